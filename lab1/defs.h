@@ -11,13 +11,19 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 
 #define MAXLINE 2048
-#define MAXBUF  1 << 21
+#define MAXBUF  (1 << 21)
 #define MAXEPOLL 64
-#define MAXCONN 64
-#define LISTENQ 64
+#define MAXCONN 16384
+#define LISTENQ 1024
+#define FDCACHE_MAX 256
+
+#define IDLE_TIMEOUT   300
+#define HEADER_TIMEOUT 10
+#define STALL_TIMEOUT  30
 
 #define OPEN_REQUEST    0xA1
 #define OPEN_REPLY      0xA2
@@ -33,6 +39,45 @@
 #define SHA_REPLY       0xAC
 #define QUIT_REQUEST    0xAD
 #define QUIT_REPLY      0xAE
+#define LISTX_REQUEST   0xAF
+#define LISTX_REPLY     0xB0
+#define COPY_REQUEST    0xB1
+#define COPY_REPLY      0xB2
+#define MOVE_REQUEST    0xB3
+#define MOVE_REPLY      0xB4
+#define HAVE_REQUEST    0xB5
+#define HAVE_REPLY      0xB6
+#define CHUNK_REQUEST   0xB7
+#define CHUNK_REPLY     0xB8
+#define MANIFEST_REQUEST 0xB9
+#define MANIFEST_REPLY  0xBA
+#define BUNDLE_REQUEST  0xBB
+#define BUNDLE_REPLY    0xBC
+#define TREE_REQUEST    0xBD
+#define TREE_REPLY      0xBE
+#define STATS_REQUEST   0xBF
+#define STATS_REPLY     0xC0
+#define BUSY_REPLY      0xFE    // any request shed by admission control
 #define FILE_DATA       0xFF
 
+// FILE_DATA status bits, only meaningful with DATA_STREAM set because
+// legacy peers leave junk in unused status fields; in a GET or PUT request
+// they are the ones the client can use, a PUT reply echoes the accepted ones
+#define DATA_STREAM     0x80    // chunked stream instead of a single frame
+#define DATA_MORE       0x01    // more frames of the stream follow
+#define DATA_CRC32C     0x02    // each frame ends with a CRC32C of its data
+#define DATA_EXTENT     0x04    // each frame starts with its 8 byte file offset,
+                                // the last one is empty and carries the size
+#define PUT_ACK         0x08    // PUT only: a second PUT_REPLY follows the data,
+                                // status 1 once it is stored as durably as configured
+#define DATA_FD         0x10    // GET over AF_UNIX only: the reply carries the file
+                                // size and the file itself as an SCM_RIGHTS descriptor
+
+#define CHUNK_SIZE      (1 << 18)
+
+// deduplicated uploads: hashes asked about per HAVE_REQUEST and CHUNK_REQUESTs
+// a client keeps in flight
+#define HAVE_BATCH      4096
+#define CHUNK_WINDOW    16
+
 #endif
\ No newline at end of file
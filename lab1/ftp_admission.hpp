@@ -0,0 +1,147 @@
+#ifndef _FTP_ADMISSION_HPP_
+#define _FTP_ADMISSION_HPP_
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// admission control: past a cap on connections, on requests queued in the
+// reactor or on uploads waiting for their fsync, or while requests wait
+// longer than they should, new work gets a BUSY_REPLY telling the client
+// when to come back instead of a place at the end of the queue; how long
+// requests wait drives the shedding the way CoDel drops packets, so a short
+// burst passes but a standing queue is drained to the target delay
+
+#define BUSY_RETRY_MIN 10   // ms
+#define BUSY_RETRY_MAX 5000 // ms
+
+// why a request was shed
+#define BUSY_CONNS 1 // too many connections, this one is closed after the reply
+#define BUSY_QUEUE 2 // too many requests ready ahead of it
+#define BUSY_SYNC  3 // too many uploads waiting to be made durable
+#define BUSY_DELAY 4 // requests wait longer than the target
+
+// BUSY_REPLY payload, big-endian
+struct busy_reply
+{
+    uint32_t retry_ms; // ask again no sooner than this
+    uint8_t reason;
+} __attribute__((packed));
+
+// the CoDel control law over request sojourn times: once they stayed above
+// target for a whole interval, shed one request, then the next after
+// interval / sqrt(count), until a request gets through below target
+struct codel
+{
+    uint64_t target_ns = 0; // 0 disables
+    uint64_t interval_ns = 100000000;
+    uint64_t first_above = 0;
+    uint64_t drop_next = 0;
+    uint32_t count = 0;
+    bool dropping = false;
+
+    uint64_t control_law(uint64_t t)
+    {
+        return t + (uint64_t)(interval_ns / sqrt((double)count));
+    }
+
+    bool ok_to_drop(uint64_t sojourn, uint64_t now)
+    {
+        if (sojourn < target_ns)
+        {
+            first_above = 0;
+            return false;
+        }
+        if (first_above == 0)
+        {
+            first_above = now + interval_ns;
+            return false;
+        }
+        return now >= first_above;
+    }
+
+    // true if the request that waited sojourn ns and is served at now
+    // should be shed
+    bool shed(uint64_t sojourn, uint64_t now)
+    {
+        if (target_ns == 0)
+        {
+            return false;
+        }
+        bool ok = ok_to_drop(sojourn, now);
+        if (dropping)
+        {
+            if (!ok)
+            {
+                dropping = false;
+                return false;
+            }
+            if (now >= drop_next)
+            {
+                ++count;
+                drop_next = control_law(drop_next);
+                return true;
+            }
+            return false;
+        }
+        if (!ok)
+        {
+            return false;
+        }
+        // a queue that comes back soon resumes near the old drop rate
+        dropping = true;
+        count = count > 2 && now - drop_next < 8 * interval_ns ? count - 2 : 1;
+        drop_next = control_law(now);
+        return true;
+    }
+};
+
+struct admission
+{
+    int max_conns = 0;   // 0s disable the caps
+    int max_queue = 0;
+    int max_sync = 0;
+    codel delay;
+    uint64_t avg_ns = 0; // moving average of the sojourn times
+    uint64_t shed[5] = {};
+
+    bool enabled()
+    {
+        return max_conns > 0 || max_queue > 0 || max_sync > 0 || delay.target_ns > 0;
+    }
+
+    // the reason to shed a request that waited sojourn ns at now behind
+    // queued others, or 0 to serve it; sync is the uploads waiting for
+    // their fsync when the request is an upload itself, else 0
+    int check(uint64_t sojourn, uint64_t now, int queued, int sync)
+    {
+        avg_ns = avg_ns - avg_ns / 8 + sojourn / 8;
+        int reason = 0;
+        if (max_queue > 0 && queued > max_queue)
+        {
+            reason = BUSY_QUEUE;
+        }
+        else if (max_sync > 0 && sync >= max_sync)
+        {
+            reason = BUSY_SYNC;
+        }
+        else if (delay.shed(sojourn, now))
+        {
+            reason = BUSY_DELAY;
+        }
+        shed[reason] += reason != 0;
+        return reason;
+    }
+
+    // when to come back: twice what requests wait now, jittered so the
+    // clients shed together don't all return at once
+    uint32_t retry_ms()
+    {
+        uint64_t ms = 2 * avg_ns / 1000000 + delay.interval_ns / 1000000;
+        ms += ms * (rand() % 50) / 100;
+        return std::min(std::max(ms, (uint64_t)BUSY_RETRY_MIN), (uint64_t)BUSY_RETRY_MAX);
+    }
+};
+
+#endif
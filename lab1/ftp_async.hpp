@@ -0,0 +1,937 @@
+#ifndef _FTP_ASYNC_HPP_
+#define _FTP_ASYNC_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+// event-driven client core, C++20 coroutines over one epoll loop: every
+// operation is a coroutine that suspends where the blocking client would
+// block, so one thread keeps many connections and transfers going at once;
+// an async_client owns a loop thread and a pool of connections to a server
+// and takes jobs from any thread; include it after ftp_utils.hpp, TCP only
+
+#define ASYNC_CONNS 4 // connections of a pool unless set otherwise
+#define ASYNC_BUSY_TRIES 5
+
+// g++ 12 mis-builds a co_await inside a condition or an operand of && and
+// ||, so the coroutines below await into a variable and test that
+
+// a lazily started coroutine producing a T; awaiting it runs it in the
+// awaiting coroutine's place, and one that finishes without suspending
+// hands control back directly, so loops over quick operations don't pile
+// up stack frames
+template <typename T>
+struct async_task
+{
+    struct promise_type
+    {
+        T value{};
+        std::coroutine_handle<> continuation;
+        bool inline_run = false; // started by await_suspend, which is still on the stack
+
+        async_task get_return_object()
+        {
+            return async_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        struct final_awaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+            {
+                promise_type &p = h.promise();
+                return p.inline_run || !p.continuation ? std::noop_coroutine() : p.continuation;
+            }
+
+            void await_resume() noexcept
+            {
+            }
+        };
+
+        final_awaiter final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_value(T v)
+        {
+            value = v;
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+
+    std::coroutine_handle<promise_type> h;
+
+    explicit async_task(std::coroutine_handle<promise_type> h) : h(h)
+    {
+    }
+
+    async_task(async_task &&other) noexcept : h(other.h)
+    {
+        other.h = nullptr;
+    }
+
+    async_task(const async_task &) = delete;
+
+    ~async_task()
+    {
+        if (h)
+        {
+            h.destroy();
+        }
+    }
+
+    bool await_ready()
+    {
+        return false;
+    }
+
+    // run it now; the caller only suspends if it did
+    bool await_suspend(std::coroutine_handle<> caller)
+    {
+        h.promise().continuation = caller;
+        h.promise().inline_run = true;
+        h.resume();
+        h.promise().inline_run = false;
+        return !h.done();
+    }
+
+    T await_resume()
+    {
+        return h.promise().value;
+    }
+};
+
+// a coroutine nobody waits for, it frees itself when it ends
+struct async_detached
+{
+    struct promise_type
+    {
+        async_detached get_return_object()
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+uint64_t async_clock_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// sockets are registered edge-triggered for both directions, a coroutine
+// tries its call first and waits for the edge only when it would block
+struct async_loop
+{
+    struct io_waiters
+    {
+        std::coroutine_handle<> in;
+        std::coroutine_handle<> out;
+    };
+
+    int epfd = -1;
+    int efd = -1;
+    std::unordered_map<int, io_waiters> waiters;
+    std::multimap<uint64_t, std::coroutine_handle<>> timers;
+    std::mutex lock;
+    std::vector<std::function<void()>> posted;
+    bool stopped = false;
+
+    int start()
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = efd;
+        if (epfd < 0 || efd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev) < 0)
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    int add(int fd)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void remove(int fd)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        waiters.erase(fd);
+    }
+
+    struct io_awaiter
+    {
+        async_loop *loop;
+        int fd;
+        bool out;
+
+        bool await_ready()
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            io_waiters &w = loop->waiters[fd];
+            (out ? w.out : w.in) = h;
+        }
+
+        void await_resume()
+        {
+        }
+    };
+
+    io_awaiter readable(int fd)
+    {
+        return {this, fd, false};
+    }
+
+    io_awaiter writable(int fd)
+    {
+        return {this, fd, true};
+    }
+
+    struct sleep_awaiter
+    {
+        async_loop *loop;
+        uint64_t until;
+
+        bool await_ready()
+        {
+            return async_clock_ms() >= until;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            loop->timers.emplace(until, h);
+        }
+
+        void await_resume()
+        {
+        }
+    };
+
+    sleep_awaiter sleep(uint32_t ms)
+    {
+        return {this, async_clock_ms() + ms};
+    }
+
+    // run fn on the loop thread, from any thread
+    void post(std::function<void()> fn)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            posted.push_back(std::move(fn));
+        }
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) < 0)
+        {
+            serror("wake event loop error");
+        }
+    }
+
+    // resume whatever one epoll_wait made ready
+    void run_once()
+    {
+        int timeout = -1;
+        if (!timers.empty())
+        {
+            uint64_t now = async_clock_ms();
+            timeout = timers.begin()->first > now ? (int)(timers.begin()->first - now) : 0;
+        }
+        struct epoll_event events[64];
+        int n = epoll_wait(epfd, events, 64, timeout);
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == efd)
+            {
+                uint64_t count;
+                while (read(efd, &count, sizeof(count)) > 0)
+                {
+                }
+                std::vector<std::function<void()>> fns;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    fns.swap(posted);
+                }
+                for (auto &fn : fns)
+                {
+                    fn();
+                }
+                continue;
+            }
+            auto it = waiters.find(fd);
+            if (it == waiters.end())
+            {
+                continue;
+            }
+            // a resumed coroutine may close fd and drop its waiters
+            uint32_t e = events[i].events;
+            std::coroutine_handle<> in, out;
+            if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                std::swap(in, it->second.in);
+            }
+            if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            {
+                std::swap(out, it->second.out);
+            }
+            if (in)
+            {
+                in.resume();
+            }
+            if (out)
+            {
+                out.resume();
+            }
+        }
+        uint64_t now = async_clock_ms();
+        while (!timers.empty() && timers.begin()->first <= now)
+        {
+            std::coroutine_handle<> h = timers.begin()->second;
+            timers.erase(timers.begin());
+            h.resume();
+        }
+    }
+
+    void run()
+    {
+        while (!stopped)
+        {
+            run_once();
+        }
+    }
+};
+
+// one session with a server, one operation at a time
+struct async_conn
+{
+    async_loop &loop;
+    int fd = -1;
+    uint32_t busy_ms = 0; // retry-after of the last BUSY_REPLY
+
+    async_conn(async_loop &loop) : loop(loop)
+    {
+    }
+
+    ~async_conn()
+    {
+        close();
+    }
+
+    void close()
+    {
+        if (fd >= 0)
+        {
+            loop.remove(fd);
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    async_task<int> read_exact(void *buf, size_t size)
+    {
+        for (size_t done = 0; done < size;)
+        {
+            ssize_t b = recv(fd, (char *)buf + done, size - done, 0);
+            if (b < 0 && (errno == EAGAIN || errno == EINTR))
+            {
+                co_await loop.readable(fd);
+                continue;
+            }
+            if (b <= 0)
+            {
+                co_return serror(b == 0 ? "socket closed" : "srecv error");
+            }
+            done += b;
+        }
+        co_return (int)size;
+    }
+
+    async_task<int> write_exact(const void *buf, size_t size, int flags = 0)
+    {
+        for (size_t done = 0; done < size;)
+        {
+            ssize_t b = send(fd, (const char *)buf + done, size - done, flags | MSG_NOSIGNAL);
+            if (b < 0 && (errno == EAGAIN || errno == EINTR))
+            {
+                co_await loop.writable(fd);
+                continue;
+            }
+            if (b < 0)
+            {
+                co_return serror("ssend error");
+            }
+            done += b;
+        }
+        co_return (int)size;
+    }
+
+    async_task<int> send_frame(type t, const void *buf, uint32_t size, status s)
+    {
+        struct ftp_header header(t, HEADER_SIZE + size, s);
+        int scode = co_await write_exact(&header, HEADER_SIZE, size > 0 ? MSG_MORE : 0);
+        if (scode >= 0 && size > 0)
+        {
+            scode = co_await write_exact(buf, size);
+        }
+        co_return scode < 0 ? -1 : 0;
+    }
+
+    // the header of the next frame, its payload is left to read
+    async_task<int> recv_header(struct ftp_header *header)
+    {
+        int scode = co_await read_exact(header, HEADER_SIZE);
+        if (scode < 0)
+        {
+            co_return -1;
+        }
+        co_return (int)(ntohl(header->m_length) - HEADER_SIZE);
+    }
+
+    // a whole frame, its payload into out
+    async_task<int> recv_frame(type *t, status *s, std::string &out)
+    {
+        struct ftp_header header;
+        int length = co_await recv_header(&header);
+        if (length < 0 || length > (MAXBUF))
+        {
+            co_return -1;
+        }
+        out.resize(length);
+        if (length > 0)
+        {
+            int scode = co_await read_exact(&out[0], length);
+            if (scode < 0)
+            {
+                co_return -1;
+            }
+        }
+        *t = header.m_type;
+        *s = header.m_status;
+        busy_ms = 0;
+        if (*t == BUSY_REPLY && length >= (int)sizeof(uint32_t))
+        {
+            uint32_t ms;
+            memcpy(&ms, out.data(), sizeof(ms));
+            busy_ms = std::max(ntohl(ms), 1U);
+        }
+        co_return length;
+    }
+
+    async_task<int> open(const std::string &ip, int port)
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1)
+        {
+            co_return serror("inet_pton error");
+        }
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || loop.add(fd) < 0)
+        {
+            close();
+            co_return serror("socket error");
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            if (errno != EINPROGRESS)
+            {
+                close();
+                co_return serror("connect error");
+            }
+            co_await loop.writable(fd);
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+            {
+                close();
+                co_return serror("connect error");
+            }
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        type t;
+        status s;
+        std::string reply;
+        int scode = co_await send_frame(OPEN_REQUEST, nullptr, 0, 0);
+        if (scode == 0)
+        {
+            scode = co_await recv_frame(&t, &s, reply);
+        }
+        if (scode < 0 || t != OPEN_REPLY || s != 1)
+        {
+            close();
+            co_return busy_ms ? -1 : serror("bad open reply");
+        }
+        co_return 0;
+    }
+
+    // download remote into local as DATA_STREAM frames, or the one frame a
+    // legacy server sends; progress counts the bytes written
+    async_task<int> get(const std::string &remote, const std::string &local,
+                        std::atomic<uint64_t> *progress)
+    {
+        type t;
+        status s;
+        std::string reply;
+        int scode = co_await send_frame(GET_REQUEST, remote.c_str(), remote.size() + 1, DATA_STREAM);
+        if (scode == 0)
+        {
+            scode = co_await recv_frame(&t, &s, reply);
+        }
+        if (scode < 0)
+        {
+            co_return -1;
+        }
+        if (t != GET_REPLY || s != 1)
+        {
+            co_return busy_ms ? -1 : serror("bad get reply");
+        }
+
+        // the data is still drained if the file can't be opened
+        int filefd = ::open(local.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (filefd < 0)
+        {
+            serror("open file error (w)");
+        }
+        std::vector<char> buf(CHUNK_SIZE);
+        off_t offset = 0;
+        bool more = true;
+        while (more)
+        {
+            struct ftp_header header;
+            int length = co_await recv_header(&header);
+            if (length < 0 || header.m_type != FILE_DATA)
+            {
+                break;
+            }
+            more = (header.m_status & DATA_STREAM) && (header.m_status & DATA_MORE);
+            while (length > 0)
+            {
+                int n = std::min(length, (int)buf.size());
+                int got = co_await read_exact(buf.data(), n);
+                if (got < 0)
+                {
+                    length = -1;
+                    break;
+                }
+                if (filefd >= 0 && pwrite(filefd, buf.data(), n, offset) != n)
+                {
+                    ::close(filefd);
+                    filefd = -1;
+                    serror("write file error");
+                }
+                offset += n;
+                length -= n;
+                if (progress)
+                {
+                    *progress += n;
+                }
+            }
+            if (length < 0)
+            {
+                break;
+            }
+        }
+        if (filefd >= 0)
+        {
+            ::close(filefd);
+        }
+        co_return more || filefd < 0 ? serror("recv file data error") : 0;
+    }
+
+    // upload local as remote, streamed if the server takes DATA_STREAM
+    async_task<int> put(const std::string &local, const std::string &remote,
+                        std::atomic<uint64_t> *progress)
+    {
+        int filefd = ::open(local.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (filefd < 0 || fstat(filefd, &st) < 0)
+        {
+            if (filefd >= 0)
+            {
+                ::close(filefd);
+            }
+            co_return serror("open file error (r)");
+        }
+        type t;
+        status s;
+        std::string reply;
+        int scode = co_await send_frame(PUT_REQUEST, remote.c_str(), remote.size() + 1, DATA_STREAM);
+        if (scode == 0)
+        {
+            scode = co_await recv_frame(&t, &s, reply);
+        }
+        if (scode < 0 || t != PUT_REPLY)
+        {
+            ::close(filefd);
+            co_return busy_ms ? -1 : serror("bad put reply");
+        }
+
+        // a legacy server takes the file as a single frame
+        bool stream = s & DATA_STREAM;
+        off_t size = st.st_size;
+        size_t frame = stream ? CHUNK_SIZE : size;
+        std::vector<char> buf(std::min(frame, (size_t)CHUNK_SIZE));
+        scode = 0;
+        off_t offset = 0;
+        do
+        {
+            uint32_t length = std::min((off_t)frame, size - offset);
+            status flags = stream ? DATA_STREAM | (offset + length < size ? DATA_MORE : 0) : 0;
+            struct ftp_header header(FILE_DATA, HEADER_SIZE + length, flags);
+            int sent = co_await write_exact(&header, HEADER_SIZE, length > 0 ? MSG_MORE : 0);
+            if (sent < 0)
+            {
+                scode = -1;
+                break;
+            }
+            for (uint32_t done = 0; scode == 0 && done < length;)
+            {
+                ssize_t n = pread(filefd, buf.data(), std::min((size_t)(length - done), buf.size()),
+                                  offset + done);
+                if (n <= 0)
+                {
+                    scode = -1;
+                    break;
+                }
+                sent = co_await write_exact(buf.data(), n);
+                if (sent < 0)
+                {
+                    scode = -1;
+                    break;
+                }
+                done += n;
+                if (progress)
+                {
+                    *progress += n;
+                }
+            }
+            offset += length;
+        } while (scode == 0 && offset < size);
+        ::close(filefd);
+        co_return scode < 0 ? serror("send file data error") : 0;
+    }
+
+    async_task<int> ls(std::string &out)
+    {
+        type t;
+        status s;
+        int scode = co_await send_frame(LIST_REQUEST, nullptr, 0, 0);
+        if (scode == 0)
+        {
+            scode = co_await recv_frame(&t, &s, out);
+        }
+        if (scode < 0 || t != LIST_REPLY)
+        {
+            co_return busy_ms ? -1 : serror("bad ls reply");
+        }
+        out.resize(strnlen(out.data(), out.size()));
+        co_return 0;
+    }
+
+    async_task<int> quit()
+    {
+        type t;
+        status s;
+        std::string reply;
+        int scode = co_await send_frame(QUIT_REQUEST, nullptr, 0, 0);
+        if (scode == 0)
+        {
+            scode = co_await recv_frame(&t, &s, reply);
+        }
+        close();
+        co_return scode < 0 ? -1 : 0;
+    }
+};
+
+#define JOB_QUEUED  0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+#define JOB_FAILED  3
+
+// a transfer handed to an async_client
+struct async_job
+{
+    int id = 0;
+    std::string op; // "get" or "put"
+    std::string remote;
+    std::string local;
+    std::atomic<int> state{JOB_QUEUED};
+    std::atomic<uint64_t> bytes{0};
+    uint64_t start_ms = 0;
+    uint64_t end_ms = 0;
+};
+
+// a loop thread with a pool of up to max_conns connections to ip:port;
+// jobs queue for a free connection, and a connection the server turned
+// away for being busy is tried again when it says
+struct async_client
+{
+    async_loop loop;
+    std::string ip;
+    int port = 0;
+    int max_conns = ASYNC_CONNS;
+    int conns = 0; // open or being opened
+    std::vector<std::unique_ptr<async_conn>> pool;
+    std::vector<async_conn *> idle;
+    std::deque<std::coroutine_handle<>> waiting;
+    std::thread thread;
+
+    // jobs not finished yet, shared with the submitting threads
+    std::mutex lock;
+    std::condition_variable finished;
+    int pending = 0;
+
+    int start(const std::string &ip_, int port_)
+    {
+        ip = ip_;
+        port = port_;
+        if (loop.start() < 0)
+        {
+            return -1;
+        }
+        thread = std::thread([this]() { loop.run(); });
+        return 0;
+    }
+
+    bool started()
+    {
+        return thread.joinable();
+    }
+
+    struct conn_waiter
+    {
+        async_client *client;
+
+        bool await_ready()
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            client->waiting.push_back(h);
+        }
+
+        void await_resume()
+        {
+        }
+    };
+
+    // an open connection of the pool, nullptr if one can't be opened
+    async_task<async_conn *> acquire()
+    {
+        while (true)
+        {
+            if (!idle.empty())
+            {
+                async_conn *c = idle.back();
+                idle.pop_back();
+                co_return c;
+            }
+            if (conns < max_conns)
+            {
+                ++conns;
+                pool.push_back(std::make_unique<async_conn>(loop));
+                async_conn *c = pool.back().get();
+                for (int tries = 1;; ++tries)
+                {
+                    int scode = co_await c->open(ip, port);
+                    if (scode == 0)
+                    {
+                        co_return c;
+                    }
+                    if (c->busy_ms == 0 || tries == ASYNC_BUSY_TRIES)
+                    {
+                        drop(c);
+                        co_return nullptr;
+                    }
+                    co_await loop.sleep(c->busy_ms);
+                }
+            }
+            co_await conn_waiter{this};
+        }
+    }
+
+    // give c back to the pool, or close it if it is no good any more
+    void release(async_conn *c, bool ok)
+    {
+        if (ok && c->fd >= 0)
+        {
+            idle.push_back(c);
+            wake();
+        }
+        else
+        {
+            drop(c);
+        }
+    }
+
+    // close c and free its place in the pool, also when it never opened:
+    // a job waiting for a connection has to try opening one in its turn
+    void drop(async_conn *c)
+    {
+        --conns;
+        for (auto it = pool.begin(); it != pool.end(); ++it)
+        {
+            if (it->get() == c)
+            {
+                pool.erase(it);
+                break;
+            }
+        }
+        wake();
+    }
+
+    // let the longest waiting job look for a connection again
+    void wake()
+    {
+        if (!waiting.empty())
+        {
+            std::coroutine_handle<> h = waiting.front();
+            waiting.pop_front();
+            loop.post([h]() { h.resume(); });
+        }
+    }
+
+    async_detached run_job(std::shared_ptr<async_job> job)
+    {
+        int scode = -1;
+        async_conn *c = co_await acquire();
+        job->start_ms = async_clock_ms();
+        job->state = JOB_RUNNING;
+        for (int tries = 1; c != nullptr; ++tries)
+        {
+            if (job->op == "get")
+            {
+                scode = co_await c->get(job->remote, job->local, &job->bytes);
+            }
+            else
+            {
+                scode = co_await c->put(job->local, job->remote, &job->bytes);
+            }
+            if (scode == 0 || c->busy_ms == 0 || tries == ASYNC_BUSY_TRIES)
+            {
+                break;
+            }
+            job->bytes = 0;
+            co_await loop.sleep(c->busy_ms);
+        }
+        if (c != nullptr)
+        {
+            // a transfer cut short leaves the stream out of step
+            release(c, scode == 0 || c->busy_ms != 0);
+        }
+        job->end_ms = async_clock_ms();
+        job->state = scode == 0 ? JOB_DONE : JOB_FAILED;
+        std::lock_guard<std::mutex> guard(lock);
+        --pending;
+        finished.notify_all();
+    }
+
+    // run job on the loop thread, callable from any thread
+    void submit(std::shared_ptr<async_job> job)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ++pending;
+        }
+        loop.post([this, job]() { run_job(job); });
+    }
+
+    // block until every submitted job has finished
+    void wait()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [this]() { return pending == 0; });
+    }
+
+    async_detached quit_all()
+    {
+        while (!idle.empty())
+        {
+            async_conn *c = idle.back();
+            idle.pop_back();
+            co_await c->quit();
+            drop(c);
+        }
+        loop.stopped = true;
+    }
+
+    // end the sessions once the jobs are done and stop the loop thread
+    void stop()
+    {
+        if (!started())
+        {
+            return;
+        }
+        wait();
+        loop.post([this]() { quit_all(); });
+        thread.join();
+    }
+};
+
+#endif
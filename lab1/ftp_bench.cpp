@@ -0,0 +1,487 @@
+#include <defs.h>
+#include <ftp_utils.hpp>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <sys/mman.h>
+#include <vector>
+
+// throughput benchmarks for the data path, numbers go to stdout
+
+double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int bench_crc(int argc, char **argv)
+{
+    size_t size = (argc > 0 ? atoi(argv[0]) : 64) << 20;
+    std::vector<char> buf(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        buf[i] = (char)(i * 2654435761u >> 13);
+    }
+
+    // known answer and cross check of both implementations
+    if (crc32c_sw(0, "123456789", 9) != 0xE3069283 ||
+        crc32c(0, "123456789", 9) != 0xE3069283)
+    {
+        return serror("crc32c check value mismatch");
+    }
+    for (size_t n = 0; n < 65536 && n < size - 13; n += n < 4096 ? 7 : 4093)
+    {
+        if (crc32c_sw(0, buf.data() + n % 13, n) != crc32c(0, buf.data() + n % 13, n))
+        {
+            return serror("crc32c implementations disagree");
+        }
+    }
+
+    struct
+    {
+        const char *name;
+        uint32_t (*fn)(uint32_t, const void *, size_t);
+    } impls[] = {
+        {"slicing-by-8", crc32c_sw},
+        {crc32c_hw_supported() ? "hardware" : "hardware (unsupported, sw)", crc32c_hw},
+    };
+    for (auto &impl : impls)
+    {
+        uint32_t crc = 0;
+        double start = now_sec();
+        for (int r = 0; r < 4; ++r)
+        {
+            crc = impl.fn(crc, buf.data(), size);
+        }
+        double secs = now_sec() - start;
+        printf("crc32c %-28s %8.2f GB/s\n", impl.name, 4.0 * size / secs / 1e9);
+    }
+    return 0;
+}
+
+// a connected pair of loopback TCP sockets
+int tcp_pair(int *sendfd, int *recvfd)
+{
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenfd, 1) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &len) < 0)
+    {
+        close(listenfd);
+        return serror("listen error");
+    }
+    *sendfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*sendfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(listenfd);
+        return serror("connect error");
+    }
+    *recvfd = accept(listenfd, nullptr, nullptr);
+    close(listenfd);
+    return 0;
+}
+
+// stream a file over loopback TCP into /dev/null with each set of flags
+int bench_stream(int argc, char **argv)
+{
+    if (argc < 1)
+    {
+        return serror("usage: ftp_bench stream <file> [rounds]");
+    }
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+    int filefd = open(argv[0], O_RDONLY);
+    struct stat st;
+    if (filefd < 0 || fstat(filefd, &st) < 0)
+    {
+        return serror("open file error (r)");
+    }
+
+    int sendfd, recvfd;
+    if (tcp_pair(&sendfd, &recvfd) < 0)
+    {
+        return -1;
+    }
+    int nullfd = open("/dev/null", O_WRONLY);
+
+    struct
+    {
+        const char *name;
+        status flags;
+    } modes[] = {
+        {"stream", DATA_STREAM},
+        {"stream+crc32c", DATA_STREAM | DATA_CRC32C},
+    };
+    for (auto &mode : modes)
+    {
+        double best = 0;
+        for (int r = 0; r < rounds; ++r)
+        {
+            off_t got = 0;
+            std::thread receiver([&]()
+                                 { got = recv_stream(recvfd, nullfd); });
+            double start = now_sec();
+            send_stream(sendfd, filefd, st.st_size, mode.flags);
+            receiver.join();
+            double secs = now_sec() - start;
+            if (got != st.st_size)
+            {
+                return serror("stream size mismatch");
+            }
+            best = std::max(best, st.st_size / secs / 1e6);
+        }
+        printf("%-16s %10.1f MB/s (best of %d)\n", mode.name, best, rounds);
+    }
+    close(sendfd);
+    close(recvfd);
+    close(nullfd);
+    close(filefd);
+    return 0;
+}
+
+// read every word of the size bytes the passed descriptor holds through a
+// mapping, the way a client uses a file handed over by DATA_FD
+off_t read_passed(int recvfd)
+{
+    char buf[64];
+    type t;
+    status s;
+    int passfd;
+    uint64_t size;
+    if (recv_post_fd(recvfd, buf, &t, &s, &passfd) != sizeof(size) || passfd < 0)
+    {
+        return -1;
+    }
+    memcpy(&size, buf, sizeof(size));
+    size = be64toh(size);
+    const uint64_t *map = (const uint64_t *)mmap(nullptr, size, PROT_READ, MAP_SHARED, passfd, 0);
+    close(passfd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < size / sizeof(uint64_t); ++i)
+    {
+        sum ^= map[i];
+    }
+    [[maybe_unused]] static volatile uint64_t sink;
+    sink = sum;
+    munmap((void *)map, size);
+    return size;
+}
+
+// same host transfers of a cached file: streamed over loopback TCP and a
+// unix socket into /dev/null, and passed over the unix socket as a descriptor
+int bench_local(int argc, char **argv)
+{
+    if (argc < 1)
+    {
+        return serror("usage: ftp_bench local <file> [rounds]");
+    }
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+    int filefd = open(argv[0], O_RDONLY);
+    struct stat st;
+    if (filefd < 0 || fstat(filefd, &st) < 0)
+    {
+        return serror("open file error (r)");
+    }
+
+    int tcp[2], uds[2];
+    if (tcp_pair(&tcp[0], &tcp[1]) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, uds) < 0)
+    {
+        return serror("socket pair error");
+    }
+    int nullfd = open("/dev/null", O_WRONLY);
+
+    struct
+    {
+        const char *name;
+        int *pair;
+        bool pass;
+    } modes[] = {
+        {"tcp loopback", tcp, false},
+        {"unix socket", uds, false},
+        {"unix fd passing", uds, true},
+    };
+    for (auto &mode : modes)
+    {
+        double best = 0;
+        for (int r = 0; r < rounds; ++r)
+        {
+            off_t got = 0;
+            int recvfd = mode.pair[1];
+            std::thread receiver([&]()
+                                 { got = mode.pass ? read_passed(recvfd) : recv_stream(recvfd, nullfd); });
+            double start = now_sec();
+            uint64_t size = htobe64(st.st_size);
+            if (mode.pass)
+            {
+                send_post_fd(mode.pair[0], GET_REPLY, &size, sizeof(size), 1 | DATA_FD, filefd);
+            }
+            else
+            {
+                send_stream(mode.pair[0], filefd, st.st_size, DATA_STREAM);
+            }
+            receiver.join();
+            double secs = now_sec() - start;
+            if (got != st.st_size)
+            {
+                return serror("transfer size mismatch");
+            }
+            best = std::max(best, st.st_size / secs / 1e9);
+        }
+        printf("%-16s %8.2f GB/s (best of %d)\n", mode.name, best, rounds);
+    }
+    for (int fd : {tcp[0], tcp[1], uds[0], uds[1], nullfd, filefd})
+    {
+        close(fd);
+    }
+    return 0;
+}
+
+// connect and open a session with a running server
+int bench_connect(const char *ip, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    char buf[64];
+    type t;
+    busy_retry_ms = 0;
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        send_post(fd, OPEN_REQUEST) < 0 || recv_post(fd, buf, &t) < 0 || t != OPEN_REPLY)
+    {
+        close(fd);
+        return busy_retry_ms ? -1 : serror("connect error");
+    }
+    return fd;
+}
+
+// upload files files as bench.<c>.<n>, each waiting for its PUT_ACK
+int bench_put_conn(const char *ip, int port, int c, int files, int datafd, off_t size)
+{
+    int fd = bench_connect(ip, port);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    char buf[64];
+    type t;
+    status s;
+    int scode = 0;
+    for (int i = 0; scode == 0 && i < files; ++i)
+    {
+        char name[64];
+        int len = sprintf(name, "bench.%d.%d", c, i) + 1;
+        if (send_post(fd, PUT_REQUEST, name, len, DATA_STREAM | PUT_ACK) < 0 ||
+            recv_post(fd, buf, &t, &s) < 0 || (s & PUT_ACK) == 0 ||
+            send_stream(fd, datafd, size, DATA_STREAM) < 0 ||
+            recv_post(fd, buf, &t, &s) < 0 || s != 1)
+        {
+            scode = -1;
+        }
+    }
+    send_post(fd, QUIT_REQUEST);
+    recv_post(fd, buf, &t);
+    close(fd);
+    return scode;
+}
+
+// acknowledged uploads per second against a running server, from conns
+// connections at once; run it against each durability setting
+int bench_put(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        return serror("usage: ftp_bench put <IPaddr> <Port> [conns] [files] [bytes]");
+    }
+    int conns = argc > 2 ? atoi(argv[2]) : 8;
+    int files = argc > 3 ? atoi(argv[3]) : 200;
+    off_t size = argc > 4 ? atoi(argv[4]) : 4096;
+
+    // every upload sends the same bytes from memory
+    int datafd = memfd_create("ftp_bench", 0);
+    std::vector<char> data(size, 'x');
+    if (datafd < 0 || swrite(datafd, data.data(), size) < 0)
+    {
+        return serror("create upload data error");
+    }
+
+    std::atomic<int> failed{0};
+    std::vector<std::thread> threads;
+    double start = now_sec();
+    for (int c = 0; c < conns; ++c)
+    {
+        threads.emplace_back([&, c]()
+                             { failed += bench_put_conn(argv[0], atoi(argv[1]), c, files, datafd, size) < 0; });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    double secs = now_sec() - start;
+    close(datafd);
+    if (failed > 0)
+    {
+        return serror("uploads failed, does the server support PUT_ACK?");
+    }
+    printf("put %d conns x %d files of %lld bytes: %10.1f uploads/s\n", conns, files,
+           (long long)size, conns * files / secs);
+    return 0;
+}
+
+struct load_stats
+{
+    long good = 0;   // downloads done within the deadline
+    long late = 0;   // done, but too late to be of use
+    long busy = 0;   // BUSY_REPLYs
+    long failed = 0; // connections lost
+    std::vector<double> latency;
+};
+
+// one client of bench_load: downloads name until stop, coming back when
+// the server says to; a download takes from its first try to its last byte
+void bench_load_conn(const char *ip, int port, const char *name, double deadline, double stop,
+                     load_stats &st)
+{
+    char buf[64];
+    type t;
+    status s;
+    int fd = -1;
+    double start = now_sec();
+    while (now_sec() < stop)
+    {
+        if (fd < 0 && (fd = bench_connect(ip, port)) < 0)
+        {
+            st.busy += busy_retry_ms != 0;
+            st.failed += busy_retry_ms == 0;
+            usleep(busy_retry_ms ? busy_retry_ms * 1000 : 100000);
+            continue;
+        }
+        busy_retry_ms = 0;
+        if (send_post(fd, GET_REQUEST, (void *)name, strlen(name) + 1, DATA_STREAM) < 0 ||
+            recv_post(fd, buf, &t, &s) < 0 ||
+            (t == GET_REPLY && (s != 1 || recv_stream(fd, -1) < 0)))
+        {
+            st.failed++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if (t == BUSY_REPLY)
+        {
+            st.busy++;
+            usleep(busy_retry_ms * 1000);
+            continue;
+        }
+        double end = now_sec();
+        st.latency.push_back(end - start);
+        if (end - start <= deadline)
+        {
+            st.good++;
+        }
+        else
+        {
+            st.late++;
+        }
+        start = end;
+    }
+    if (fd >= 0)
+    {
+        send_post(fd, QUIT_REQUEST);
+        recv_post(fd, buf, &t);
+        close(fd);
+    }
+}
+
+// downloads of file a running server completes within a deadline per
+// second, with conns clients asking at once; goodput should hold up as
+// conns grows past what the server can serve when it sheds load
+int bench_load(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        return serror("usage: ftp_bench load <IPaddr> <Port> <file> [conns] [seconds] [deadline ms]");
+    }
+    int conns = argc > 3 ? atoi(argv[3]) : 8;
+    double secs = argc > 4 ? atof(argv[4]) : 10;
+    double deadline = (argc > 5 ? atof(argv[5]) : 1000) / 1000;
+    struct stat st;
+    if (stat(argv[2], &st) < 0)
+    {
+        return serror("stat file error, run it in the server directory");
+    }
+
+    std::vector<load_stats> stats(conns);
+    std::vector<std::thread> threads;
+    double stop = now_sec() + secs;
+    for (int c = 0; c < conns; ++c)
+    {
+        threads.emplace_back([&, c]()
+                             { bench_load_conn(argv[0], atoi(argv[1]), argv[2], deadline, stop, stats[c]); });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    load_stats all;
+    for (auto &s : stats)
+    {
+        all.good += s.good;
+        all.late += s.late;
+        all.busy += s.busy;
+        all.failed += s.failed;
+        all.latency.insert(all.latency.end(), s.latency.begin(), s.latency.end());
+    }
+    std::sort(all.latency.begin(), all.latency.end());
+    auto pct = [&](double p)
+    { return all.latency.empty() ? 0 : all.latency[(size_t)(p * (all.latency.size() - 1))] * 1000; };
+    printf("load %d conns: %8.1f good/s %8.1f MB/s goodput, %ld late, %ld busy, %ld failed, "
+           "latency p50 %.1f ms p99 %.1f ms\n",
+           conns, all.good / secs, all.good * (double)st.st_size / secs / (1 << 20), all.late,
+           all.busy, all.failed, pct(0.5), pct(0.99));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: ftp_bench crc [MiB] | stream <file> [rounds] | local <file> [rounds] |\n"
+               "       put <IPaddr> <Port> [conns] [files] [bytes] |\n"
+               "       load <IPaddr> <Port> <file> [conns] [seconds] [deadline ms]\n");
+        return 0;
+    }
+    if (strcmp(argv[1], "put") == 0)
+    {
+        return bench_put(argc - 2, argv + 2) < 0;
+    }
+    if (strcmp(argv[1], "load") == 0)
+    {
+        return bench_load(argc - 2, argv + 2) < 0;
+    }
+    if (strcmp(argv[1], "crc") == 0)
+    {
+        return bench_crc(argc - 2, argv + 2) < 0;
+    }
+    if (strcmp(argv[1], "stream") == 0)
+    {
+        return bench_stream(argc - 2, argv + 2) < 0;
+    }
+    if (strcmp(argv[1], "local") == 0)
+    {
+        return bench_local(argc - 2, argv + 2) < 0;
+    }
+    printf("unknown benchmark: %s\n", argv[1]);
+    return 1;
+}
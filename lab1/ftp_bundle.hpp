@@ -0,0 +1,240 @@
+#ifndef _FTP_BUNDLE_HPP_
+#define _FTP_BUNDLE_HPP_
+
+#include <string>
+#include <filesystem>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// many files in one reply: the files are laid out back to back as a
+// bundle_entry, the name without terminator and the data, and that byte
+// stream is cut into DATA_STREAM frames regardless of file boundaries;
+// small files are packed together so a frame carries many of them, all
+// fields are big-endian
+
+#define BUNDLE_BATCH CHUNK_SIZE
+
+struct bundle_entry
+{
+    uint64_t size;
+    uint32_t mode;
+    uint16_t name_len;
+} __attribute__((packed));
+
+struct bundle_writer
+{
+    int fd;
+    size_t used = 0;
+    uint64_t files = 0;
+    char buf[BUNDLE_BATCH];
+
+    bundle_writer(int fd_) : fd(fd_) {}
+
+    // frame what is buffered in one writev, the last frame ends the bundle
+    int flush(bool last)
+    {
+        struct ftp_header header(FILE_DATA, HEADER_SIZE + used,
+                                 last ? DATA_STREAM : DATA_STREAM | DATA_MORE);
+        struct iovec iov[2] = {{&header, HEADER_SIZE}, {buf, used}};
+        uint64_t start = tracing() ? trace_clock() : 0;
+        int scode = ssendv(fd, iov, 2);
+        if (start)
+        {
+            trace(start, fd, TRACE_SEND, FILE_DATA, header.m_status, used, scode >= 0);
+        }
+        used = 0;
+        return scode < 0 ? -1 : 0;
+    }
+
+    // the entry of a file of size bytes, all of which has to follow
+    int entry(const char *name, uint64_t size, mode_t mode)
+    {
+        struct bundle_entry e;
+        size_t len = strlen(name);
+        e.size = htobe64(size);
+        e.mode = htobe32(mode);
+        e.name_len = htobe16(len);
+        if (used + sizeof(e) + len > sizeof(buf) && flush(false) < 0)
+        {
+            return -1;
+        }
+        memcpy(buf + used, &e, sizeof(e));
+        memcpy(buf + used + sizeof(e), name, len);
+        used += sizeof(e) + len;
+        ++files;
+        return 0;
+    }
+
+    // the first size bytes of filefd as the next data in the bundle
+    int data(int filefd, off_t size)
+    {
+        // small files are copied into the batch, a file that changed size
+        // since the stat is cut or zero padded to keep the stream in step
+        if (used + size <= sizeof(buf))
+        {
+            off_t got = 0;
+            while (got < size)
+            {
+                ssize_t n = pread(filefd, buf + used + got, size - got, got);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    serror("bundled file changed");
+                    memset(buf + used + got, 0, size - got);
+                    break;
+                }
+                got += n;
+            }
+            used += size;
+            return 0;
+        }
+
+        // big ones go out in frames of their own straight from the page cache
+        if (flush(false) < 0)
+        {
+            return -1;
+        }
+        for (off_t offset = 0; offset < size;)
+        {
+            int n = std::min(size - offset, (off_t)BUNDLE_BATCH);
+            if (send_file(fd, FILE_DATA, filefd, offset, n, DATA_STREAM | DATA_MORE) < 0)
+            {
+                return -1;
+            }
+            offset += n;
+        }
+        return 0;
+    }
+
+    int add(const char *name, int filefd, const struct stat &st)
+    {
+        return entry(name, st.st_size, st.st_mode) < 0 ? -1 : data(filefd, st.st_size);
+    }
+};
+
+// unpacks a bundle fed in arbitrary pieces into the working directory;
+// names that are absolute or climb out of it are skipped
+struct bundle_reader
+{
+    char head[sizeof(bundle_entry) + UINT16_MAX + 1];
+    size_t have = 0;
+    uint64_t left = 0;
+    bool in_data = false;
+    int filefd = -1;
+    uint64_t files = 0, bytes = 0;
+    bool bad = false;
+
+    ~bundle_reader()
+    {
+        if (filefd >= 0)
+        {
+            close(filefd);
+        }
+    }
+
+    void feed(const char *p, size_t n)
+    {
+        while (n > 0)
+        {
+            if (in_data)
+            {
+                size_t m = std::min((uint64_t)n, left);
+                if (filefd >= 0 && swrite(filefd, (void *)p, m) < 0)
+                {
+                    bad = true;
+                    close(filefd);
+                    filefd = -1;
+                }
+                p += m;
+                n -= m;
+                left -= m;
+                bytes += m;
+                if (left == 0)
+                {
+                    finish();
+                }
+                continue;
+            }
+
+            // the entry first, then as much of the name as it announces
+            struct bundle_entry e;
+            size_t need = sizeof(e);
+            if (have >= sizeof(e))
+            {
+                memcpy(&e, head, sizeof(e));
+                need += be16toh(e.name_len);
+            }
+            size_t m = std::min(n, need - have);
+            memcpy(head + have, p, m);
+            have += m;
+            p += m;
+            n -= m;
+            if (have == sizeof(e))
+            {
+                memcpy(&e, head, sizeof(e));
+                need += be16toh(e.name_len);
+            }
+            if (have == need)
+            {
+                start(be64toh(e.size), be32toh(e.mode),
+                      std::string(head + sizeof(e), be16toh(e.name_len)));
+            }
+        }
+    }
+
+    // true if the bundle ended on an entry boundary
+    bool complete()
+    {
+        return !in_data && have == 0;
+    }
+
+private:
+    void start(uint64_t size, mode_t mode, const std::string &name)
+    {
+        namespace fs = std::filesystem;
+        fs::path path = fs::path(name).lexically_normal();
+        bool safe = !name.empty() && path.is_relative() && *path.begin() != "..";
+        std::error_code ec;
+        if (!safe)
+        {
+            serror("unsafe bundle name");
+            bad = true;
+        }
+        else if (path.has_parent_path())
+        {
+            fs::create_directories(path.parent_path(), ec);
+        }
+        if (safe && (filefd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode & 0777)) < 0)
+        {
+            serror("open file error (w)");
+            bad = true;
+        }
+        have = 0;
+        left = size;
+        in_data = true;
+        ++files;
+        if (left == 0)
+        {
+            finish();
+        }
+    }
+
+    void finish()
+    {
+        if (filefd >= 0)
+        {
+            close(filefd);
+            filefd = -1;
+        }
+        in_data = false;
+    }
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef _FTP_CAPTURE_HPP_
+#define _FTP_CAPTURE_HPP_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// request capture for ftp_replay: a capture_file_header, then for every
+// request served a capture_record followed by arg_len bytes of its argument;
+// little-endian like the trace files, read back on the same machine
+
+#define CAPTURE_MAGIC   "FTPCAPT1"
+#define CAPTURE_ARG_MAX 4096
+#define CAPTURE_CLOSE   0 // type of the record ending a session without QUIT
+
+struct capture_file_header
+{
+    char magic[8];
+    uint64_t start_ns; // CLOCK_REALTIME when the capture began
+} __attribute__((packed));
+
+struct capture_record
+{
+    uint64_t offset_ns;  // arrival since the capture began
+    uint64_t size;       // file bytes moved by the request
+    uint32_t session;    // one per accepted connection
+    uint32_t service_us; // time the server spent on it
+    uint8_t type;
+    uint8_t status;
+    uint16_t arg_len;
+} __attribute__((packed));
+
+uint64_t capture_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct capture_writer
+{
+    FILE *fp = nullptr;
+    uint64_t start = 0;
+    bool dirty = false;
+
+    int open(const char *path)
+    {
+        if ((fp = fopen(path, "wb")) == nullptr)
+        {
+            return -1;
+        }
+        struct capture_file_header header;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        header.start_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        start = capture_clock();
+        fwrite(&header, sizeof(header), 1, fp);
+        return fflush(fp) == 0 ? 0 : -1;
+    }
+
+    bool enabled()
+    {
+        return fp != nullptr;
+    }
+
+    // arrival is the capture_clock() reading taken when the request came in
+    void add(uint64_t arrival, uint32_t session, uint8_t type, uint8_t status,
+             const void *arg, size_t arg_len, uint64_t size)
+    {
+        struct capture_record r;
+        uint64_t now = capture_clock();
+        r.offset_ns = arrival - start;
+        r.size = size;
+        r.session = session;
+        r.service_us = (now - arrival) / 1000;
+        r.type = type;
+        r.status = status;
+        r.arg_len = arg_len < CAPTURE_ARG_MAX ? arg_len : CAPTURE_ARG_MAX;
+        fwrite(&r, sizeof(r), 1, fp);
+        fwrite(arg, 1, r.arg_len, fp);
+        dirty = true;
+    }
+
+    // records are buffered, flushed once per event loop round
+    void flush()
+    {
+        if (dirty)
+        {
+            fflush(fp);
+            dirty = false;
+        }
+    }
+};
+
+#endif
@@ -1,5 +1,13 @@
 #include <defs.h>
 #include <ftp_utils.hpp>
+#include <ftp_listing.hpp>
+#include <ftp_dedup.hpp>
+#include <ftp_bundle.hpp>
+#include <ftp_tree.hpp>
+#include <ftp_timing.hpp>
+#include <ftp_async.hpp>
+#include <unordered_set>
+#include <sys/un.h>
 
 static const char *cmdnames[] = {
     "open",
@@ -9,9 +17,26 @@ static const char *cmdnames[] = {
     "put",
     "sha256",
     "quit",
+    "crc",
+    "trace",
+    "sparse",
+    "lsx",
+    "cp",
+    "mv",
+    "dedup",
+    "mget",
+    "transport",
+    "tree",
+    "timing",
+    "bg",
+    "jobs",
+    "wait",
+    "stats",
 };
 const int cmdnum = sizeof(cmdnames) / sizeof(char *);
 
+#define BUSY_TRIES 5 // runs of a command the server keeps turning away
+
 static const char *default_prompt = "Client(None)>";
 char prompt[MAXLINE] = "Client(None)>";
 
@@ -20,35 +45,99 @@ bool running = true;
 int sock;
 type m_type;
 status m_status;
+status stream_flags = DATA_STREAM | DATA_EXTENT;
+bool dedup_put = false;
+bool local_sock = false; // connected through the server's unix socket
+bool rtp_sock = false;   // open an ip and port over lab2's RTP, not TCP
+timing_session timing;
 
-int do_open(char *args)
-{
-    // get ip and port from args
-    char *ip = args;
-    char *p = strstr(args, " ");
-    *p = '\0';
-    int port = atoi(p + 1);
+// bg transfers run on connections of their own to the server of the last
+// TCP open, driven by an event loop thread while the prompt stays usable
+async_client background;
+std::vector<std::shared_ptr<async_job>> jobs;
+std::vector<bool> jobs_reported;
+std::string server_ip;
+int server_port = 0; // 0 unless connected over TCP
 
-    // create socket and connect to server
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in addr;
-    addr.sin_port = htons(port);
-    addr.sin_family = AF_INET;
-    if (inet_pton(AF_INET, ip, &addr.sin_addr) < 0)
+// socket buffers and stream frames of a TCP connection sized to its
+// bandwidth-delay product as files go over it
+tcp_tuner tuner;
+
+// connect to the unix socket at path, a server on this host
+int open_local(char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
     {
-        close(sock);
-        return serror("inet_pton error");
+        return serror("unix socket path too long");
     }
+    strcpy(addr.sun_path, path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
     if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
     {
         close(sock);
         return serror("connect error");
     }
+    return 0;
+}
+
+int do_open(char *args)
+{
+    // "open /path" is a unix socket, anything else an ip and port
+    char *ip = args;
+    int port = 0;
+    local_sock = args[0] == '/';
+    if (local_sock)
+    {
+        if (open_local(args) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        char *p = strstr(args, " ");
+        if (p == nullptr)
+        {
+            return serror("usage: open <IPaddr> <Port> | open <unix socket path>");
+        }
+        *p = '\0';
+        port = atoi(p + 1);
+
+        // RTP connects with a handshake of its own
+        if (rtp_sock)
+        {
+            if ((sock = transport_connect(ip, port, 0)) < 0)
+            {
+                return serror("connect error");
+            }
+        }
+        else
+        {
+            // create socket and connect to server
+            sock = socket(AF_INET, SOCK_STREAM, 0);
+            struct sockaddr_in addr;
+            addr.sin_port = htons(port);
+            addr.sin_family = AF_INET;
+            if (inet_pton(AF_INET, ip, &addr.sin_addr) < 0)
+            {
+                close(sock);
+                return serror("inet_pton error");
+            }
+            if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+            {
+                close(sock);
+                return serror("connect error");
+            }
+        }
+    }
 
     // send post
     if (send_post(sock, OPEN_REQUEST) < 0)
     {
-        close(sock);
+        transport_close(sock);
         return serror("send open request error");
     }
 
@@ -56,18 +145,29 @@ int do_open(char *args)
     char buf[MAXBUF];
     if (recv_post(sock, buf, &m_type, &m_status) < 0)
     {
-        close(sock);
+        transport_close(sock);
         return serror("recv open reply error");
     }
     if (m_type != OPEN_REPLY || m_status != 1)
     {
-        close(sock);
+        transport_close(sock);
         return serror("bad open reply");
     }
 
     // change states
     connected = true;
-    sprintf(prompt, "Client(%s:%d)>", ip, port);
+    server_ip = local_sock ? "" : ip;
+    server_port = local_sock || rtp_sock ? 0 : port;
+    tuner = tcp_tuner();
+    tuning = server_port ? &tuner : nullptr;
+    if (local_sock)
+    {
+        sprintf(prompt, "Client(%s)>", args);
+    }
+    else
+    {
+        sprintf(prompt, "Client(%s:%d)>", ip, port);
+    }
     printf("connection established\n");
     return 0;
 }
@@ -99,11 +199,12 @@ int do_quit(char *args = nullptr)
     }
 
     // release resources and change states
-    if (close(sock) < 0)
+    if (transport_close(sock) < 0)
     {
         return serror("close socket error");
     }
     connected = false;
+    tuning = nullptr;
     strcpy(prompt, default_prompt);
     printf("connection close ok\n");
     return 0;
@@ -139,6 +240,67 @@ int do_ls(char *args = nullptr)
     return 0;
 }
 
+// list the remote directory page by page with sizes and mtimes
+int do_lsx(char *args)
+{
+    // check if connected
+    if (connected == false)
+    {
+        return serror("lsx not supported offline");
+    }
+
+    struct list_request req = {0, 0};
+    static char buf[LISTX_PAGE];
+    do
+    {
+        // send post
+        if (send_post(sock, LISTX_REQUEST, &req, sizeof(req)) < 0)
+        {
+            return serror("send lsx request error");
+        }
+
+        // recv post
+        int size;
+        if ((size = recv_post(sock, buf, &m_type, &m_status)) < 0)
+        {
+            return serror("recv lsx reply error");
+        }
+        if (m_type != LISTX_REPLY || size < (int)sizeof(struct list_page))
+        {
+            return serror("bad lsx reply");
+        }
+
+        // show records
+        struct list_page *page = (struct list_page *)buf;
+        char *p = buf + sizeof(struct list_page);
+        for (uint32_t i = ntohl(page->count); i > 0; --i)
+        {
+            struct list_record r;
+            if (p + sizeof(r) > buf + size)
+            {
+                return serror("bad lsx reply");
+            }
+            memcpy(&r, p, sizeof(r));
+            int len = be16toh(r.name_len);
+            p += sizeof(r);
+            if (p + len > buf + size)
+            {
+                return serror("bad lsx reply");
+            }
+
+            mode_t mode = be32toh(r.mode);
+            char kind = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISREG(mode) ? '-' : '?';
+            time_t mtime = be64toh(r.mtime_ns) / 1000000000;
+            char when[32];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&mtime));
+            printf("%c %12llu %s %.*s\n", kind, (unsigned long long)be64toh(r.size), when, len, p);
+            p += len;
+        }
+        req.cursor = page->cursor;
+    } while (m_status == 1);
+    return 0;
+}
+
 int do_cd(char *args)
 {
     // checkout if connected
@@ -167,6 +329,40 @@ int do_cd(char *args)
     return 0;
 }
 
+// save the file the server passed as passfd, copied inside the kernel;
+// the reply payload is its size
+int get_passed(char *args, int passfd, char *buf, int n)
+{
+    uint64_t size;
+    if (passfd < 0 || n != sizeof(size))
+    {
+        if (passfd >= 0)
+        {
+            close(passfd);
+        }
+        return serror("bad get reply");
+    }
+    memcpy(&size, buf, sizeof(size));
+    size = be64toh(size);
+
+    // in the server's own directory the file may already be the target
+    struct stat src, dst;
+    if (fstat(passfd, &src) == 0 && stat(args, &dst) == 0 &&
+        src.st_dev == dst.st_dev && src.st_ino == dst.st_ino)
+    {
+        close(passfd);
+        return 0;
+    }
+    int filefd = open(args, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int scode = filefd < 0 ? serror("open file error (w)") : copy_data(passfd, filefd, size);
+    close(passfd);
+    if (filefd >= 0 && close(filefd) < 0)
+    {
+        scode = -1;
+    }
+    return scode < 0 ? serror("recv file data error") : 0;
+}
+
 int do_get(char *args)
 {
     // check if connected
@@ -175,40 +371,234 @@ int do_get(char *args)
         return serror("get not supported offline");
     }
 
-    // send post
-    if (send_post(sock, GET_REQUEST, args, strlen(args) + 1) < 0)
+    // send post, over a unix socket the server may pass the file itself
+    status flags = stream_flags | (local_sock ? DATA_FD : 0);
+    if (send_post(sock, GET_REQUEST, args, strlen(args) + 1, flags) < 0)
     {
         return serror("send get request error");
     }
 
     // recv post
     char buf[MAXBUF];
-    int size;
-    if ((size = recv_post(sock, buf, &m_type, &m_status)) < 0)
+    int passfd = -1;
+    int n = local_sock ? recv_post_fd(sock, buf, &m_type, &m_status, &passfd)
+                       : recv_post(sock, buf, &m_type, &m_status);
+    if (n < 0)
     {
         return serror("recv get reply error");
     }
-    if (m_type != GET_REPLY || m_status != 1)
+    if (m_type != GET_REPLY || (m_status & ~DATA_FD) != 1)
     {
+        if (passfd >= 0)
+        {
+            close(passfd);
+        }
         return serror("bad get reply");
     }
+    if (m_status & DATA_FD)
+    {
+        return get_passed(args, passfd, buf, n);
+    }
 
-    // recv file
-    if ((size = recv_post(sock, buf, &m_type)) < 0)
+    // recv file and save file data, drain it if the file can't be opened
+    int filefd = open(args, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (filefd < 0)
+    {
+        serror("open file error (w)");
+    }
+    off_t size = recv_stream(sock, filefd);
+    if (filefd >= 0)
+    {
+        close(filefd);
+    }
+    if (size < 0 && filefd >= 0)
+    {
+        // a frame that failed its checksum leaves no file behind
+        unlink(args);
+    }
+    if (size < 0 || filefd < 0)
     {
         return serror("recv file data error");
     }
-    if (m_type != FILE_DATA)
+
+    return 0;
+}
+
+// upload only the chunks of the file the server lacks, then its manifest;
+// returns 1 if the server doesn't deduplicate and a plain put is needed
+int put_dedup(char *args)
+{
+    // cut and hash the file the way the server would
+    int filefd = open(args, O_RDONLY);
+    struct stat st;
+    if (filefd < 0 || fstat(filefd, &st) < 0)
     {
-        return serror("bad file data");
+        if (filefd >= 0)
+        {
+            close(filefd);
+        }
+        return serror("open file error (r)");
+    }
+    uint8_t *map = nullptr;
+    if (st.st_size > 0)
+    {
+        map = (uint8_t *)mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, filefd, 0);
+    }
+    close(filefd);
+    if (map == MAP_FAILED)
+    {
+        return serror("mmap file error");
+    }
+    std::vector<manifest_entry> entries = cdc_split(map, st.st_size);
+    std::string request = std::string(args) + '\0';
+    manifest_pack(entries, st.st_size, request);
+    if (request.size() > MAXBUF)
+    {
+        munmap(map, st.st_size);
+        return 1;
     }
 
-    // save file data
-    if (write_file(args, buf, size) < 0)
+    // ask which chunks the server already has
+    static char buf[MAXBUF];
+    std::vector<char> have(entries.size());
+    for (size_t i = 0; i < entries.size(); i += HAVE_BATCH)
+    {
+        int n = std::min(entries.size() - i, (size_t)HAVE_BATCH);
+        for (int j = 0; j < n; ++j)
+        {
+            memcpy(buf + j * SHA256_LEN, entries[i + j].hash, SHA256_LEN);
+        }
+        int size;
+        if (send_post(sock, HAVE_REQUEST, buf, n * SHA256_LEN) < 0 ||
+            (size = recv_post(sock, buf, &m_type, &m_status)) < 0)
+        {
+            munmap(map, st.st_size);
+            return serror("have request error");
+        }
+        if (m_type != HAVE_REPLY || m_status != 1 || size != n)
+        {
+            munmap(map, st.st_size);
+            return 1;
+        }
+        memcpy(&have[i], buf, n);
+    }
+
+    // upload the missing ones once each, keeping a few requests in flight
+    std::unordered_set<std::string> sent;
+    int inflight = 0, scode = 0;
+    uint64_t offset = 0, bytes = 0;
+    for (size_t i = 0; i <= entries.size() && scode == 0; ++i)
+    {
+        bool last = i == entries.size();
+        uint32_t n = last ? 0 : ntohl(entries[i].length);
+        std::string key = last ? "" : std::string((char *)entries[i].hash, SHA256_LEN);
+        if (!last && !have[i] && sent.insert(key).second)
+        {
+            if (send_post(sock, CHUNK_REQUEST, map + offset, n) < 0)
+            {
+                scode = serror("send chunk request error");
+            }
+            ++inflight;
+            bytes += n;
+        }
+        offset += n;
+        while (scode == 0 && (inflight == CHUNK_WINDOW || (last && inflight > 0)))
+        {
+            if (recv_post(sock, buf, &m_type, &m_status) < 0 ||
+                m_type != CHUNK_REPLY || m_status != 1)
+            {
+                scode = serror("bad chunk reply");
+            }
+            --inflight;
+        }
+    }
+    munmap(map, st.st_size);
+    if (scode < 0)
     {
         return -1;
     }
 
+    // commit the manifest
+    if (send_post(sock, MANIFEST_REQUEST, (void *)request.data(), request.size()) < 0 ||
+        recv_post(sock, buf, &m_type, &m_status) < 0)
+    {
+        return serror("manifest request error");
+    }
+    if (m_type != MANIFEST_REPLY || m_status != 1)
+    {
+        return serror("bad manifest reply");
+    }
+    printf("%zu of %zu chunks sent, %llu of %llu bytes\n", sent.size(), entries.size(),
+           (unsigned long long)bytes, (unsigned long long)st.st_size);
+    return 0;
+}
+
+// fetch every file matching the space separated patterns in one bundle
+int do_mget(char *args)
+{
+    // check if connected
+    if (connected == false)
+    {
+        return serror("mget not supported offline");
+    }
+    if (*args == '\0')
+    {
+        return serror("usage: mget <pattern> ...");
+    }
+
+    // send post, the patterns go as "pattern\0pattern\0"
+    std::string patterns;
+    for (char *p = strtok(args, " "); p != nullptr; p = strtok(nullptr, " "))
+    {
+        patterns.append(p).push_back('\0');
+    }
+    if (send_post(sock, BUNDLE_REQUEST, (void *)patterns.data(), patterns.size()) < 0)
+    {
+        return serror("send bundle request error");
+    }
+
+    // recv post
+    static char buf[CHUNK_SIZE];
+    if (recv_post(sock, buf, &m_type, &m_status) < 0)
+    {
+        return serror("recv bundle reply error");
+    }
+    if (m_type != BUNDLE_REPLY || m_status != 1)
+    {
+        return serror("bad bundle reply");
+    }
+
+    // unpack the frames as they arrive
+    bundle_reader bundle;
+    struct ftp_header header;
+    do
+    {
+        if (srecv(sock, (void *)&header, HEADER_SIZE) <= 0)
+        {
+            return serror("recv bundle error");
+        }
+        if (header.m_type != FILE_DATA || (header.m_status & DATA_STREAM) == 0)
+        {
+            return serror("bad bundle data");
+        }
+        for (uint32_t length = ntohl(header.m_length) - HEADER_SIZE; length > 0;)
+        {
+            int n = std::min(length, (uint32_t)sizeof(buf));
+            if (srecv(sock, buf, n) < 0)
+            {
+                return serror("recv bundle error");
+            }
+            bundle.feed(buf, n);
+            length -= n;
+        }
+    } while (header.m_status & DATA_MORE);
+
+    printf("%llu files, %llu bytes\n", (unsigned long long)bundle.files,
+           (unsigned long long)bundle.bytes);
+    if (bundle.bad || !bundle.complete())
+    {
+        return serror("bad bundle data");
+    }
     return 0;
 }
 
@@ -220,9 +610,28 @@ int do_put(char *args)
         return serror("put not supported offline");
     }
 
+    int scode;
+    if (dedup_put && (scode = put_dedup(args)) <= 0)
+    {
+        return scode;
+    }
+
+    // open file
+    int filefd = open(args, O_RDONLY);
+    struct stat st;
+    if (filefd < 0 || fstat(filefd, &st) < 0)
+    {
+        if (filefd >= 0)
+        {
+            close(filefd);
+        }
+        return serror("open file error (r)");
+    }
+
     // send post
-    if (send_post(sock, PUT_REQUEST, args, strlen(args) + 1) < 0)
+    if (send_post(sock, PUT_REQUEST, args, strlen(args) + 1, stream_flags | PUT_ACK) < 0)
     {
+        close(filefd);
         return serror("send put request error");
     }
 
@@ -230,22 +639,34 @@ int do_put(char *args)
     char buf[MAXBUF];
     if (recv_post(sock, buf, &m_type, &m_status) < 0)
     {
+        close(filefd);
         return serror("recv put reply error");
     }
     if (m_type != PUT_REPLY)
     {
+        close(filefd);
         return serror("bad put reply");
     }
 
-    // send data
-    int size;
-    if ((size = read_file(args, buf, MAXBUF)) < 0)
+    // send data, in a single frame unless the server takes a stream
+    status flags = data_flags(m_status & stream_flags);
+    bool ack = flags && (m_status & PUT_ACK);
+    off_t size = flags ? st.st_size : std::min(st.st_size, (off_t)MAXBUF);
+    scode = send_stream(sock, filefd, size, flags);
+    close(filefd);
+    if (scode < 0)
     {
-        return -1;
+        return serror("send data file error");
     }
-    if (send_post(sock, FILE_DATA, buf, size) < 0)
+
+    // the server confirms once the file is stored as durably as it promises
+    if (ack && recv_post(sock, buf, &m_type, &m_status) < 0)
     {
-        return serror("send data file error");
+        return serror("recv put ack error");
+    }
+    if (ack && (m_type != PUT_REPLY || m_status != 1))
+    {
+        return serror("file not stored");
     }
 
     return 0;
@@ -292,6 +713,380 @@ int do_sha(char *args)
     return 0;
 }
 
+// "tree <file>" shows the Merkle root of a server file; "tree check <file>"
+// compares the local copy with it leaf by leaf and shows the byte ranges
+// that differ, the ones a resumed or ranged transfer has to fetch again
+int do_tree(char *args)
+{
+    // check if connected
+    if (connected == false)
+    {
+        return serror("tree not supported offline");
+    }
+    bool check = strncmp(args, "check ", 6) == 0;
+    char *path = check ? args + 6 : args;
+
+    // send post
+    char buf[MAXBUF];
+    struct tree_request req;
+    req.shift = TREE_SHIFT;
+    req.leaves = check;
+    memcpy(buf, &req, sizeof(req));
+    strcpy(buf + sizeof(req), path);
+    if (send_post(sock, TREE_REQUEST, buf, sizeof(req) + strlen(path) + 1) < 0)
+    {
+        return serror("send tree request error");
+    }
+
+    // recv post
+    int n = recv_post(sock, buf, &m_type, &m_status);
+    if (n < 0)
+    {
+        return serror("recv tree reply error");
+    }
+    struct tree_reply reply;
+    memcpy(&reply, buf, std::min(n, (int)sizeof(reply)));
+    int count = ntohl(reply.count);
+    if (m_type != TREE_REPLY || m_status != 1 || n < (int)sizeof(reply) ||
+        n != (int)sizeof(reply) + count * SHA256_LEN)
+    {
+        return serror("bad tree reply");
+    }
+    uint64_t size = be64toh(reply.size);
+    char hex[2 * SHA256_LEN + 1];
+    sha256_hex(reply.root, hex);
+    if (!check)
+    {
+        printf("%s  %s\n", hex, path);
+        return 0;
+    }
+
+    // hash the local file the same way
+    int filefd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (filefd < 0 || fstat(filefd, &st) < 0)
+    {
+        if (filefd >= 0)
+        {
+            close(filefd);
+        }
+        return serror("open local file error");
+    }
+    std::vector<tree_digest> leaves;
+    uint8_t root[SHA256_LEN];
+    int scode = tree_hash([filefd](void *p, size_t size, off_t offset)
+                          { return pread(filefd, p, size, offset); },
+                          st.st_size, reply.shift, 0, leaves, root);
+    close(filefd);
+    if (scode < 0)
+    {
+        return serror("read local file error");
+    }
+
+    // a leaf past the end of either file differs too
+    const tree_digest *remote = (const tree_digest *)(buf + sizeof(reply));
+    int total = std::max(count, (int)leaves.size());
+    int differ = 0;
+    for (int i = 0; i < total; ++i)
+    {
+        if (i < count && i < (int)leaves.size() && memcmp(remote[i].h, leaves[i].h, SHA256_LEN) == 0)
+        {
+            continue;
+        }
+        uint64_t start = (uint64_t)i << reply.shift;
+        uint64_t end = std::min(start + ((uint64_t)1 << reply.shift), std::max(size, (uint64_t)st.st_size));
+        printf("leaf %d differs: bytes %lu-%lu\n", i, (unsigned long)start, (unsigned long)end - 1);
+        ++differ;
+    }
+    if (differ == 0 && size == (uint64_t)st.st_size)
+    {
+        printf("%s  %s matches\n", hex, path);
+    }
+    else
+    {
+        printf("%d of %d leaves differ, %lu bytes here, %lu on the server\n", differ, total,
+               (unsigned long)st.st_size, (unsigned long)size);
+    }
+    return 0;
+}
+
+// ask the server to copy or move "src dst" within its own filesystem
+int do_copy(type request, type reply, char *args)
+{
+    // check if connected
+    if (connected == false)
+    {
+        return serror("cp/mv not supported offline");
+    }
+
+    // the paths go as "src\0dst\0"
+    char *p = strstr(args, " ");
+    if (p == nullptr || p == args || p[1] == '\0')
+    {
+        return serror("usage: cp|mv <src> <dst>");
+    }
+    *p = '\0';
+
+    // send post
+    if (send_post(sock, request, args, strlen(args) + strlen(p + 1) + 2) < 0)
+    {
+        return serror("send copy request error");
+    }
+
+    // recv post
+    char buf[MAXBUF];
+    if (recv_post(sock, buf, &m_type, &m_status) < 0)
+    {
+        return serror("recv copy reply error");
+    }
+    if (m_type != reply)
+    {
+        return serror("bad copy reply");
+    }
+    if (m_status != 1)
+    {
+        return serror("copy failed");
+    }
+    return 0;
+}
+
+int do_cp(char *args)
+{
+    return do_copy(COPY_REQUEST, COPY_REPLY, args);
+}
+
+int do_mv(char *args)
+{
+    return do_copy(MOVE_REQUEST, MOVE_REPLY, args);
+}
+
+int do_dedup(char *args)
+{
+    if (strcasecmp(args, "on") == 0 || strcasecmp(args, "off") == 0)
+    {
+        dedup_put = strcasecmp(args, "on") == 0;
+        return 0;
+    }
+    return serror("usage: dedup on|off");
+}
+
+int do_crc(char *args)
+{
+    if (strcasecmp(args, "on") == 0)
+    {
+        stream_flags |= DATA_CRC32C;
+    }
+    else if (strcasecmp(args, "off") == 0)
+    {
+        stream_flags &= ~DATA_CRC32C;
+    }
+    else
+    {
+        return serror("usage: crc on|off");
+    }
+    return 0;
+}
+
+int do_sparse(char *args)
+{
+    if (strcasecmp(args, "on") == 0)
+    {
+        stream_flags |= DATA_EXTENT;
+    }
+    else if (strcasecmp(args, "off") == 0)
+    {
+        stream_flags &= ~DATA_EXTENT;
+    }
+    else
+    {
+        return serror("usage: sparse on|off");
+    }
+    return 0;
+}
+
+int do_trace(char *args)
+{
+    if (strcasecmp(args, "on") == 0 || strcasecmp(args, "off") == 0)
+    {
+        trace_enabled = strcasecmp(args, "on") == 0;
+        return 0;
+    }
+    if (strncasecmp(args, "dump ", 5) == 0)
+    {
+        int n = trace_dump(args + 5);
+        if (n < 0)
+        {
+            return serror("dump trace error");
+        }
+        printf("%d records dumped\n", n);
+        return 0;
+    }
+    return serror("usage: trace on|off|dump <file>");
+}
+
+int do_transport(char *args)
+{
+    if (strcasecmp(args, "tcp") == 0 || strcasecmp(args, "rtp") == 0)
+    {
+#ifndef FTP_RTP
+        if (strcasecmp(args, "rtp") == 0)
+        {
+            return serror("built without the rtp transport");
+        }
+#endif
+        rtp_sock = strcasecmp(args, "rtp") == 0;
+        return 0;
+    }
+    return serror("usage: transport tcp|rtp");
+}
+
+int do_timing(char *args)
+{
+    if (strcasecmp(args, "on") == 0 || strcasecmp(args, "off") == 0)
+    {
+        timing.on = strcasecmp(args, "on") == 0;
+        timing.json = false;
+        return 0;
+    }
+    if (strcasecmp(args, "json") == 0 || strncasecmp(args, "json ", 5) == 0)
+    {
+        timing.on = timing.json = true;
+        timing.json_path = args[4] ? args + 5 : "";
+        return 0;
+    }
+    if (strcasecmp(args, "show") == 0)
+    {
+        return timing.report(false) < 0 ? serror("write timing summary error") : 0;
+    }
+    return serror("usage: timing on|off|json [file]|show");
+}
+
+void show_job(const async_job &job)
+{
+    static const char *states[] = {"queued", "running", "done", "failed"};
+    int state = job.state;
+    uint64_t bytes = job.bytes;
+    printf("[%d] %s %s: %s, %lu bytes", job.id, job.op.c_str(), job.remote.c_str(), states[state],
+           (unsigned long)bytes);
+    if (state >= JOB_DONE && job.end_ms > job.start_ms)
+    {
+        uint64_t ms = job.end_ms - job.start_ms;
+        printf(" in %lu ms, %.1f MB/s", (unsigned long)ms, bytes / (double)ms * 1e3 / (1 << 20));
+    }
+    printf("\n");
+}
+
+// tell about the jobs that finished since the last prompt
+void report_jobs()
+{
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        if (!jobs_reported[i] && jobs[i]->state >= JOB_DONE)
+        {
+            jobs_reported[i] = true;
+            show_job(*jobs[i]);
+        }
+    }
+}
+
+int do_bg(char *args)
+{
+    if (strncasecmp(args, "conns ", 6) == 0)
+    {
+        if (background.started())
+        {
+            return serror("background connections are already open");
+        }
+        background.max_conns = std::max(1, atoi(args + 6));
+        return 0;
+    }
+    bool get = strncasecmp(args, "get ", 4) == 0;
+    if (!get && strncasecmp(args, "put ", 4) != 0)
+    {
+        return serror("usage: bg get|put <file> | bg conns <n>");
+    }
+    if (!connected || server_port == 0)
+    {
+        return serror("bg needs a TCP connection");
+    }
+    if (!background.started() && background.start(server_ip, server_port) < 0)
+    {
+        return serror("start background loop error");
+    }
+    if (background.ip != server_ip || background.port != server_port)
+    {
+        return serror("background transfers go to the first server opened");
+    }
+
+    auto job = std::make_shared<async_job>();
+    job->id = jobs.size() + 1;
+    job->op = get ? "get" : "put";
+    job->remote = job->local = args + 4;
+    jobs.push_back(job);
+    jobs_reported.push_back(false);
+    background.submit(job);
+    printf("[%d] %s %s\n", job->id, job->op.c_str(), job->remote.c_str());
+    return 0;
+}
+
+int do_jobs(char *args)
+{
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        jobs_reported[i] = jobs_reported[i] || jobs[i]->state >= JOB_DONE;
+        show_job(*jobs[i]);
+    }
+    return 0;
+}
+
+// block until the background transfers are done
+int do_wait(char *args)
+{
+    if (background.started())
+    {
+        background.wait();
+    }
+    report_jobs();
+    return 0;
+}
+
+// what the server has seen of its connections, and what this one tuned
+int do_stats(char *args)
+{
+    // check if connected
+    if (connected == false)
+    {
+        return serror("stats not supported offline");
+    }
+
+    // send post
+    if (send_post(sock, STATS_REQUEST) < 0)
+    {
+        return serror("send stats request error");
+    }
+
+    // recv post
+    char buf[MAXBUF];
+    if (recv_post(sock, buf, &m_type, &m_status) < 0)
+    {
+        return serror("recv stats reply error");
+    }
+    if (m_type != STATS_REPLY)
+    {
+        return serror("bad stats reply");
+    }
+
+    // show data
+    printf("%s", buf);
+    if (tuning)
+    {
+        char line[512];
+        tuner.describe(sock, line, sizeof(line));
+        printf("client: %s", line);
+    }
+    return 0;
+}
+
 int (*cmdfuncs[])(char *) = {
     do_open,
     do_ls,
@@ -300,16 +1095,62 @@ int (*cmdfuncs[])(char *) = {
     do_put,
     do_sha,
     do_quit,
+    do_crc,
+    do_trace,
+    do_sparse,
+    do_lsx,
+    do_cp,
+    do_mv,
+    do_dedup,
+    do_mget,
+    do_transport,
+    do_tree,
+    do_timing,
+    do_bg,
+    do_jobs,
+    do_wait,
+    do_stats,
 };
 
 int parseline(char *cmdline)
 {
     char *p = strstr(cmdline, " ");
+    char *args = p ? p + 1 : cmdline + strlen(cmdline);
+    size_t len = p ? p - cmdline : strlen(cmdline);
     for (int i = 0; i < cmdnum; ++i)
     {
-        if (strncasecmp(cmdline, cmdnames[i], strlen(cmdnames[i])) == 0)
+        if (len == strlen(cmdnames[i]) && strncasecmp(cmdline, cmdnames[i], len) == 0)
         {
-            return cmdfuncs[i](p + 1);
+            // a server shedding load turns a request away before acting on
+            // it, so the command runs again once the server says to
+            std::string saved = args;
+            bool timed = timing.on && cmdfuncs[i] != do_timing;
+            if (timed)
+            {
+                timing.begin(io_bytes);
+            }
+            for (int tries = 1;; ++tries)
+            {
+                busy_retry_ms = 0;
+                int scode = cmdfuncs[i](args);
+                if (scode >= 0 || busy_retry_ms == 0 || tries == BUSY_TRIES)
+                {
+                    // the session summary comes with the quit ending it
+                    if (timed)
+                    {
+                        timing.end(cmdnames[i], scode, io_bytes);
+                    }
+                    if (timed && cmdfuncs[i] == do_quit && timing.report() < 0)
+                    {
+                        serror("write timing summary error");
+                    }
+                    return scode;
+                }
+                printf("server busy, retrying in %u ms\n", busy_retry_ms);
+                fflush(stdout);
+                usleep(busy_retry_ms * 1000);
+                strcpy(args, saved.c_str());
+            }
         }
     }
     return 1;
@@ -320,6 +1161,7 @@ int main()
     char cmdline[MAXLINE];
     while(running)
     {
+        report_jobs();
         fflush(stdout);
         printf("%s", prompt);
         fflush(stdout);
@@ -329,6 +1171,13 @@ int main()
         }
         if (feof(stdin))
         {
+            // the background transfers are finished, not cut off
+            background.stop();
+            report_jobs();
+            if (timing.on && timing.report() < 0)
+            {
+                serror("write timing summary error");
+            }
             printf("\n");
             fflush(stdout);
             exit(0);
@@ -339,5 +1188,7 @@ int main()
             serror("command not supported");
         }
     }
+    background.stop();
+    report_jobs();
     return 0;
 }
\ No newline at end of file
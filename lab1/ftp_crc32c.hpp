@@ -0,0 +1,227 @@
+#ifndef _FTP_CRC32C_HPP_
+#define _FTP_CRC32C_HPP_
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// CRC32C (Castagnoli, reflected polynomial 0x82F63B78), chained by passing
+// the previous result as crc; uses the crc32 instruction when the cpu has
+// one and falls back to slicing-by-8 tables otherwise
+
+struct crc32c_tables
+{
+    uint32_t t[8][256];
+
+    crc32c_tables()
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t r = i;
+            for (int j = 0; j < 8; ++j)
+            {
+                r = r & 1 ? (r >> 1) ^ 0x82F63B78 : r >> 1;
+            }
+            t[0][i] = r;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            for (int k = 1; k < 8; ++k)
+            {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+// a * b modulo the polynomial, both reflected
+uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+            {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0x82F63B78 : b >> 1;
+    }
+    return p;
+}
+
+// x^(8 * n) modulo the polynomial, the operator appending n zero bytes
+uint32_t crc32c_zeros_op(size_t n)
+{
+    uint32_t p = (uint32_t)1 << 31, x2k = (uint32_t)1 << 23;
+    while (n)
+    {
+        if (n & 1)
+        {
+            p = crc32c_multmodp(x2k, p);
+        }
+        x2k = crc32c_multmodp(x2k, x2k);
+        n >>= 1;
+    }
+    return p;
+}
+
+// crc of A followed by B from crc(A), crc(B) and zeros_op(len(B))
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint32_t op)
+{
+    return crc32c_multmodp(op, crc1) ^ crc2;
+}
+
+// multiplication by a fixed zeros_op is linear in the crc, so it can be
+// tabled per byte like the crc itself: four lookups instead of a bit loop
+struct crc32c_shift
+{
+    uint32_t t[4][256];
+
+    crc32c_shift(uint32_t op)
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            for (int k = 0; k < 4; ++k)
+            {
+                t[k][i] = crc32c_multmodp(op, i << (8 * k));
+            }
+        }
+    }
+
+    uint32_t combine(uint32_t crc1, uint32_t crc2) const
+    {
+        return t[0][crc1 & 0xff] ^ t[1][(crc1 >> 8) & 0xff] ^
+               t[2][(crc1 >> 16) & 0xff] ^ t[3][crc1 >> 24] ^ crc2;
+    }
+};
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t size)
+{
+    static const crc32c_tables tables;
+    const uint32_t(*t)[256] = tables.t;
+    const uint8_t *p = (const uint8_t *)buf;
+
+    crc = ~crc;
+    while (size >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        uint32_t lo = (uint32_t)v ^ crc;
+        uint32_t hi = (uint32_t)(v >> 32);
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+              t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+              t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size--)
+    {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+#define CRC32C_LANE 4096
+
+// the crc32 instruction has a latency of three cycles but issues one per
+// cycle, so long buffers run three independent lanes that get combined
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t size)
+{
+    static const crc32c_shift lane(crc32c_zeros_op(CRC32C_LANE));
+    const uint8_t *p = (const uint8_t *)buf;
+    while (size >= 3 * CRC32C_LANE)
+    {
+        uint64_t c0 = ~crc, c1 = ~0u, c2 = ~0u;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8)
+        {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + CRC32C_LANE + i, 8);
+            memcpy(&v2, p + 2 * CRC32C_LANE + i, 8);
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        crc = lane.combine(~(uint32_t)c0, ~(uint32_t)c1);
+        crc = lane.combine(crc, ~(uint32_t)c2);
+        p += 3 * CRC32C_LANE;
+        size -= 3 * CRC32C_LANE;
+    }
+
+    uint64_t c = ~crc;
+    while (size >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        size -= 8;
+    }
+    while (size--)
+    {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    return ~(uint32_t)c;
+}
+
+bool crc32c_hw_supported()
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc"))) uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    crc = ~crc;
+    while (size >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        size -= 8;
+    }
+    while (size--)
+    {
+        crc = __crc32cb(crc, *p++);
+    }
+    return ~crc;
+}
+
+bool crc32c_hw_supported()
+{
+    return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+#else
+uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t size)
+{
+    return crc32c_sw(crc, buf, size);
+}
+
+bool crc32c_hw_supported()
+{
+    return false;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t size)
+{
+    static uint32_t (*impl)(uint32_t, const void *, size_t) =
+        crc32c_hw_supported() ? crc32c_hw : crc32c_sw;
+    return impl(crc, buf, size);
+}
+
+#endif
@@ -0,0 +1,281 @@
+#ifndef _FTP_DEDUP_HPP_
+#define _FTP_DEDUP_HPP_
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <ftp_sha256.hpp>
+#include <ftp_span.hpp>
+
+// content addressed storage: files are cut into content defined chunks
+// with FastCDC, every distinct chunk is stored once under its SHA-256 in
+// the chunk store, and the file itself becomes a manifest listing its
+// chunks; client and server cut identically, so a client can learn which
+// chunks the server already has and upload only the others
+
+#define CDC_MIN (1 << 14)
+#define CDC_AVG (1 << 16)
+#define CDC_MAX (1 << 18)
+
+// normalized chunking: a stricter mask before CDC_AVG and a looser one
+// after it pull chunk sizes towards the average; the gear hash moves the
+// latest bytes into the high bits, so the masks test those
+#define CDC_MASK_S (~0ULL << (64 - 18))
+#define CDC_MASK_L (~0ULL << (64 - 14))
+
+#define MANIFEST_MAGIC "FTPMANI1"
+#define MANIFEST_XATTR "user.ftp.manifest" // set on every file stored as one
+
+struct manifest_header
+{
+    char magic[8];
+    uint64_t size;   // bytes of file data
+    uint32_t count;  // manifest_entry records that follow
+} __attribute__((packed));
+
+struct manifest_entry
+{
+    uint8_t hash[SHA256_LEN];
+    uint32_t length;
+} __attribute__((packed));
+
+struct cdc_gear
+{
+    uint64_t g[256];
+
+    // any fixed random table works as long as both sides use the same one
+    cdc_gear()
+    {
+        uint64_t x = 0x9E3779B97F4A7C15ULL;
+        for (int i = 0; i < 256; ++i)
+        {
+            uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            g[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+// length of the chunk at the start of the n bytes at p
+size_t cdc_cut(const uint8_t *p, size_t n)
+{
+    static const cdc_gear gear;
+    if (n <= CDC_MIN)
+    {
+        return n;
+    }
+    n = std::min(n, (size_t)CDC_MAX);
+    size_t normal = std::min(n, (size_t)CDC_AVG);
+    uint64_t fp = 0;
+    size_t i = CDC_MIN;
+    for (; i < normal; ++i)
+    {
+        fp = (fp << 1) + gear.g[p[i]];
+        if ((fp & CDC_MASK_S) == 0)
+        {
+            return i + 1;
+        }
+    }
+    for (; i < n; ++i)
+    {
+        fp = (fp << 1) + gear.g[p[i]];
+        if ((fp & CDC_MASK_L) == 0)
+        {
+            return i + 1;
+        }
+    }
+    return n;
+}
+
+// cut size bytes at p into chunks and hash them
+std::vector<manifest_entry> cdc_split(const uint8_t *p, size_t size)
+{
+    std::vector<manifest_entry> entries;
+    for (size_t offset = 0; offset < size;)
+    {
+        manifest_entry e;
+        size_t n = cdc_cut(p + offset, size - offset);
+        sha256(p + offset, n, e.hash);
+        e.length = htonl(n);
+        entries.push_back(e);
+        offset += n;
+    }
+    return entries;
+}
+
+// mark fd as holding a manifest, or clear the mark; the mark is kept out
+// of band so that no file content can pass for a manifest
+int manifest_mark(int fd, bool manifest)
+{
+    if (manifest)
+    {
+        return fsetxattr(fd, MANIFEST_XATTR, "", 0, 0);
+    }
+    // nothing is marked where there are no extended attributes
+    return fremovexattr(fd, MANIFEST_XATTR) < 0 && errno != ENODATA && errno != ENOTSUP ? -1 : 0;
+}
+
+// the header of the manifest in fd if it is a marked one of file size fsize
+bool manifest_head(int fd, off_t fsize, struct manifest_header *header)
+{
+    return fsize >= (off_t)sizeof(*header) &&
+           (fsize - sizeof(*header)) % sizeof(manifest_entry) == 0 &&
+           fgetxattr(fd, MANIFEST_XATTR, nullptr, 0) >= 0 &&
+           pread(fd, header, sizeof(*header), 0) == sizeof(*header) &&
+           memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) == 0 &&
+           fsize == (off_t)(sizeof(*header) + (uint64_t)ntohl(header->count) * sizeof(manifest_entry));
+}
+
+// the size of the file whose directory entry name in dfd has stat st, the
+// one it stands for if it is a manifest
+uint64_t manifest_size(int dfd, const char *name, const struct stat &st)
+{
+    struct manifest_header header;
+    if (!S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(header) ||
+        (st.st_size - sizeof(header)) % sizeof(manifest_entry) != 0)
+    {
+        return st.st_size;
+    }
+    int fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    bool manifest = fd >= 0 && manifest_head(fd, st.st_size, &header);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return manifest ? be64toh(header.size) : st.st_size;
+}
+
+// the entries of the manifest in fd if it is one, of file size fsize
+bool manifest_read(int fd, off_t fsize, std::vector<manifest_entry> &entries, uint64_t *size)
+{
+    struct manifest_header header;
+    if (!manifest_head(fd, fsize, &header))
+    {
+        return false;
+    }
+    entries.resize(ntohl(header.count));
+    size_t bytes = entries.size() * sizeof(manifest_entry);
+    if (pread(fd, entries.data(), bytes, sizeof(header)) != (ssize_t)bytes)
+    {
+        return false;
+    }
+    *size = be64toh(header.size);
+    return true;
+}
+
+// serialize a manifest of entries holding size bytes into buf
+void manifest_pack(const std::vector<manifest_entry> &entries, uint64_t size, std::string &buf)
+{
+    struct manifest_header header;
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.size = htobe64(size);
+    header.count = htonl(entries.size());
+    buf.append((const char *)&header, sizeof(header));
+    buf.append((const char *)entries.data(), entries.size() * sizeof(manifest_entry));
+}
+
+struct chunk_store
+{
+    std::string root; // directory the chunks are kept in
+
+    std::string path(const uint8_t hash[SHA256_LEN])
+    {
+        char hex[2 * SHA256_LEN + 1];
+        sha256_hex(hash, hex);
+        return root + "/" + std::string(hex, 2) + "/" + hex;
+    }
+
+    bool has(const uint8_t hash[SHA256_LEN])
+    {
+        return access(path(hash).c_str(), F_OK) == 0;
+    }
+
+    int open(const uint8_t hash[SHA256_LEN])
+    {
+        return ::open(path(hash).c_str(), O_RDONLY | O_CLOEXEC);
+    }
+
+    // store a chunk unless present, written aside and renamed into place
+    // so a reader never sees a partial chunk
+    int put(const uint8_t hash[SHA256_LEN], const void *data, size_t size)
+    {
+        std::string p = path(hash);
+        if (access(p.c_str(), F_OK) == 0)
+        {
+            return 0;
+        }
+        mkdir(p.substr(0, p.find_last_of('/')).c_str(), 0755);
+        std::string tmp = p + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        const char *q = (const char *)data;
+        for (size_t done = 0; done < size;)
+        {
+            ssize_t n = write(fd, q + done, size - done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                close(fd);
+                unlink(tmp.c_str());
+                return -1;
+            }
+            done += n;
+        }
+        if (close(fd) < 0 || rename(tmp.c_str(), p.c_str()) < 0)
+        {
+            unlink(tmp.c_str());
+            return -1;
+        }
+        return 0;
+    }
+
+    // split the size bytes of fd into the store, filling its manifest
+    int put_file(int fd, off_t size, std::vector<manifest_entry> &entries)
+    {
+        span_scope span("store chunks");
+        if (size == 0)
+        {
+            entries.clear();
+            return 0;
+        }
+        uint8_t *map = (uint8_t *)mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            return -1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        entries = cdc_split(map, size);
+        int scode = 0;
+        off_t offset = 0;
+        for (auto &e : entries)
+        {
+            if (put(e.hash, map + offset, ntohl(e.length)) < 0)
+            {
+                scode = -1;
+                break;
+            }
+            offset += ntohl(e.length);
+        }
+        munmap(map, size);
+        return scode;
+    }
+};
+
+#endif
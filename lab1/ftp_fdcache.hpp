@@ -0,0 +1,181 @@
+#ifndef _FTP_FDCACHE_HPP_
+#define _FTP_FDCACHE_HPP_
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <ftp_span.hpp>
+
+// bounded LRU cache of read-only file descriptors keyed by canonical path,
+// a hit hands out an open fd and its size without open/fstat/close; entries
+// are dropped on PUT through this server and, via inotify on the parent
+// directory, when the file is written, renamed or unlinked by anyone else
+struct fd_entry
+{
+    std::string path;
+    int fd;
+    off_t size;
+    int wd;
+};
+
+struct fd_cache
+{
+    std::list<fd_entry> lru;
+    std::unordered_map<std::string, std::list<fd_entry>::iterator> index;
+    std::unordered_map<int, std::string> dirs;
+    std::unordered_map<int, int> dirrefs;
+    size_t capacity;
+    int ifd;
+
+    fd_cache(size_t capacity_ = FDCACHE_MAX) : capacity(capacity_)
+    {
+        ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+
+    // returns the cached entry for path, opening it on a miss;
+    // nullptr if the path is not a readable regular file
+    fd_entry *get(const std::string &path)
+    {
+        auto it = index.find(path);
+        if (it != index.end() && it->second->wd >= 0)
+        {
+            lru.splice(lru.begin(), lru, it->second);
+            return &lru.front();
+        }
+        if (it != index.end())
+        {
+            evict(it->second);
+        }
+
+        span_scope span("open");
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        {
+            close(fd);
+            return nullptr;
+        }
+
+        // cached files are read front to back, let readahead go further
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (lru.size() >= capacity)
+        {
+            evict(std::prev(lru.end()));
+        }
+
+        // without a watch we could never see the file change, so such an
+        // entry is served once and dropped on its next lookup
+        int wd = watch(path);
+        lru.push_front({path, fd, st.st_size, wd});
+        index[path] = lru.begin();
+        if (wd >= 0)
+        {
+            ++dirrefs[wd];
+        }
+        return &lru.front();
+    }
+
+    void invalidate(const std::string &path)
+    {
+        auto it = index.find(path);
+        if (it != index.end())
+        {
+            evict(it->second);
+        }
+    }
+
+    void clear()
+    {
+        while (!lru.empty())
+        {
+            evict(lru.begin());
+        }
+    }
+
+    // drain pending inotify events, call when ifd becomes readable
+    void handle_events()
+    {
+        alignas(struct inotify_event) char buf[4096];
+        ssize_t n;
+        while ((n = read(ifd, buf, sizeof(buf))) > 0)
+        {
+            for (char *p = buf; p < buf + n;)
+            {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + ev->len;
+
+                // events were lost, any entry may be stale
+                if (ev->mask & IN_Q_OVERFLOW)
+                {
+                    clear();
+                    continue;
+                }
+                auto dit = dirs.find(ev->wd);
+                if (dit == dirs.end())
+                {
+                    continue;
+                }
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                {
+                    for (auto it = lru.begin(); it != lru.end();)
+                    {
+                        auto cur = it++;
+                        if (cur->wd == ev->wd)
+                        {
+                            evict(cur);
+                        }
+                    }
+                    continue;
+                }
+                if (ev->len > 0)
+                {
+                    invalidate(dit->second + "/" + ev->name);
+                }
+            }
+        }
+    }
+
+private:
+    int watch(const std::string &path)
+    {
+        if (ifd < 0)
+        {
+            return -1;
+        }
+        std::string dir = path.substr(0, path.find_last_of('/'));
+        if (dir.empty())
+        {
+            dir = "/";
+        }
+        int wd = inotify_add_watch(ifd, dir.c_str(),
+                                   IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                       IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE |
+                                       IN_DELETE_SELF | IN_MOVE_SELF);
+        if (wd >= 0)
+        {
+            dirs[wd] = dir == "/" ? "" : dir;
+        }
+        return wd;
+    }
+
+    void evict(std::list<fd_entry>::iterator it)
+    {
+        close(it->fd);
+        if (it->wd >= 0 && --dirrefs[it->wd] == 0)
+        {
+            dirrefs.erase(it->wd);
+            dirs.erase(it->wd);
+            inotify_rm_watch(ifd, it->wd);
+        }
+        index.erase(it->path);
+        lru.erase(it);
+    }
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef _FTP_LISTING_HPP_
+#define _FTP_LISTING_HPP_
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <ftp_dedup.hpp>
+#include <ftp_span.hpp>
+
+// paged binary directory listing: a LISTX reply holds a list_page followed
+// by count list_records, each followed by its name without a terminator;
+// pages are read straight from getdents64, so a directory of any size is
+// listed with one small buffer, and the cursor is the directory offset of
+// the next entry; all fields are big-endian
+
+#define LISTX_PAGE   (1 << 16)
+#define LISTX_DIRENT (1 << 15)
+
+struct list_request
+{
+    uint64_t cursor; // 0 for the first page
+    uint32_t limit;  // most records wanted, 0 for as many as fit
+} __attribute__((packed));
+
+struct list_page
+{
+    uint64_t cursor; // pass back to get the next page
+    uint32_t count;
+} __attribute__((packed));
+
+struct list_record
+{
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint32_t mode;     // st_mode, type and permission bits
+    uint16_t name_len;
+} __attribute__((packed));
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// fill buf (at least LISTX_PAGE bytes) with the page of directory dfd that
+// starts at cursor; returns the page size, or -1 on error, *more is set if
+// entries follow the page
+int list_fill(int dfd, uint64_t cursor, uint32_t limit, char *buf, bool *more)
+{
+    span_scope span("list");
+    char dirents[LISTX_DIRENT];
+    struct list_page *page = (struct list_page *)buf;
+    size_t used = sizeof(struct list_page);
+    uint32_t count = 0;
+    *more = false;
+
+    if (lseek(dfd, cursor, SEEK_SET) < 0)
+    {
+        return -1;
+    }
+    while (!*more)
+    {
+        long n = syscall(SYS_getdents64, dfd, dirents, sizeof(dirents));
+        if (n < 0)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        for (long off = 0; off < n;)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dirents + off);
+            off += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            {
+                cursor = d->d_off;
+                continue;
+            }
+
+            size_t len = strlen(d->d_name);
+            if ((limit > 0 && count == limit) ||
+                used + sizeof(struct list_record) + len > LISTX_PAGE)
+            {
+                *more = true;
+                break;
+            }
+
+            // an entry removed since getdents returned it is skipped
+            struct stat st;
+            cursor = d->d_off;
+            if (fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            {
+                continue;
+            }
+            struct list_record r;
+            r.size = htobe64(manifest_size(dfd, d->d_name, st));
+            r.mtime_ns = htobe64((uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec);
+            r.mode = htobe32(st.st_mode);
+            r.name_len = htobe16(len);
+            memcpy(buf + used, &r, sizeof(r));
+            memcpy(buf + used + sizeof(r), d->d_name, len);
+            used += sizeof(r) + len;
+            ++count;
+        }
+    }
+
+    page->cursor = htobe64(cursor);
+    page->count = htobe32(count);
+    return used;
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef _FTP_READAHEAD_HPP_
+#define _FTP_READAHEAD_HPP_
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <ftp_listing.hpp>
+
+// sequential GET detection: a connection that lists a directory and then
+// gets its files in listing order will most likely get the next ones as
+// well, so the server asks the kernel to read those in while the current
+// one is on the wire; the tracker only decides which paths, the server
+// opens and advises them
+
+#define READAHEAD_FILES 4         // files ahead of the current one
+#define READAHEAD_BYTES (8 << 20) // most bytes asked for per file
+#define READAHEAD_NAMES (1 << 16) // names of a listing remembered at most
+
+struct readahead_state
+{
+    std::string dir;                // the listed directory
+    std::vector<std::string> names; // in listing order
+    std::unordered_map<std::string, int> position;
+    int last = -1;    // listing position of the last get
+    int streak = 0;   // gets in listing order in a row
+    int advised = -1; // furthest position read ahead
+};
+
+struct readahead_tracker
+{
+    int files = READAHEAD_FILES; // 0 disables
+    std::unordered_map<int, readahead_state> conns;
+
+    // connection fd starts listing dir anew
+    void listing(int fd, const std::string &dir)
+    {
+        if (files > 0)
+        {
+            conns[fd] = readahead_state();
+            conns[fd].dir = dir;
+        }
+    }
+
+    void add(int fd, const std::string &name)
+    {
+        auto it = conns.find(fd);
+        if (it == conns.end() || it->second.names.size() >= READAHEAD_NAMES)
+        {
+            return;
+        }
+        it->second.position.emplace(name, (int)it->second.names.size());
+        it->second.names.push_back(name);
+    }
+
+    // the names of ls output, one per line
+    void add_lines(int fd, const char *text)
+    {
+        for (const char *p = text; *p;)
+        {
+            const char *end = strchrnul(p, '\n');
+            if (end > p)
+            {
+                add(fd, std::string(p, end - p));
+            }
+            p = *end ? end + 1 : end;
+        }
+    }
+
+    // the names of a LISTX page of size bytes
+    void add_page(int fd, const char *page, int size)
+    {
+        const char *p = page + sizeof(struct list_page);
+        for (const char *end = page + size; p + sizeof(struct list_record) <= end;)
+        {
+            struct list_record r;
+            memcpy(&r, p, sizeof(r));
+            size_t len = be16toh(r.name_len);
+            p += sizeof(r);
+            if (p + len > end)
+            {
+                break;
+            }
+            add(fd, std::string(p, len));
+            p += len;
+        }
+    }
+
+    // connection fd gets path; the paths to read ahead now, if it has been
+    // going down its last listing in order, or starts at the top of it
+    std::vector<std::string> next(int fd, const std::string &path)
+    {
+        std::vector<std::string> out;
+        auto it = conns.find(fd);
+        if (it == conns.end())
+        {
+            return out;
+        }
+        readahead_state &st = it->second;
+        size_t slash = path.find_last_of('/');
+        auto pos = st.position.end();
+        if (slash == st.dir.size() && path.compare(0, slash, st.dir) == 0)
+        {
+            pos = st.position.find(path.substr(slash + 1));
+        }
+        if (pos == st.position.end())
+        {
+            st.last = -1;
+            st.streak = 0;
+            return out;
+        }
+        int i = pos->second;
+        st.streak = i == st.last + 1 ? st.streak + 1 : 1;
+        st.last = i;
+        if (st.streak == 1)
+        {
+            st.advised = i;
+        }
+        if (st.streak < 2 && i != 0)
+        {
+            return out;
+        }
+        int until = std::min(i + files, (int)st.names.size() - 1);
+        for (int j = std::max(i, st.advised) + 1; j <= until; ++j)
+        {
+            out.push_back(st.dir + "/" + st.names[j]);
+        }
+        st.advised = std::max(st.advised, until);
+        return out;
+    }
+
+    void forget(int fd)
+    {
+        conns.erase(fd);
+    }
+};
+
+#endif
@@ -0,0 +1,302 @@
+#include <defs.h>
+#include <ftp_utils.hpp>
+#include <ftp_capture.hpp>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+
+// replays a capture taken with the server's capture= option: every
+// captured session gets a connection and a thread of its own, and each
+// request is sent at its captured time divided by the speed, so sessions
+// overlap as they did; with speed max requests follow each other at once
+
+struct replay_request
+{
+    capture_record r;
+    std::string arg;
+};
+
+struct replay_result
+{
+    std::vector<std::pair<type, uint64_t>> latencies; // type and ns
+    uint64_t bytes = 0;
+    uint64_t late_ns = 0; // worst start behind schedule
+    int errors = 0;
+    int skipped = 0;
+};
+
+const char *replay_ip;
+int replay_port;
+double speed = 1; // 0 replays as fast as possible
+uint64_t replay_start;
+uint64_t first_offset = UINT64_MAX; // the replay starts with the first request
+int datafd; // PUT data, captures don't keep file contents
+
+int load_capture(const char *path, std::map<uint32_t, std::vector<replay_request>> &sessions)
+{
+    FILE *fp = fopen(path, "rb");
+    struct capture_file_header header;
+    if (fp == nullptr || fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        if (fp != nullptr)
+        {
+            fclose(fp);
+        }
+        return serror("bad capture file");
+    }
+    replay_request req;
+    char arg[CAPTURE_ARG_MAX];
+    while (fread(&req.r, sizeof(req.r), 1, fp) == 1)
+    {
+        if (req.r.arg_len > CAPTURE_ARG_MAX || fread(arg, 1, req.r.arg_len, fp) != req.r.arg_len)
+        {
+            break;
+        }
+        req.arg.assign(arg, req.r.arg_len);
+        sessions[req.r.session].push_back(req);
+        first_offset = std::min(first_offset, req.r.offset_ns);
+    }
+    fclose(fp);
+    return 0;
+}
+
+int replay_connect()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(replay_port);
+    if (inet_pton(AF_INET, replay_ip, &addr.sin_addr) != 1 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return serror("connect error");
+    }
+    return fd;
+}
+
+// wait until the captured offset of a request comes round
+void replay_wait(uint64_t offset_ns, replay_result &result)
+{
+    if (speed == 0)
+    {
+        return;
+    }
+    uint64_t due = replay_start + (uint64_t)((offset_ns - first_offset) / speed);
+    uint64_t now = capture_clock();
+    if (now >= due)
+    {
+        result.late_ns = std::max(result.late_ns, now - due);
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = due / 1000000000;
+    ts.tv_nsec = due % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+    {
+    }
+}
+
+// send one request and take in the whole of its answer, the bytes of
+// file data moved or -1
+off_t replay_one(int fd, replay_request &req, char *buf)
+{
+    type t = req.r.type;
+    status s = req.r.status;
+    void *arg = (void *)req.arg.data();
+    int len = req.arg.size();
+    type rt;
+    status rs;
+    if (send_post(fd, t, len ? arg : nullptr, len, s) < 0 || recv_post(fd, buf, &rt, &rs) < 0 ||
+        rt != t + 1)
+    {
+        return -1;
+    }
+    switch (t)
+    {
+    case GET_REQUEST:
+    case BUNDLE_REQUEST:
+        return rs == 1 ? recv_stream(fd, -1) : 0;
+    case SHA_REQUEST:
+        return rs == 1 && recv_post(fd, buf, &rt) < 0 ? -1 : 0;
+    case PUT_REQUEST:
+    {
+        // without streaming the whole file has to fit in one frame
+        status flags = data_flags(rs);
+        off_t size = flags ? req.r.size : std::min(req.r.size, (uint64_t)MAXBUF - HEADER_SIZE);
+        if (send_stream(fd, datafd, size, flags) < 0)
+        {
+            return -1;
+        }
+        if ((rs & DATA_STREAM) && (rs & PUT_ACK) && (recv_post(fd, buf, &rt, &rs) < 0 || rs != 1))
+        {
+            return -1;
+        }
+        return size;
+    }
+    default:
+        return 0;
+    }
+}
+
+void replay_session(std::vector<replay_request> &requests, replay_result &result)
+{
+    std::vector<char> buf(MAXBUF);
+    int fd = -1;
+    for (auto &req : requests)
+    {
+        replay_wait(req.r.offset_ns, result);
+        // content dependent requests can't be rebuilt from a capture
+        if (req.r.type == HAVE_REQUEST || req.r.type == CHUNK_REQUEST ||
+            req.r.type == MANIFEST_REQUEST)
+        {
+            ++result.skipped;
+            continue;
+        }
+        if (req.r.type == CAPTURE_CLOSE)
+        {
+            break;
+        }
+        if (fd < 0 && (fd = replay_connect()) < 0)
+        {
+            ++result.errors;
+            return;
+        }
+        uint64_t start = capture_clock();
+        off_t n = replay_one(fd, req, buf.data());
+        if (n < 0)
+        {
+            serror("replayed request failed");
+            ++result.errors;
+            break;
+        }
+        result.latencies.push_back({req.r.type, capture_clock() - start});
+        result.bytes += n;
+        if (req.r.type == QUIT_REQUEST)
+        {
+            break;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+// nearest rank percentile of sorted latencies, in microseconds
+double percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    size_t rank = (size_t)(p / 100 * sorted.size() + 0.999999);
+    return sorted[std::max(rank, (size_t)1) - 1] / 1e3;
+}
+
+void report(const char *name, std::vector<uint64_t> &ns)
+{
+    if (ns.empty())
+    {
+        return;
+    }
+    std::sort(ns.begin(), ns.end());
+    printf("%-9s %8zu %10.1f %10.1f %10.1f %10.1f\n", name, ns.size(), percentile(ns, 50),
+           percentile(ns, 90), percentile(ns, 99), ns.back() / 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        printf("usage: ftp_replay <capture> <IPaddr> <Port> [speed|max]\n");
+        return 0;
+    }
+    replay_ip = argv[2];
+    replay_port = atoi(argv[3]);
+    if (argc > 4)
+    {
+        speed = strcmp(argv[4], "max") == 0 ? 0 : atof(argv[4]);
+        if (strcmp(argv[4], "max") != 0 && speed <= 0)
+        {
+            printf("bad speed: %s\n", argv[4]);
+            return 0;
+        }
+    }
+
+    std::map<uint32_t, std::vector<replay_request>> sessions;
+    if (load_capture(argv[1], sessions) < 0)
+    {
+        return 1;
+    }
+
+    // every upload sends the same bytes, enough for the largest one
+    uint64_t max_put = 0;
+    for (auto &session : sessions)
+    {
+        for (auto &req : session.second)
+        {
+            if (req.r.type == PUT_REQUEST)
+            {
+                max_put = std::max(max_put, req.r.size);
+            }
+        }
+    }
+    datafd = memfd_create("ftp_replay", 0);
+    std::vector<char> data(1 << 20, 'x');
+    for (uint64_t done = 0; datafd >= 0 && done < max_put; done += data.size())
+    {
+        if (swrite(datafd, data.data(), std::min((uint64_t)data.size(), max_put - done)) < 0)
+        {
+            return serror("create upload data error");
+        }
+    }
+    if (datafd < 0)
+    {
+        return serror("create upload data error");
+    }
+
+    std::vector<replay_result> results(sessions.size());
+    std::vector<std::thread> threads;
+    replay_start = capture_clock();
+    int i = 0;
+    for (auto &session : sessions)
+    {
+        threads.emplace_back(replay_session, std::ref(session.second), std::ref(results[i++]));
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    double secs = (capture_clock() - replay_start) / 1e9;
+
+    std::map<type, std::vector<uint64_t>> by_type;
+    std::vector<uint64_t> all;
+    uint64_t bytes = 0, late_ns = 0;
+    int errors = 0, skipped = 0;
+    for (auto &result : results)
+    {
+        for (auto &l : result.latencies)
+        {
+            by_type[l.first].push_back(l.second);
+            all.push_back(l.second);
+        }
+        bytes += result.bytes;
+        late_ns = std::max(late_ns, result.late_ns);
+        errors += result.errors;
+        skipped += result.skipped;
+    }
+    printf("%zu sessions, %zu requests in %.3f s: %.1f requests/s, %.1f MB/s\n",
+           sessions.size(), all.size(), secs, all.size() / secs, bytes / secs / 1e6);
+    printf("%d failed, %d skipped, worst start %.1f ms behind schedule\n", errors, skipped,
+           late_ns / 1e6);
+    printf("%-9s %8s %10s %10s %10s %10s (us)\n", "request", "count", "p50", "p90", "p99", "max");
+    for (auto &t : by_type)
+    {
+        report(request_name(t.first), t.second);
+    }
+    report("all", all);
+    close(datafd);
+    return errors > 0;
+}
@@ -1,5 +1,20 @@
 #include <defs.h>
 #include <ftp_utils.hpp>
+#include <ftp_fdcache.hpp>
+#include <ftp_timer.hpp>
+#include <ftp_listing.hpp>
+#include <ftp_dedup.hpp>
+#include <ftp_bundle.hpp>
+#include <ftp_sync.hpp>
+#include <ftp_capture.hpp>
+#include <ftp_tree.hpp>
+#include <ftp_span.hpp>
+#include <ftp_admission.hpp>
+#include <ftp_readahead.hpp>
+#include <glob.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <signal.h>
 
 #define type2ind(m_type) ((m_type - OPEN_REQUEST) / 2)
 #define fd2ind(fd) ((fd - 2))
@@ -10,160 +25,1158 @@ int epfd;
 struct epoll_event evt;
 fs::path dft_path;
 fs::path cwds[MAXCONN];
+fd_cache fdcache;
+timer_wheel wheel;
+timer_node idle_timers[MAXCONN];
+bool parked[MAXCONN];
+bool local_conn[MAXCONN]; // accepted on the AF_UNIX listener
+chunk_store chunks;
+sync_group syncer;
+status m_status;
+int m_length;
+off_t m_bytes; // file bytes the current request moved, for the capture
+
+// deadlines in seconds, 0 disables
+int idle_timeout = IDLE_TIMEOUT;
+int header_timeout = HEADER_TIMEOUT;
+int stall_timeout = STALL_TIMEOUT;
+
+// frame tracing, toggled with SIGUSR1 and dumped to trace_file on SIGUSR2
+int trace_on = 0;
+const char *trace_file = nullptr;
+volatile sig_atomic_t trace_dump_pending = 0;
+
+// storage=dedup keeps PUT files as manifests of chunks in chunk_dir,
+// by default .ftp_chunks in the server directory
+const char *storage = "plain";
+const char *chunk_dir = nullptr;
+bool dedup = false;
+
+// how uploads are made durable before a PUT_ACK: not at all, by an fsync
+// of each file, or by fsyncs batched on a thread (group commit)
+const char *durability_text = "none";
+int durability = DURABILITY_NONE;
+
+// unix=<path> listens on an AF_UNIX socket too, for clients on this host
+const char *unix_path = nullptr;
+
+// capture=<file> records every request for ftp_replay
+const char *capture_file = nullptr;
+capture_writer capture;
+uint32_t sessions[MAXCONN];
+uint32_t next_session = 0;
+
+// spans=<file> writes timing spans of one request in span_sample as
+// Chrome trace JSON
+const char *span_file = nullptr;
+int span_sample = 1;
+span_writer spans;
+
+// threads hashing the leaves of a TREE_REQUEST, 0 for one per core
+int tree_threads = 0;
+
+// transport=rtp serves over lab2's reliable UDP instead of TCP, with
+// windows of rtp_window packets
+const char *transport = "tcp";
+int rtp_window = 0;
+bool rtp = false;
+
+// readahead=<n> reads the next n files of a listing ahead of a connection
+// getting them in order, 0 disables
+readahead_tracker prefetch;
+
+// admission control, off unless one of its options is set: caps on
+// connections, on requests ready behind the one being served and on
+// uploads waiting for group durability, and a CoDel target delay in ms
+admission admit;
+int codel_target = 0;
+int codel_interval = 100;
+int conns = 0;
+int sync_queued = 0;
+uint64_t ready_since[MAXCONN]; // when epoll first reported fd readable, 0 if not waiting
+bool refused[MAXCONN];         // over max_conns, closed after one BUSY_REPLY
+uint64_t shed_reported = 0;
+
+// autotune=0 leaves TCP socket buffers and stream frames as they are
+// instead of sizing them to each connection's bandwidth-delay product
+int autotune = 1;
+tcp_tuner tuners[MAXCONN];
+
+struct server_option
+{
+    const char *name;
+    int *value;
+    const char **text;
+};
+
+server_option options[] = {
+    {"idle_timeout", &idle_timeout, nullptr},
+    {"header_timeout", &header_timeout, nullptr},
+    {"stall_timeout", &stall_timeout, nullptr},
+    {"trace", &trace_on, nullptr},
+    {"trace_file", nullptr, &trace_file},
+    {"storage", nullptr, &storage},
+    {"chunk_dir", nullptr, &chunk_dir},
+    {"durability", nullptr, &durability_text},
+    {"capture", nullptr, &capture_file},
+    {"unix", nullptr, &unix_path},
+    {"transport", nullptr, &transport},
+    {"rtp_window", &rtp_window, nullptr},
+    {"tree_threads", &tree_threads, nullptr},
+    {"spans", nullptr, &span_file},
+    {"span_sample", &span_sample, nullptr},
+    {"max_conns", &admit.max_conns, nullptr},
+    {"max_queue", &admit.max_queue, nullptr},
+    {"max_sync", &admit.max_sync, nullptr},
+    {"codel_target", &codel_target, nullptr},
+    {"codel_interval", &codel_interval, nullptr},
+    {"readahead", &prefetch.files, nullptr},
+    {"autotune", &autotune, nullptr},
+};
+
+// parse a "name=value" command line option
+int parse_option(char *arg)
+{
+    char *p = strchr(arg, '=');
+    if (p == nullptr)
+    {
+        return -1;
+    }
+    *p = '\0';
+    for (auto &opt : options)
+    {
+        if (strcmp(arg, opt.name) == 0)
+        {
+            if (opt.value != nullptr)
+            {
+                *opt.value = atoi(p + 1);
+            }
+            else
+            {
+                *opt.text = p + 1;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void on_trace_signal(int sig)
+{
+    if (sig == SIGUSR1)
+    {
+        trace_enabled.store(!trace_enabled.load());
+    }
+    else
+    {
+        trace_dump_pending = 1;
+    }
+}
+
+// bound a single blocking send or recv on fd to sec seconds
+void set_sock_timeout(int fd, int optname, int sec)
+{
+    struct timeval tv;
+    tv.tv_sec = sec;
+    tv.tv_usec = 0;
+    if (setsockopt(fd, SOL_SOCKET, optname, &tv, sizeof(tv)) < 0)
+    {
+        serror("set socket timeout error");
+    }
+}
+
+// release everything held by connection fd
+int close_conn(int fd)
+{
+    wheel.del(&idle_timers[fd2ind(fd)]);
+    evt.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &evt) < 0)
+    {
+        serror("delete epoll control error");
+    }
+    if (cwds[fd2ind(fd)] != "NULL" && !refused[fd2ind(fd)])
+    {
+        --conns;
+    }
+    cwds[fd2ind(fd)] = fs::path("NULL");
+    refused[fd2ind(fd)] = false;
+    ready_since[fd2ind(fd)] = 0;
+    prefetch.forget(fd);
+    if (transport_close(fd) < 0)
+    {
+        return serror("close socket error");
+    }
+    return 0;
+}
+
+// note in the capture that the session of fd ended without a QUIT
+void capture_close(int fd)
+{
+    if (capture.enabled())
+    {
+        capture.add(capture_clock(), sessions[fd2ind(fd)], CAPTURE_CLOSE, 0, nullptr, 0, 0);
+    }
+}
+
+// stop serving fd until unpark_conn, while it waits for its upload to be
+// made durable; out of epoll and the timer wheel nothing can close it
+void park_conn(int fd)
+{
+    wheel.del(&idle_timers[fd2ind(fd)]);
+    evt.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &evt) < 0)
+    {
+        serror("delete epoll control error");
+    }
+    parked[fd2ind(fd)] = true;
+}
+
+void unpark_conn(int fd)
+{
+    parked[fd2ind(fd)] = false;
+    evt.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &evt) < 0)
+    {
+        serror("add connfd epoll control error");
+    }
+    if (idle_timeout > 0)
+    {
+        wheel.add(&idle_timers[fd2ind(fd)], idle_timeout * 1000);
+    }
+}
+
+// how long the request on fd has waited: since its first byte arrived,
+// which the kernel stamps on TCP sockets with SO_TIMESTAMPNS, else since
+// epoll first reported fd readable
+uint64_t request_wait(int fd, uint64_t now)
+{
+    char byte;
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_PEEK | MSG_DONTWAIT) > 0)
+    {
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            {
+                struct timespec arrived, real;
+                memcpy(&arrived, CMSG_DATA(cmsg), sizeof(arrived));
+                clock_gettime(CLOCK_REALTIME, &real);
+                int64_t ns = (real.tv_sec - arrived.tv_sec) * 1000000000LL +
+                             real.tv_nsec - arrived.tv_nsec;
+                return std::max(ns, (int64_t)0);
+            }
+        }
+    }
+    uint64_t since = ready_since[fd2ind(fd)];
+    return since && now > since ? now - since : 0;
+}
+
+// everything can be turned away but the rest of an upload under way, which
+// would leave it half done, and a QUIT, which frees a connection
+bool sheddable(type t)
+{
+    return t != QUIT_REQUEST && t != HAVE_REQUEST && t != CHUNK_REQUEST && t != MANIFEST_REQUEST;
+}
+
+// answer a request with BUSY_REPLY instead of serving it; a refused
+// connection is closed after that
+void shed_request(int fd, int reason)
+{
+    busy_reply reply = {htonl(admit.retry_ms()), (uint8_t)reason};
+    if (send_post(fd, BUSY_REPLY, &reply, sizeof(reply)) < 0)
+    {
+        serror("send busy reply error");
+        reason = BUSY_CONNS;
+    }
+    if (reason == BUSY_CONNS)
+    {
+        close_conn(fd);
+    }
+}
+
+// what was shed since the last report, every 10 seconds at most
+void report_shed(uint64_t now)
+{
+    uint64_t *n = admit.shed;
+    if (now - shed_reported < 10000000000ULL || n[1] + n[2] + n[3] + n[4] == 0)
+    {
+        return;
+    }
+    fprintf(dfp, "shed %lu requests: %lu over max_conns, %lu over max_queue, %lu over max_sync, "
+                 "%lu over codel_target\n",
+            (unsigned long)(n[1] + n[2] + n[3] + n[4]), (unsigned long)n[1], (unsigned long)n[2],
+            (unsigned long)n[3], (unsigned long)n[4]);
+    memset(admit.shed, 0, sizeof(admit.shed));
+    shed_reported = now;
+}
+
+// path with its symlinks resolved as far as it exists, so that the fd
+// cache watches the directory that really holds a file
+std::string real_path(const fs::path &path)
+{
+    std::error_code ec;
+    fs::path real = fs::weakly_canonical(path, ec);
+    return ec ? path.lexically_normal() : real;
+}
+
+// key of args relative to the working directory of connection fd
+std::string conn_path(int fd, const char *args)
+{
+    fs::path &cwd = cwds[fd2ind(fd)];
+    return real_path((cwd == "NULL" ? dft_path : cwd) / args);
+}
+
+std::string conn_dir(int fd)
+{
+    fs::path &cwd = cwds[fd2ind(fd)];
+    return real_path(cwd == "NULL" ? dft_path : cwd);
+}
+
+// connection fd is getting path; have the kernel start reading the files
+// it will likely get next, through the cache so the GETs find them open
+void read_ahead(int fd, const std::string &path)
+{
+    for (auto &next : prefetch.next(fd, path))
+    {
+        if (fd_entry *e = fdcache.get(next))
+        {
+            posix_fadvise(e->fd, 0, std::min(e->size, (off_t)READAHEAD_BYTES), POSIX_FADV_WILLNEED);
+        }
+    }
+}
 
 int do_open(int fd, char *args = nullptr)
 {
     if (send_post(fd, OPEN_REPLY, nullptr, 0, 1) < 0)
     {
-        return serror("send open reply error");
+        return serror("send open reply error");
+    }
+    cwds[fd2ind(fd)] = dft_path;
+    return 0;
+}
+
+int do_quit(int fd, char *args)
+{
+    if (send_post(fd, QUIT_REPLY) < 0)
+    {
+        serror("send quit reply error");
+    }
+    return close_conn(fd);
+}
+
+int do_ls(int fd, char *args = nullptr)
+{
+    char buf[MAXBUF];
+    FILE *fp;
+
+    span_scope span("list");
+    if ((fp = popen("ls", "r")) == nullptr)
+    {
+        return serror("popen ls error");
+    }
+
+    int nread = fread((void *)buf, 1, MAXBUF, fp);
+    pclose(fp);
+    span.end();
+    buf[nread++] = '\0';
+    prefetch.listing(fd, conn_dir(fd));
+    prefetch.add_lines(fd, buf);
+
+    if (send_post(fd, LIST_REPLY, buf, nread) < 0)
+    {
+        return serror("send ls reply error");
+    }
+    return 0;
+}
+
+int do_cd(int fd, char *args)
+{
+    status s = fs::exists(args);
+
+    if (send_post(fd, CD_REPLY, nullptr, 0, s) < 0)
+    {
+        return serror("send cd reply error");
+    }
+
+    if (s == 1)
+    {
+        cwds[fd2ind(fd)] = fs::canonical(fs::absolute(args));
+    }
+
+    return 0;
+}
+
+// write the manifest data to path, replacing whatever was there, and mark
+// the file as one
+int write_manifest(const char *path, const std::string &data)
+{
+    int filefd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (filefd < 0)
+    {
+        return serror("open file error (w)");
+    }
+    int scode = manifest_mark(filefd, true);
+    if (scode < 0)
+    {
+        serror("mark manifest error");
+    }
+    else
+    {
+        scode = swrite(filefd, (void *)data.data(), data.size());
+    }
+    if (close(filefd) < 0 || scode < 0)
+    {
+        return serror("write file error");
+    }
+    return 0;
+}
+
+// whether every chunk a manifest lists is stored
+bool manifest_stored(const std::vector<manifest_entry> &entries)
+{
+    for (auto &e : entries)
+    {
+        if (!chunks.has(e.hash))
+        {
+            serror("missing chunk");
+            return false;
+        }
+    }
+    return true;
+}
+
+// walk the chunk files of a manifest in order, calling f(i, cfd, n) with
+// the chunk index, an open descriptor and its length; stops at the first
+// chunk that can't be opened or that f fails on
+template <typename F>
+int manifest_walk(const std::vector<manifest_entry> &entries, F f)
+{
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        int cfd = chunks.open(entries[i].hash);
+        int scode = cfd < 0 ? -1 : f(i, cfd, (off_t)ntohl(entries[i].length));
+        if (cfd >= 0)
+        {
+            close(cfd);
+        }
+        if (scode < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// stream the file a manifest describes straight from its chunk files,
+// framed the same way send_stream frames a plain file
+int send_manifest(int fd, const std::vector<manifest_entry> &entries, uint64_t size, status flags)
+{
+    if (flags == 0)
+    {
+        off_t left = std::min(size, (uint64_t)MAXBUF);
+        struct ftp_header header(FILE_DATA, HEADER_SIZE + left, 0);
+        if (ssend(fd, (void *)&header, HEADER_SIZE, left > 0 ? MSG_MORE : 0) <= 0)
+        {
+            return -1;
+        }
+        int scode = manifest_walk(entries, [&](size_t i, int cfd, off_t n)
+                                  {
+                                      n = std::min(n, left);
+                                      left -= n;
+                                      return n > 0 ? send_range(fd, cfd, 0, n) : 0;
+                                  });
+        return scode < 0 ? serror("send chunk error") : 0;
+    }
+
+    off_t pos = 0;
+    int scode = manifest_walk(entries, [&](size_t i, int cfd, off_t n)
+                              {
+                                  status s = flags | DATA_MORE;
+                                  if (i + 1 == entries.size() && (flags & DATA_EXTENT) == 0)
+                                  {
+                                      s &= ~DATA_MORE;
+                                  }
+                                  pos += n;
+                                  return send_chunk(fd, cfd, 0, n, s, pos - n);
+                              });
+    if (scode < 0)
+    {
+        return serror("send chunk error");
+    }
+    if ((flags & DATA_EXTENT) || entries.empty())
+    {
+        return send_chunk(fd, -1, 0, 0, flags & ~DATA_MORE, pos);
+    }
+    return 0;
+}
+
+// the file a manifest describes assembled in a sealed memfd: a snapshot
+// a local client can map or copy from, and that nobody can change under it
+int manifest_memfd(const std::vector<manifest_entry> &entries)
+{
+    int mfd = memfd_create("ftp_get", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mfd >= 0 && manifest_walk(entries, [&](size_t i, int cfd, off_t n)
+                                  { return send_range(mfd, cfd, 0, n); }) < 0)
+    {
+        close(mfd);
+        return serror("assemble manifest error");
+    }
+    if (mfd >= 0 &&
+        fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+    {
+        close(mfd);
+        return serror("seal memfd error");
+    }
+    return mfd;
+}
+
+// hand a local client the file itself instead of streaming it, a plain
+// file is passed as it is so the client sees later changes to it; returns
+// 1 if the file has to be streamed after all
+int pass_file(int fd, const char *args, bool manifest, const std::vector<manifest_entry> &entries)
+{
+    if (!local_conn[fd2ind(fd)] || !(m_status & DATA_STREAM) || !(m_status & DATA_FD))
+    {
+        return 1;
+    }
+    int passfd = manifest ? manifest_memfd(entries) : open(args, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (passfd < 0 || fstat(passfd, &st) < 0)
+    {
+        if (passfd >= 0)
+        {
+            close(passfd);
+        }
+        return 1;
+    }
+    uint64_t size = htobe64(st.st_size);
+    int scode = send_post_fd(fd, GET_REPLY, &size, sizeof(size), 1 | DATA_FD, passfd);
+    close(passfd);
+    m_bytes = st.st_size;
+    return scode < 0 ? serror("send get reply error") : 0;
+}
+
+int do_get(int fd, char *args)
+{
+    std::string path = conn_path(fd, args);
+    fd_entry *e = fdcache.get(path);
+    status s = e != nullptr;
+    if (s == 1)
+    {
+        read_ahead(fd, path);
+    }
+
+    // a deduplicated file is served from its chunks, all of them must exist
+    std::vector<manifest_entry> entries;
+    uint64_t msize = 0;
+    bool manifest = s == 1 && manifest_read(e->fd, e->size, entries, &msize);
+    if (manifest && !manifest_stored(entries))
+    {
+        s = 0;
+    }
+
+    int scode = s == 1 ? pass_file(fd, args, manifest, entries) : 1;
+    if (scode <= 0)
+    {
+        return scode;
+    }
+
+    if (send_post(fd, GET_REPLY, nullptr, 0, s, s ? MSG_MORE : 0) < 0)
+    {
+        return serror("send get reply error");
+    }
+
+    if (s == 0)
+    {
+        return 0;
+    }
+
+    // a single FILE_DATA frame has to fit in the peer's buffer
+    status flags = data_flags(m_status);
+    if (manifest)
+    {
+        m_bytes = msize;
+        cork(fd, 1);
+        scode = send_manifest(fd, entries, msize, flags);
+        cork(fd, 0);
+        return scode < 0 ? serror("send file data error") : 0;
+    }
+    off_t size = flags ? e->size : std::min(e->size, (off_t)MAXBUF);
+    m_bytes = size;
+    if (send_stream(fd, e->fd, size, flags) < 0)
+    {
+        return serror("send file data error");
+    }
+
+    return 0;
+}
+
+int do_put(int fd, char *args)
+{
+    bool ack = (m_status & DATA_STREAM) && (m_status & PUT_ACK);
+    if (send_post(fd, PUT_REPLY, nullptr, 0, data_flags(m_status) | (ack ? PUT_ACK : 0)) < 0)
+    {
+        return serror("send put reply error");
+    }
+
+    // the data is still drained if the file can't be opened; deduplicated
+    // files are received into an unnamed file and replaced once complete,
+    // others under a temporary name renamed once every frame checked out
+    std::string path = conn_path(fd, args);
+    std::string part;
+    fdcache.invalidate(path);
+    span_scope span("open");
+    int filefd;
+    if (dedup)
+    {
+        filefd = open(chunks.root.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+    else
+    {
+        part = std::string(args) + ".part." + std::to_string(fd);
+        filefd = open(part.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    span.end();
+    if (filefd < 0)
+    {
+        serror("open file error (w)");
+    }
+
+    if (stall_timeout != header_timeout)
+    {
+        set_sock_timeout(fd, SO_RCVTIMEO, stall_timeout);
+    }
+    off_t size = recv_stream(fd, filefd);
+    if (stall_timeout != header_timeout)
+    {
+        set_sock_timeout(fd, SO_RCVTIMEO, header_timeout);
+    }
+    m_bytes = std::max(size, (off_t)0);
+
+    if (dedup && size >= 0 && filefd >= 0)
+    {
+        struct stat st;
+        std::vector<manifest_entry> entries;
+        std::string manifest;
+        if (fstat(filefd, &st) < 0 || chunks.put_file(filefd, st.st_size, entries) < 0)
+        {
+            size = serror("store chunks error");
+        }
+        else
+        {
+            manifest_pack(entries, st.st_size, manifest);
+            size = write_manifest(args, manifest);
+        }
+    }
+    else if (size >= 0 && filefd >= 0 && rename(part.c_str(), args) < 0)
+    {
+        size = serror("rename file error");
+    }
+    if (size < 0 || filefd < 0)
+    {
+        if (filefd >= 0)
+        {
+            close(filefd);
+        }
+        if (filefd >= 0 && !part.empty())
+        {
+            unlink(part.c_str());
+        }
+        if (ack)
+        {
+            send_post(fd, PUT_REPLY, nullptr, 0, 0);
+        }
+        else if (size < 0)
+        {
+            // without an ack dropping the connection is the only way left
+            // to tell the client its data didn't arrive intact
+            close_conn(fd);
+        }
+        return serror("recv file data error");
+    }
+
+    // a deduplicated file lives in many chunk files, its filesystem is
+    // synced as a whole; a renamed file needs its directory entry synced
+    sync_job job = {filefd, ack ? fd : -1, ack, "", dedup, true};
+    if (!dedup)
+    {
+        job.dir = real_path(fs::absolute(args).parent_path());
+    }
+    if (durability == DURABILITY_GROUP)
+    {
+        syncer.submit(job);
+        ++sync_queued;
+        if (ack)
+        {
+            park_conn(fd);
+        }
+        return 0;
+    }
+    if (durability == DURABILITY_FILE)
+    {
+        job.ok = dedup ? syncfs(filefd) == 0 : sync_file(filefd, job.dir);
+    }
+    close(filefd);
+    if (ack && send_post(fd, PUT_REPLY, nullptr, 0, job.ok) < 0)
+    {
+        return serror("send put ack error");
+    }
+    return job.ok ? 0 : serror("sync file error");
+}
+
+// sha256sum style line for the file a manifest describes
+int manifest_sha(const std::vector<manifest_entry> &entries, const char *path, char *out)
+{
+    static char buf[1 << 16];
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    for (auto &e : entries)
+    {
+        int cfd = chunks.open(e.hash);
+        if (cfd < 0)
+        {
+            return serror("missing chunk");
+        }
+        ssize_t n;
+        while ((n = read(cfd, buf, sizeof(buf))) > 0)
+        {
+            sha256_update(&ctx, buf, n);
+        }
+        close(cfd);
+    }
+    uint8_t digest[SHA256_LEN];
+    char hex[2 * SHA256_LEN + 1];
+    sha256_final(&ctx, digest);
+    sha256_hex(digest, hex);
+    return sprintf(out, "%s  %s\n", hex, path);
+}
+
+int do_sha(int fd, char *args)
+{
+    status s = fs::exists(args);
+
+    if (send_post(fd, SHA_REPLY, nullptr, 0, s, s ? MSG_MORE : 0) < 0)
+    {
+        return serror("send sha256 reply error");
+    }
+
+    if (s == 0)
+    {
+        return 0;
+    }
+
+    fs::path p = fs::canonical(fs::absolute(args));
+    char buf[MAXBUF];
+    int nread = -1;
+    span_scope span("hash");
+    int filefd = open(args, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    std::vector<manifest_entry> entries;
+    uint64_t msize;
+    if (filefd >= 0 && fstat(filefd, &st) == 0 && manifest_read(filefd, st.st_size, entries, &msize))
+    {
+        nread = manifest_sha(entries, p.c_str(), buf);
     }
-    cwds[fd2ind(fd)] = dft_path;
+    if (filefd >= 0)
+    {
+        close(filefd);
+    }
+    if (nread < 0)
+    {
+        sprintf(buf, "sha256sum %s", p.c_str());
+        FILE *fp;
+        if ((fp = popen(buf, "r")) == nullptr)
+        {
+            return serror("popen sha256sum error");
+        }
+        nread = fread((void *)buf, 1, MAXBUF, fp);
+        pclose(fp);
+    }
+    span.end();
+    buf[nread++] = '\0';
+
+    if (send_post(fd, FILE_DATA, buf, nread) < 0)
+    {
+        return serror("send file data error");
+    }
+
     return 0;
 }
 
-int do_quit(int fd, char *args)
+// Merkle root of a file, with the leaf hashes if asked for; status 0 if
+// the file can't be read
+int do_tree(int fd, char *args)
 {
-    if (send_post(fd, QUIT_REPLY) < 0)
+    struct tree_request req;
+    memcpy(&req, args, sizeof(req));
+    const char *path = args + sizeof(req);
+    int shift = std::max(TREE_SHIFT_MIN, std::min((int)req.shift, TREE_SHIFT_MAX));
+
+    // a deduplicated file is read from its chunks
+    int filefd = m_length > (int)sizeof(req) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    std::vector<manifest_entry> entries;
+    std::vector<off_t> starts;
+    uint64_t size = 0;
+    tree_reader reader;
+    if (filefd >= 0 && fstat(filefd, &st) == 0 && S_ISREG(st.st_mode) &&
+        manifest_read(filefd, st.st_size, entries, &size))
     {
-        return serror("send quit reply error");
+        off_t offset = 0;
+        for (auto &e : entries)
+        {
+            starts.push_back(offset);
+            offset += ntohl(e.length);
+        }
+        reader = [&](void *buf, size_t n, off_t offset) -> ssize_t
+        {
+            size_t i = std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+            off_t skip = offset - starts[i];
+            int cfd = chunks.open(entries[i].hash);
+            ssize_t b = cfd < 0 ? -1 : pread(cfd, buf, std::min(n, (size_t)(ntohl(entries[i].length) - skip)), skip);
+            if (cfd >= 0)
+            {
+                close(cfd);
+            }
+            return b;
+        };
     }
-    evt.data.fd = fd;
-    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &evt) < 0)
+    else if (filefd >= 0 && S_ISREG(st.st_mode))
     {
-        serror("delete epoll control error");
+        size = st.st_size;
+        reader = [filefd](void *buf, size_t n, off_t offset)
+        {
+            return pread(filefd, buf, n, offset);
+        };
+    }
+
+    static char buf[sizeof(tree_reply) + TREE_LEAVES * SHA256_LEN];
+    struct tree_reply *reply = (struct tree_reply *)buf;
+    std::vector<tree_digest> leaves;
+    shift = req.leaves ? tree_fit_shift(size, shift) : shift;
+    status s = reader && tree_hash(reader, size, shift, tree_threads, leaves, reply->root) == 0;
+    if (filefd >= 0)
+    {
+        close(filefd);
     }
-    if (close(fd) < 0)
+    int count = s && req.leaves ? leaves.size() : 0;
+    reply->size = htobe64(size);
+    reply->shift = shift;
+    reply->count = htonl(count);
+    memcpy(buf + sizeof(tree_reply), leaves.data(), count * SHA256_LEN);
+    m_bytes = s ? size : 0;
+    if (send_post(fd, TREE_REPLY, buf, s ? sizeof(tree_reply) + count * SHA256_LEN : 0, s) < 0)
     {
-        return serror("close socket error");
+        return serror("send tree reply error");
     }
-    cwds[fd2ind(fd)] = fs::path("NULL");
     return 0;
 }
 
-int do_ls(int fd, char *args = nullptr)
+// one page of the working directory with metadata, status 1 if more follow;
+// an empty reply means the directory could not be read
+int do_lsx(int fd, char *args)
 {
-    char buf[MAXBUF];
-    FILE *fp;
+    struct list_request req;
+    memcpy(&req, args, sizeof(req));
 
-    if ((fp = popen("ls", "r")) == nullptr)
+    static char buf[LISTX_PAGE];
+    bool more = false;
+    int size = -1;
+    int dfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0)
     {
-        return serror("popen ls error");
+        size = list_fill(dfd, be64toh(req.cursor), ntohl(req.limit), buf, &more);
+        close(dfd);
+    }
+    if (size > 0)
+    {
+        if (req.cursor == 0)
+        {
+            prefetch.listing(fd, conn_dir(fd));
+        }
+        prefetch.add_page(fd, buf, size);
+    }
+    if (size < 0)
+    {
+        serror("read directory error");
+        size = 0;
     }
 
-    int nread = fread((void *)buf, 1, MAXBUF, fp);
-    pclose(fp);
-    buf[nread++] = '\0';
-
-    if (send_post(fd, LIST_REPLY, buf, nread) < 0)
+    if (send_post(fd, LISTX_REPLY, buf, size, more) < 0)
     {
-        return serror("send ls reply error");
+        return serror("send lsx reply error");
     }
     return 0;
 }
 
-int do_cd(int fd, char *args)
+// copy the regular file src over dst, both relative to the working directory
+int copy_path(const char *src, const char *dst)
 {
-    status s = fs::exists(args);
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    struct stat st, dst_st;
+    if (in < 0 || fstat(in, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        if (in >= 0)
+        {
+            close(in);
+        }
+        return serror("open copy source error");
+    }
+    // truncating the source itself would lose it
+    if (stat(dst, &dst_st) == 0 && dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino)
+    {
+        close(in);
+        return serror("copy onto itself");
+    }
 
-    if (send_post(fd, CD_REPLY, nullptr, 0, s) < 0)
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+    if (out < 0)
     {
-        return serror("send cd reply error");
+        close(in);
+        return serror("open copy target error");
+    }
+    // a copied manifest stands for the same file, a target that was one
+    // no longer is unless the source is too
+    struct manifest_header header;
+    int scode = manifest_mark(out, manifest_head(in, st.st_size, &header));
+    if (scode == 0)
+    {
+        scode = copy_data(in, out, st.st_size);
+    }
+    close(in);
+    if (close(out) < 0 || scode < 0)
+    {
+        unlink(dst);
+        return -1;
     }
+    return 0;
+}
+
+// split a "src\0dst\0" request into its two paths
+int copy_args(char *args, char **dst)
+{
+    size_t len = strlen(args);
+    *dst = args + len + 1;
+    if (len == 0 || **dst == '\0')
+    {
+        return serror("bad copy arguments");
+    }
+    return 0;
+}
 
+int do_copy(int fd, char *args)
+{
+    char *dst;
+    status s = copy_args(args, &dst) == 0;
     if (s == 1)
     {
-        cwds[fd2ind(fd)] = fs::canonical(fs::absolute(args));
+        fdcache.invalidate(conn_path(fd, dst));
+        s = copy_path(args, dst) == 0;
     }
 
+    if (send_post(fd, COPY_REPLY, nullptr, 0, s) < 0)
+    {
+        return serror("send copy reply error");
+    }
     return 0;
 }
 
-int do_get(int fd, char *args)
+int do_move(int fd, char *args)
 {
-    status s = fs::exists(args);
+    char *dst;
+    status s = copy_args(args, &dst) == 0;
+    if (s == 1)
+    {
+        fdcache.invalidate(conn_path(fd, args));
+        fdcache.invalidate(conn_path(fd, dst));
+        s = rename(args, dst) == 0;
+        // across filesystems the data has to be copied after all
+        if (s == 0 && errno == EXDEV)
+        {
+            s = copy_path(args, dst) == 0 && unlink(args) == 0;
+        }
+    }
 
-    if (send_post(fd, GET_REPLY, nullptr, 0, s) < 0)
+    if (send_post(fd, MOVE_REPLY, nullptr, 0, s) < 0)
     {
-        return serror("send get reply error");
+        return serror("send move reply error");
     }
+    return 0;
+}
 
-    if (s == 0)
+// which of the hashes in the request are stored, one byte each;
+// status 0 tells the client this server doesn't deduplicate
+int do_have(int fd, char *args)
+{
+    static char have[HAVE_BATCH];
+    int n = dedup ? std::min(m_length / SHA256_LEN, HAVE_BATCH) : 0;
+    for (int i = 0; i < n; ++i)
     {
-        return 0;
+        have[i] = chunks.has((uint8_t *)args + i * SHA256_LEN);
     }
 
-    char buf[MAXBUF];
-    int size;
-    if ((size = read_file(args, buf, MAXBUF)) < 0)
+    if (send_post(fd, HAVE_REPLY, have, n, dedup) < 0)
     {
-        return -1;
+        return serror("send have reply error");
     }
+    return 0;
+}
 
-    if (send_post(fd, FILE_DATA, buf, size) < 0)
+// store the chunk in the request, replying with its hash
+int do_chunk(int fd, char *args)
+{
+    uint8_t hash[SHA256_LEN];
+    status s = dedup && m_length > 0 && m_length <= CDC_MAX;
+    if (s == 1)
     {
-        return serror("send file data error");
+        span_scope span("store chunk");
+        sha256(args, m_length, hash);
+        s = chunks.put(hash, args, m_length) == 0;
     }
 
+    if (send_post(fd, CHUNK_REPLY, hash, s ? SHA256_LEN : 0, s) < 0)
+    {
+        return serror("send chunk reply error");
+    }
     return 0;
 }
 
-int do_put(int fd, char *args)
+// "path\0" and a manifest, written to path if all its chunks are stored
+int do_manifest(int fd, char *args)
 {
-    if (send_post(fd, PUT_REPLY) < 0)
+    size_t len = strnlen(args, m_length);
+    char *p = args + len + 1;
+    size_t rest = len < (size_t)m_length ? m_length - len - 1 : 0;
+    struct manifest_header header;
+    status s = dedup && len > 0 && rest >= sizeof(header);
+    if (s == 1)
     {
-        return serror("send put reply error");
+        memcpy(&header, p, sizeof(header));
+        s = memcmp(header.magic, MANIFEST_MAGIC, sizeof(header.magic)) == 0 &&
+            rest == sizeof(header) + (size_t)ntohl(header.count) * sizeof(manifest_entry);
     }
-    
-    char buf[MAXBUF];
-    int size;
-    type m_type;
-    if ((size = recv_post(fd, buf, &m_type)) < 0)
+    uint64_t size = 0;
+    manifest_entry *entries = (manifest_entry *)(p + sizeof(header));
+    for (uint32_t i = 0; s == 1 && i < ntohl(header.count); ++i)
     {
-        return serror("recv file data error");
+        s = chunks.has(entries[i].hash);
+        size += ntohl(entries[i].length);
     }
-    if (m_type != FILE_DATA)
+    if (s == 1 && size == be64toh(header.size))
     {
-        return serror("bad file data");
+        fdcache.invalidate(conn_path(fd, args));
+        s = write_manifest(args, std::string(p, rest)) == 0;
+    }
+    else
+    {
+        s = 0;
     }
 
-    if (write_file(args, buf, size) < 0)
+    if (send_post(fd, MANIFEST_REPLY, nullptr, 0, s) < 0)
     {
-        return -1;
+        return serror("send manifest reply error");
     }
     return 0;
 }
 
-int do_sha(int fd, char *args)
+// every regular file matching the "pattern\0..." globs of the request in
+// one bundle; a pattern matching nothing is taken as a plain path
+int do_bundle(int fd, char *args)
 {
-    status s = fs::exists(args);
-
-    if (send_post(fd, SHA_REPLY, nullptr, 0, s) < 0)
+    glob_t g;
+    int flags = GLOB_NOCHECK;
+    memset(&g, 0, sizeof(g));
+    span_scope span("glob");
+    for (char *p = args; p < args + m_length && *p != '\0'; p += strlen(p) + 1)
     {
-        return serror("send sha256 reply error");
+        glob(p, flags, nullptr, &g);
+        flags |= GLOB_APPEND;
     }
 
-    if (s == 0)
+    if (send_post(fd, BUNDLE_REPLY, nullptr, 0, 1, MSG_MORE) < 0)
     {
-        return 0;
+        globfree(&g);
+        return serror("send bundle reply error");
     }
 
-    fs::path p = fs::canonical(fs::absolute(args));
-    char buf[MAXBUF];
-    sprintf(buf, "sha256sum %s", p.c_str());
-    FILE *fp;
-    if ((fp = popen(buf, "r")) == nullptr)
+    bundle_writer bundle(fd);
+    int scode = 0;
+    cork(fd, 1);
+    for (size_t i = 0; i < g.gl_pathc && scode == 0; ++i)
     {
-        return serror("popen sha256sum error");
+        int filefd = open(g.gl_pathv[i], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        std::vector<manifest_entry> entries;
+        uint64_t msize = 0;
+        bool regular = filefd >= 0 && fstat(filefd, &st) == 0 && S_ISREG(st.st_mode);
+        if (regular && manifest_read(filefd, st.st_size, entries, &msize))
+        {
+            // a deduplicated file goes in as the file it stands for
+            if (manifest_stored(entries))
+            {
+                scode = bundle.entry(g.gl_pathv[i], msize, st.st_mode);
+                if (scode == 0)
+                {
+                    scode = manifest_walk(entries, [&](size_t, int cfd, off_t n)
+                                          { return bundle.data(cfd, n); });
+                }
+                m_bytes += msize;
+            }
+        }
+        else if (regular)
+        {
+            scode = bundle.add(g.gl_pathv[i], filefd, st);
+            m_bytes += st.st_size;
+        }
+        if (filefd >= 0)
+        {
+            close(filefd);
+        }
     }
-    int nread = fread((void *)buf, 1, MAXBUF, fp);
-    pclose(fp);
-    buf[nread++] = '\0';
-
-    if (send_post(fd, FILE_DATA, buf, nread) < 0)
+    globfree(&g);
+    if (scode == 0)
     {
-        return serror("send file data error");
+        scode = bundle.flush(true);
     }
+    cork(fd, 0);
+    if (scode < 0)
+    {
+        return serror("send bundle error");
+    }
+    return 0;
+}
 
+// what the server has seen of its connections: the admission counters and
+// what autotuning measured on each TCP connection that moved a file
+int do_stats(int fd, char *args)
+{
+    std::string text;
+    char line[512];
+    uint64_t *n = admit.shed;
+    snprintf(line, sizeof(line), "%d connections, %lu requests shed since the last report\n",
+             conns, (unsigned long)(n[1] + n[2] + n[3] + n[4]));
+    text += line;
+    for (int i = 0; i < MAXCONN && text.size() + sizeof(line) < (MAXBUF); ++i)
+    {
+        if (cwds[i] == "NULL" || tuners[i].transfers == 0)
+        {
+            continue;
+        }
+        int len = snprintf(line, sizeof(line), "conn %d: ", sessions[i]);
+        tuners[i].describe(i + 2, line + len, sizeof(line) - len);
+        text += line;
+    }
+    if (send_post(fd, STATS_REPLY, (void *)text.c_str(), text.size() + 1) < 0)
+    {
+        return serror("send stats reply error");
+    }
     return 0;
 }
 
@@ -175,21 +1188,66 @@ int (*funcs[])(int, char *) = {
     do_put,
     do_sha,
     do_quit,
+    do_lsx,
+    do_copy,
+    do_move,
+    do_have,
+    do_chunk,
+    do_manifest,
+    do_bundle,
+    do_tree,
+    do_stats,
 };
+const int nfuncs = sizeof(funcs) / sizeof(funcs[0]);
 
 int main(int argc, char **argv)
 {
     // check if command line is valid
-    if (argc != 3)
+    if (argc < 3)
     {
-        printf("usage: ftp_server <IPaddr> <Port>\n");
+        printf("usage: ftp_server <IPaddr> <Port> [option=value ...]\n");
         return 0;
     }
+    for (int i = 3; i < argc; ++i)
+    {
+        if (parse_option(argv[i]) < 0)
+        {
+            printf("unknown option: %s\n", argv[i]);
+            return 0;
+        }
+    }
+
+    // tracing
+    char default_trace_file[64];
+    if (trace_file == nullptr)
+    {
+        sprintf(default_trace_file, "/tmp/ftp_server.%d.trace", getpid());
+        trace_file = default_trace_file;
+    }
+    trace_enabled = trace_on != 0;
+    signal(SIGUSR1, on_trace_signal);
+    signal(SIGUSR2, on_trace_signal);
+    // a client that gives up mid-transfer must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // allow as many descriptors as we have connection slots
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < MAXCONN + 16)
+    {
+        rl.rlim_cur = std::min(rl.rlim_max, (rlim_t)MAXCONN + 16);
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 
     // initialize listenfd
     char *ip = argv[1];
     int port = atoi(argv[2]);
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    rtp = strcmp(transport, "rtp") == 0;
+    if (!rtp && strcmp(transport, "tcp") != 0)
+    {
+        printf("unknown transport: %s\n", transport);
+        return 0;
+    }
+    int listenfd = rtp ? -1 : socket(AF_INET, SOCK_STREAM, 0);
     struct sockaddr_in servaddr;
     servaddr.sin_port = htons(port);
     servaddr.sin_family = AF_INET;
@@ -198,22 +1256,90 @@ int main(int argc, char **argv)
         close(listenfd);
         return serror("inet_pton error");
     }
-    if (bind(listenfd, (struct sockaddr *)&servaddr, sizeof(servaddr)))
+    // over RTP requests come in on a UDP socket taking connections
+    if (rtp && (listenfd = transport_listen(ip, port)) < 0)
+    {
+        return serror("rtp listen error");
+    }
+    if (!rtp && bind(listenfd, (struct sockaddr *)&servaddr, sizeof(servaddr)))
     {
         close(listenfd);
         return serror("bind error");
     }
-    if (listen(listenfd, LISTENQ) < 0)
+    if (!rtp && listen(listenfd, LISTENQ) < 0)
     {
         close(listenfd);
         return serror("listen error");
     }
 
+    // same host clients can skip TCP through a unix socket
+    int unixfd = -1;
+    if (unix_path != nullptr)
+    {
+        struct sockaddr_un unaddr;
+        memset(&unaddr, 0, sizeof(unaddr));
+        unaddr.sun_family = AF_UNIX;
+        if (strlen(unix_path) >= sizeof(unaddr.sun_path))
+        {
+            return serror("unix socket path too long");
+        }
+        strcpy(unaddr.sun_path, unix_path);
+        unlink(unix_path);
+        unixfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (unixfd < 0 || bind(unixfd, (struct sockaddr *)&unaddr, sizeof(unaddr)) < 0 ||
+            listen(unixfd, LISTENQ) < 0)
+        {
+            return serror("unix socket listen error");
+        }
+    }
+
     // initialize path settings
     dft_path = fs::current_path();
+
+    if (capture_file != nullptr && capture.open(capture_file) < 0)
+    {
+        return serror("open capture file error");
+    }
+    if (span_file != nullptr && spans.open(span_file, span_sample) < 0)
+    {
+        return serror("open span file error");
+    }
+
+    // durability policy
+    const char *durabilities[] = {"none", "file", "group"};
+    durability = -1;
+    for (int i = 0; i < 3; ++i)
+    {
+        if (strcmp(durability_text, durabilities[i]) == 0)
+        {
+            durability = i;
+        }
+    }
+    if (durability < 0)
+    {
+        printf("unknown durability: %s\n", durability_text);
+        return 0;
+    }
+
+    // chunks of deduplicated files are read whatever the storage mode
+    chunks.root = chunk_dir ? fs::absolute(chunk_dir) : dft_path / ".ftp_chunks";
+    dedup = strcmp(storage, "dedup") == 0;
+    if (!dedup && strcmp(storage, "plain") != 0)
+    {
+        printf("unknown storage: %s\n", storage);
+        return 0;
+    }
+    std::error_code ec;
+    if (dedup && !fs::create_directories(chunks.root, ec) && ec)
+    {
+        return serror("create chunk directory error");
+    }
+    admit.delay.target_ns = (uint64_t)codel_target * 1000000;
+    admit.delay.interval_ns = (uint64_t)std::max(codel_interval, 1) * 1000000;
     for (int i = 0; i < MAXCONN; ++i)
     {
         cwds[i] = fs::path("NULL");
+        idle_timers[i].fd = i + 2;
     }
 
     // initialize epoll
@@ -224,6 +1350,28 @@ int main(int argc, char **argv)
     {
         serror("add listenfd epoll control error");
     }
+    evt.data.fd = unixfd;
+    if (unixfd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, unixfd, &evt))
+    {
+        serror("add unix listenfd epoll control error");
+    }
+    evt.data.fd = fdcache.ifd;
+    if (fdcache.ifd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, fdcache.ifd, &evt))
+    {
+        serror("add inotify epoll control error");
+    }
+    if (durability == DURABILITY_GROUP)
+    {
+        if (syncer.start() < 0)
+        {
+            return serror("start sync thread error");
+        }
+        evt.data.fd = syncer.efd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, syncer.efd, &evt))
+        {
+            return serror("start sync thread error");
+        }
+    }
 
     // listen
     int connfd;
@@ -234,49 +1382,229 @@ int main(int argc, char **argv)
     char buf[MAXBUF];
     while (true)
     {
-        int nevents = epoll_wait(epfd, events, MAXEPOLL, -1);
+        int nevents = epoll_wait(epfd, events, MAXEPOLL, transport_timeout(wheel.timeout()));
+        nevents = transport_ready(events, nevents, MAXEPOLL);
+
+        // requests wait from the first time epoll reports them, and that
+        // is when the capture has them arrive; both clocks are monotonic
+        uint64_t polled = admit.enabled() ? span_clock() : 0;
+        uint64_t ready = polled ? polled : capture.enabled() ? capture_clock() : 0;
+        for (int i = 0; ready && i < nevents; ++i)
+        {
+            int ind = fd2ind(events[i].data.fd);
+            if (ind >= 0 && ind < MAXCONN && ready_since[ind] == 0)
+            {
+                ready_since[ind] = ready;
+            }
+        }
+        if (trace_dump_pending)
+        {
+            trace_dump_pending = 0;
+            if (trace_dump(trace_file) < 0)
+            {
+                serror("dump trace error");
+            }
+        }
+
+        // apply file changes before serving any request of this batch
+        for (int i = 0; i < nevents; ++i)
+        {
+            if (events[i].data.fd == fdcache.ifd)
+            {
+                fdcache.handle_events();
+            }
+        }
+
         for (int i = 0; i < nevents; ++i)
         {
             connfd = events[i].data.fd;
+            if (connfd == fdcache.ifd)
+            {
+                continue;
+            }
+
+            // answer the uploads whose batch is durable now
+            if (connfd == syncer.efd)
+            {
+                for (auto &job : syncer.collect())
+                {
+                    --sync_queued;
+                    close(job.filefd);
+                    if (job.connfd < 0)
+                    {
+                        continue;
+                    }
+                    unpark_conn(job.connfd);
+                    if (send_post(job.connfd, PUT_REPLY, nullptr, 0, job.ok) < 0)
+                    {
+                        serror("send put ack error");
+                        close_conn(job.connfd);
+                    }
+                }
+                continue;
+            }
 
             // recv new connection
-            if (connfd == listenfd)
+            if (connfd == listenfd || connfd == unixfd)
             {
-                if ((connfd = accept(listenfd, (struct sockaddr *)&cliaddr, &clilen)) < 0)
+                int lfd = connfd;
+                clilen = sizeof(cliaddr);
+                if (rtp && lfd == listenfd)
+                {
+                    // nothing to accept if it was a repeated SYN; the
+                    // handshake runs here and stalls every other connection
+                    // for up to SEND_TR * SEND_MS when the peer is slow
+                    if ((connfd = transport_accept(lfd, rtp_window)) < 0)
+                    {
+                        continue;
+                    }
+                }
+                else if ((connfd = accept(lfd, (struct sockaddr *)&cliaddr, &clilen)) < 0)
                 {
                     serror("accept error");
                     continue;
                 }
+                if (fd2ind(connfd) >= MAXCONN)
+                {
+                    serror("too many connections");
+                    transport_close(connfd);
+                    continue;
+                }
                 evt.data.fd = connfd;
                 if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &evt))
                 {
                     serror("add connfd epoll control error");
                 }
+                cwds[fd2ind(connfd)] = dft_path;
+                refused[fd2ind(connfd)] = admit.max_conns > 0 && conns >= admit.max_conns;
+                conns += !refused[fd2ind(connfd)];
+                sessions[fd2ind(connfd)] = ++next_session;
+                local_conn[fd2ind(connfd)] = lfd == unixfd;
+                tuners[fd2ind(connfd)] = tcp_tuner();
+
+                // request arrival times tell admission control the queueing delay
+                int on = 1;
+                if (admit.enabled() && !rtp &&
+                    setsockopt(connfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+                {
+                    serror("set socket timestamps error");
+                }
+
+                // a frame must arrive and data must keep flowing in time
+                set_sock_timeout(connfd, SO_RCVTIMEO, header_timeout);
+                set_sock_timeout(connfd, SO_SNDTIMEO, stall_timeout);
+                if (idle_timeout > 0)
+                {
+                    wheel.add(&idle_timers[fd2ind(connfd)], idle_timeout * 1000);
+                }
+                continue;
+            }
+
+            // an RTP connection may have taken in nothing but ACKs, and one
+            // held back while its upload is made durable waits for the reply
+            if (parked[fd2ind(connfd)] || !transport_readable(connfd))
+            {
+                ready_since[fd2ind(connfd)] = 0;
                 continue;
             }
 
-            // recv request
+            // recv request, the peer is gone or too slow if this fails
+            uint64_t waited = polled ? request_wait(connfd, span_clock()) : 0;
+            uint64_t arrival = capture.enabled() ? ready_since[fd2ind(connfd)] : 0;
+            ready_since[fd2ind(connfd)] = 0;
+            spans.begin(sessions[fd2ind(connfd)], connfd);
             memset(buf, 0, sizeof(buf));
-            if (recv_post(connfd, buf, &m_type) < 0)
+            if ((m_length = recv_post(connfd, buf, &m_type, &m_status)) < 0)
             {
                 serror("recv request error");
+                spans.end("closed", 0, 0, 0, 0);
+                capture_close(connfd);
+                close_conn(connfd);
+                continue;
+            }
+
+            // anything but a known request is a protocol violation
+            if (m_type < OPEN_REQUEST || (m_type - OPEN_REQUEST) % 2 != 0 ||
+                type2ind(m_type) >= nfuncs)
+            {
+                serror("bad request type");
+                spans.end("bad request", m_type, m_status, m_length, 0);
+                close_conn(connfd);
                 continue;
             }
 
+            // turn the request away rather than let it wait, or add to
+            // what the others wait for
+            if (polled && sheddable(m_type))
+            {
+                int reason = refused[fd2ind(connfd)]
+                                 ? BUSY_CONNS
+                                 : admit.check(waited, span_clock(), nevents - i - 1,
+                                               m_type == PUT_REQUEST ? sync_queued : 0);
+                if (reason != 0)
+                {
+                    admit.shed[BUSY_CONNS] += reason == BUSY_CONNS;
+                    shed_request(connfd, reason);
+                    spans.end("busy", m_type, m_status, m_length, 0);
+                    continue;
+                }
+            }
+
             // change working directory
             if (fs::exists(cwds[fd2ind(connfd)]))
             {
                 if (chdir(cwds[fd2ind(connfd)].c_str()) < 0)
                 {
                     serror("change to client directory error");
+                    spans.end(request_name(m_type), m_type, m_status, m_length, 0);
                     continue;
                 }
             }
+            if (capture.enabled() && arrival == 0)
+            {
+                arrival = capture_clock();
+            }
+            m_bytes = 0;
+            bool tcp = !rtp && !local_conn[fd2ind(connfd)];
+            tuning = autotune && tcp ? &tuners[fd2ind(connfd)] : nullptr;
             funcs[type2ind(m_type)](connfd, buf);
+            tuning = nullptr;
+            // chunk data and hash lists are not worth keeping
+            bool binary = m_type == HAVE_REQUEST || m_type == CHUNK_REQUEST;
+            if (arrival)
+            {
+                capture.add(arrival, sessions[fd2ind(connfd)], m_type, m_status,
+                            buf, binary ? 0 : m_length, binary ? m_length : m_bytes);
+            }
             if (chdir(dft_path.c_str()) < 0)
             {
                 serror("change to default directory error");
             }
+            const char *path = m_type == TREE_REQUEST ? buf + sizeof(tree_request) : buf;
+            spans.end(request_name(m_type), m_type, m_status, m_length, m_bytes,
+                      binary ? nullptr : path);
+
+            // restart the idle deadline unless the connection is gone
+            if (idle_timeout > 0 && cwds[fd2ind(connfd)] != "NULL" && !parked[fd2ind(connfd)])
+            {
+                wheel.add(&idle_timers[fd2ind(connfd)], idle_timeout * 1000);
+            }
+        }
+
+        // reap connections that stayed idle for too long
+        wheel.advance([](timer_node *t)
+                      {
+                          serror("idle connection timeout");
+                          capture_close(t->fd);
+                          close_conn(t->fd);
+                      });
+        if (capture.enabled())
+        {
+            capture.flush();
+        }
+        if (polled)
+        {
+            report_shed(span_clock());
         }
     }
     return 0;
@@ -0,0 +1,161 @@
+#ifndef _FTP_SHA256_HPP_
+#define _FTP_SHA256_HPP_
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// FIPS 180-4 SHA-256, incremental: sha256_init, any number of
+// sha256_update calls, then sha256_final
+
+#define SHA256_LEN 32
+
+struct sha256_ctx
+{
+    uint32_t h[8];
+    uint64_t length; // bytes hashed so far
+    uint8_t block[64];
+    size_t used;     // bytes buffered in block
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t sha256_ror(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+void sha256_init(sha256_ctx *ctx)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->h, iv, sizeof(iv));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_compress(uint32_t h[8], const uint8_t *p)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+    {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+               (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i)
+    {
+        uint32_t s0 = sha256_ror(w[i - 15], 7) ^ sha256_ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = sha256_ror(w[i - 2], 17) ^ sha256_ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t s1 = sha256_ror(e, 6) ^ sha256_ror(e, 11) ^ sha256_ror(e, 25);
+        uint32_t t1 = k + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t s0 = sha256_ror(a, 2) ^ sha256_ror(a, 13) ^ sha256_ror(a, 22);
+        uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+void sha256_update(sha256_ctx *ctx, const void *buf, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    ctx->length += size;
+    if (ctx->used > 0)
+    {
+        size_t n = std::min(size, sizeof(ctx->block) - ctx->used);
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        size -= n;
+        if (ctx->used < sizeof(ctx->block))
+        {
+            return;
+        }
+        sha256_compress(ctx->h, ctx->block);
+        ctx->used = 0;
+    }
+    while (size >= 64)
+    {
+        sha256_compress(ctx->h, p);
+        p += 64;
+        size -= 64;
+    }
+    memcpy(ctx->block, p, size);
+    ctx->used = size;
+}
+
+void sha256_final(sha256_ctx *ctx, uint8_t out[SHA256_LEN])
+{
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56)
+    {
+        sha256_update(ctx, &pad, 1);
+    }
+    uint8_t len[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        len[i] = bits >> (56 - 8 * i);
+    }
+    sha256_update(ctx, len, sizeof(len));
+    for (int i = 0; i < 8; ++i)
+    {
+        out[4 * i] = ctx->h[i] >> 24;
+        out[4 * i + 1] = ctx->h[i] >> 16;
+        out[4 * i + 2] = ctx->h[i] >> 8;
+        out[4 * i + 3] = ctx->h[i];
+    }
+}
+
+void sha256(const void *buf, size_t size, uint8_t out[SHA256_LEN])
+{
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, buf, size);
+    sha256_final(&ctx, out);
+}
+
+// lowercase hex of a digest, out holds 2 * SHA256_LEN + 1 chars
+void sha256_hex(const uint8_t digest[SHA256_LEN], char *out)
+{
+    for (int i = 0; i < SHA256_LEN; ++i)
+    {
+        sprintf(out + 2 * i, "%02x", digest[i]);
+    }
+}
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef _FTP_SPAN_HPP_
+#define _FTP_SPAN_HPP_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// per-request timing spans in the Chrome trace event format, loadable in
+// chrome://tracing or Perfetto: a sampled request is one complete ("X")
+// event with the spans opened while it was served nested inside it, each
+// session on a track of its own; the serving thread only takes clock
+// readings, a writer thread formats and writes the JSON
+
+#define SPAN_QUEUE 1024 // requests waiting for the writer before some are dropped
+
+struct span_event
+{
+    const char *name; // a string literal
+    uint64_t start_ns;
+    uint64_t end_ns;
+};
+
+struct span_request
+{
+    uint32_t track;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    std::string name;
+    std::string detail;
+    int fd;
+    int type;
+    int status;
+    int length;
+    uint64_t bytes;
+    std::vector<span_event> spans;
+};
+
+// the request the thread is serving, if it is sampled
+thread_local span_request *span_current = nullptr;
+
+uint64_t span_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// times the scope it is declared in when the request is sampled
+struct span_scope
+{
+    const char *name;
+    uint64_t start;
+
+    span_scope(const char *name) : name(name), start(span_current ? span_clock() : 0)
+    {
+    }
+
+    ~span_scope()
+    {
+        end();
+    }
+
+    // close the span before the end of its scope
+    void end()
+    {
+        if (start && span_current)
+        {
+            span_current->spans.push_back({name, start, span_clock()});
+        }
+        start = 0;
+    }
+};
+
+struct span_writer
+{
+    FILE *fp = nullptr;
+    int every = 1; // sample one request of every
+    uint64_t seen = 0;
+    uint64_t dropped = 0;
+    span_request current;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<span_request> queue;
+
+    // the array is left open, trace viewers accept that and a server
+    // killed at any time still leaves a readable file
+    int open(const char *path, int sample_every)
+    {
+        if ((fp = fopen(path, "w")) == nullptr)
+        {
+            return -1;
+        }
+        every = sample_every > 0 ? sample_every : 1;
+        fprintf(fp, "[\n");
+        fflush(fp);
+        std::thread(&span_writer::run, this).detach();
+        return 0;
+    }
+
+    bool enabled()
+    {
+        return fp != nullptr;
+    }
+
+    // start timing a request of session track if it is one of the sampled
+    void begin(uint32_t track, int fd)
+    {
+        if (fp == nullptr || seen++ % every != 0)
+        {
+            return;
+        }
+        current.track = track;
+        current.fd = fd;
+        current.spans.clear();
+        current.start_ns = span_clock();
+        span_current = &current;
+    }
+
+    // the request is served; name it and hand it to the writer
+    void end(const char *name, int type, int status, int length, uint64_t bytes,
+             const char *detail = nullptr)
+    {
+        if (span_current != &current)
+        {
+            return;
+        }
+        span_current = nullptr;
+        current.end_ns = span_clock();
+        current.name = name;
+        current.detail = detail ? detail : "";
+        current.type = type;
+        current.status = status;
+        current.length = length;
+        current.bytes = bytes;
+        std::lock_guard<std::mutex> guard(lock);
+        if (queue.size() >= SPAN_QUEUE)
+        {
+            ++dropped;
+            return;
+        }
+        queue.push_back(std::move(current));
+        ready.notify_one();
+    }
+
+    // printable characters only, a viewer must not choke on a file name
+    static std::string escape(const std::string &s)
+    {
+        std::string out;
+        for (char c : s.substr(0, 128))
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+            }
+            out += (c >= 0x20 && c < 0x7f) ? c : '?';
+        }
+        return out;
+    }
+
+    void write(const span_request &r, std::unordered_set<uint32_t> &named)
+    {
+        int pid = getpid();
+        if (named.insert(r.track).second)
+        {
+            fprintf(fp,
+                    "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                    "\"args\":{\"name\":\"session %u fd %d\"}},\n",
+                    pid, r.track, r.track, r.fd);
+        }
+        fprintf(fp,
+                "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%u,\"args\":{\"type\":%d,\"status\":%d,\"length\":%d,"
+                "\"bytes\":%lu,\"arg\":\"%s\"}},\n",
+                r.name.c_str(), r.start_ns / 1e3, (r.end_ns - r.start_ns) / 1e3, pid, r.track,
+                r.type, r.status, r.length, (unsigned long)r.bytes, escape(r.detail).c_str());
+        for (auto &s : r.spans)
+        {
+            fprintf(fp,
+                    "{\"name\":\"%s\",\"cat\":\"span\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":%d,\"tid\":%u},\n",
+                    s.name, s.start_ns / 1e3, (s.end_ns - s.start_ns) / 1e3, pid, r.track);
+        }
+    }
+
+    void run()
+    {
+        std::unordered_set<uint32_t> named;
+        std::deque<span_request> batch;
+        while (true)
+        {
+            uint64_t lost;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                ready.wait(guard, [this]() { return !queue.empty(); });
+                batch.swap(queue);
+                lost = dropped;
+                dropped = 0;
+            }
+            for (auto &r : batch)
+            {
+                write(r, named);
+            }
+            if (lost > 0)
+            {
+                fprintf(fp,
+                        "{\"name\":\"%lu requests dropped\",\"ph\":\"i\",\"s\":\"g\","
+                        "\"ts\":%.3f,\"pid\":%d,\"tid\":0},\n",
+                        (unsigned long)lost, span_clock() / 1e3, getpid());
+            }
+            fflush(fp);
+            batch.clear();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef _FTP_SYNC_HPP_
+#define _FTP_SYNC_HPP_
+
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <ftp_span.hpp>
+
+// group commit: uploads that complete while a batch is being flushed wait
+// together for the next one, so concurrent uploads share the cost of the
+// device cache flush instead of paying it one after another; a dedicated
+// thread does the syncing and signals efd when jobs are done
+
+#define DURABILITY_NONE  0
+#define DURABILITY_FILE  1
+#define DURABILITY_GROUP 2
+
+struct sync_job
+{
+    int filefd;
+    int connfd;      // connection waiting for the job, -1 if none
+    bool ack;        // the client asked to hear when the data is stored
+    std::string dir; // directory to sync too because the file is new, or ""
+    bool whole_fs;   // the data is spread over several files, sync them all
+    bool ok;
+};
+
+// flush the data of filefd, and dir if the file was created in it
+bool sync_file(int filefd, const std::string &dir)
+{
+    span_scope span("fsync");
+    bool ok = fdatasync(filefd) == 0;
+    if (ok && !dir.empty())
+    {
+        int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        ok = dirfd >= 0 && fsync(dirfd) == 0;
+        if (dirfd >= 0)
+        {
+            close(dirfd);
+        }
+    }
+    return ok;
+}
+
+struct sync_group
+{
+    int efd = -1;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<sync_job> pending;
+    std::vector<sync_job> done;
+    std::thread worker;
+
+    int start()
+    {
+        if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        {
+            return -1;
+        }
+        worker = std::thread([this]()
+                             { run(); });
+        worker.detach();
+        return 0;
+    }
+
+    void submit(const sync_job &job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(job);
+        wake.notify_one();
+    }
+
+    // jobs finished since the last call, call when efd becomes readable
+    std::vector<sync_job> collect()
+    {
+        uint64_t n;
+        while (read(efd, &n, sizeof(n)) > 0)
+        {
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<sync_job> out;
+        out.swap(done);
+        return out;
+    }
+
+private:
+    void run()
+    {
+        std::vector<sync_job> batch;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]()
+                          { return !pending.empty(); });
+                batch.swap(pending);
+            }
+
+            // start writeback of the whole batch before waiting on any of
+            // it, then each directory gets synced once
+            for (auto &job : batch)
+            {
+                sync_file_range(job.filefd, 0, 0, SYNC_FILE_RANGE_WRITE);
+            }
+            std::set<std::string> dirs;
+            bool synced_fs = false, fs_ok = false;
+            for (auto &job : batch)
+            {
+                if (job.whole_fs && !synced_fs)
+                {
+                    fs_ok = syncfs(job.filefd) == 0;
+                    synced_fs = true;
+                }
+                job.ok = job.whole_fs ? fs_ok : sync_file(job.filefd, "");
+                if (!job.dir.empty())
+                {
+                    dirs.insert(job.dir);
+                }
+            }
+            for (auto &dir : dirs)
+            {
+                int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                bool ok = dirfd >= 0 && fsync(dirfd) == 0;
+                if (dirfd >= 0)
+                {
+                    close(dirfd);
+                }
+                for (auto &job : batch)
+                {
+                    job.ok = job.ok && (job.dir != dir || ok);
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.insert(done.end(), batch.begin(), batch.end());
+            }
+            batch.clear();
+            uint64_t one = 1;
+            if (write(efd, &one, sizeof(one)) < 0)
+            {
+                serror("eventfd write error");
+            }
+        }
+    }
+};
+
+#endif
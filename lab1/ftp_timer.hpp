@@ -0,0 +1,177 @@
+#ifndef _FTP_TIMER_HPP_
+#define _FTP_TIMER_HPP_
+
+#include <stdint.h>
+#include <time.h>
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 4
+#define TW_TICK_MS 100
+
+// intrusive node, embed one per deadline; unlinked nodes have prev == nullptr
+struct timer_node
+{
+    timer_node *prev = nullptr;
+    timer_node *next = nullptr;
+    uint64_t expire = 0;
+    int fd = -1;
+
+    bool pending() { return prev != nullptr; }
+};
+
+uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// hierarchical timer wheel with TW_LEVELS levels of TW_SLOTS slots each:
+// level 0 slots are one tick wide, every further level is TW_SLOTS times
+// coarser and gets cascaded down when the level below wraps around;
+// add and del are O(1), advance is O(1) amortized per tick and timer
+struct timer_wheel
+{
+    timer_node slots[TW_LEVELS][TW_SLOTS];
+    uint64_t tick;
+    size_t count;
+
+    timer_wheel() : tick(now_ms() / TW_TICK_MS), count(0)
+    {
+        for (int l = 0; l < TW_LEVELS; ++l)
+        {
+            for (int i = 0; i < TW_SLOTS; ++i)
+            {
+                slots[l][i].prev = slots[l][i].next = &slots[l][i];
+            }
+        }
+    }
+
+    // (re)arm t to fire after ms milliseconds
+    void add(timer_node *t, uint64_t ms)
+    {
+        if (t->pending())
+        {
+            del(t);
+        }
+        t->expire = (now_ms() + ms + TW_TICK_MS - 1) / TW_TICK_MS;
+        insert(t);
+        ++count;
+    }
+
+    void del(timer_node *t)
+    {
+        if (!t->pending())
+        {
+            return;
+        }
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        t->prev = t->next = nullptr;
+        --count;
+    }
+
+    // milliseconds until the first tick that has work, -1 if nothing is armed;
+    // that is a non-empty level 0 slot or the cascade of a non-empty slot
+    // further up, which may wake us early but never late
+    int timeout()
+    {
+        if (count == 0)
+        {
+            return -1;
+        }
+        uint64_t ms = now_ms();
+        if (ms / TW_TICK_MS > tick)
+        {
+            return 0;
+        }
+        uint64_t next = UINT64_MAX;
+        for (int l = 0; l < TW_LEVELS; ++l)
+        {
+            int shift = l * TW_BITS;
+            uint64_t at = ((tick + ((uint64_t)1 << shift) - 1) >> shift) << shift;
+            for (int i = 0; i < TW_SLOTS && at < next; ++i, at += (uint64_t)1 << shift)
+            {
+                timer_node *head = &slots[l][(at >> shift) & TW_MASK];
+                if (head->next != head)
+                {
+                    next = at;
+                    break;
+                }
+            }
+        }
+        return next * TW_TICK_MS > ms ? (int)(next * TW_TICK_MS - ms) : 0;
+    }
+
+    // run every tick up to now, fn is called on each expired node after it
+    // has been unlinked, so it may re-arm or free it
+    template <typename F>
+    void advance(F fn)
+    {
+        uint64_t target = now_ms() / TW_TICK_MS;
+        while (tick <= target)
+        {
+            int index = tick & TW_MASK;
+            for (int l = 1; index == 0 && l < TW_LEVELS; ++l)
+            {
+                index = (tick >> (l * TW_BITS)) & TW_MASK;
+                cascade(l, index);
+            }
+
+            timer_node *head = &slots[0][tick & TW_MASK];
+            ++tick;
+            while (head->next != head)
+            {
+                timer_node *t = head->next;
+                del(t);
+                fn(t);
+            }
+        }
+    }
+
+private:
+    void insert(timer_node *t)
+    {
+        uint64_t delta = t->expire < tick ? 0 : t->expire - tick;
+        timer_node *head;
+        int l = 0;
+        while (l < TW_LEVELS - 1 && delta >= ((uint64_t)1 << ((l + 1) * TW_BITS)))
+        {
+            ++l;
+        }
+        if (t->expire < tick)
+        {
+            head = &slots[0][tick & TW_MASK];
+        }
+        else if (l == TW_LEVELS - 1 && delta >= ((uint64_t)1 << (TW_LEVELS * TW_BITS)))
+        {
+            // clamp to the farthest slot, it gets re-cascaded when reached
+            head = &slots[l][((tick >> (l * TW_BITS)) - 1) & TW_MASK];
+        }
+        else
+        {
+            head = &slots[l][(t->expire >> (l * TW_BITS)) & TW_MASK];
+        }
+        t->next = head;
+        t->prev = head->prev;
+        head->prev->next = t;
+        head->prev = t;
+    }
+
+    void cascade(int l, int index)
+    {
+        timer_node *head = &slots[l][index];
+        timer_node *t = head->next;
+        head->prev = head->next = head;
+        while (t != head)
+        {
+            timer_node *next = t->next;
+            insert(t);
+            t = next;
+        }
+    }
+};
+
+#endif
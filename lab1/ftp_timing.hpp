@@ -0,0 +1,210 @@
+#ifndef _FTP_TIMING_HPP_
+#define _FTP_TIMING_HPP_
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// client side timing of commands: wall time, bytes and throughput of each,
+// and per command latency histograms over the session in the HDR style,
+// exact below 2^TIMING_SUB_BITS us and within 1 / 2^(TIMING_SUB_BITS - 1)
+// above, so a percentile costs a walk over at most a few thousand counters
+// however many commands were timed
+
+#define TIMING_SUB_BITS 6 // 32 buckets per power of two, about 3% error
+
+struct hdr_histogram
+{
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+    double sum = 0;
+
+    // values below 2^TIMING_SUB_BITS have a bucket each, larger ones keep
+    // their TIMING_SUB_BITS - 1 bits below the leading one
+    static int index(uint64_t v)
+    {
+        const int sub = 1 << TIMING_SUB_BITS;
+        if (v < (uint64_t)sub)
+        {
+            return (int)v;
+        }
+        int top = 63 - __builtin_clzll(v);
+        int shift = top - (TIMING_SUB_BITS - 1);
+        return sub + (top - TIMING_SUB_BITS) * (sub / 2) + (int)(v >> shift) - sub / 2;
+    }
+
+    // the largest value that falls in bucket i
+    static uint64_t highest(int i)
+    {
+        const int sub = 1 << TIMING_SUB_BITS;
+        if (i < sub)
+        {
+            return i;
+        }
+        int top = (i - sub) / (sub / 2) + TIMING_SUB_BITS;
+        uint64_t lead = (uint64_t)((i - sub) % (sub / 2) + sub / 2);
+        int shift = top - (TIMING_SUB_BITS - 1);
+        return ((lead + 1) << shift) - 1;
+    }
+
+    void record(uint64_t v)
+    {
+        size_t i = index(v);
+        if (i >= counts.size())
+        {
+            counts.resize(i + 1);
+        }
+        ++counts[i];
+        ++total;
+        sum += v;
+        min = std::min(min, v);
+        max = std::max(max, v);
+    }
+
+    // the value p percent of the recorded ones are at most
+    uint64_t percentile(double p)
+    {
+        uint64_t rank = (uint64_t)(p / 100 * total + 0.5);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            if ((seen += counts[i]) >= std::max(rank, (uint64_t)1))
+            {
+                return std::min(highest(i), max);
+            }
+        }
+        return max;
+    }
+};
+
+struct timing_stats
+{
+    uint64_t count = 0;
+    uint64_t failed = 0;
+    uint64_t bytes = 0;
+    uint64_t us = 0;
+    hdr_histogram latency; // us
+};
+
+struct timing_session
+{
+    bool on = false;
+    bool json = false;
+    std::string json_path; // "" for stdout
+    std::map<std::string, timing_stats> commands;
+    uint64_t start_us = 0;
+    uint64_t start_bytes = 0;
+
+    static uint64_t clock_us()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    // a command starts with the io_bytes counter at bytes
+    void begin(uint64_t bytes)
+    {
+        start_us = clock_us();
+        start_bytes = bytes;
+    }
+
+    // the command name ended with scode and the counter at bytes; report it
+    void end(const char *name, int scode, uint64_t bytes)
+    {
+        uint64_t us = clock_us() - start_us;
+        uint64_t moved = bytes - start_bytes;
+        timing_stats &st = commands[name];
+        ++st.count;
+        st.failed += scode < 0;
+        st.bytes += moved;
+        st.us += us;
+        st.latency.record(us);
+        printf("%s: %.3f ms, %lu bytes", name, us / 1e3, (unsigned long)moved);
+        if (moved > 0 && us > 0)
+        {
+            printf(", %.1f MB/s", moved / (double)us * 1e6 / (1 << 20));
+        }
+        printf("%s\n", scode < 0 ? ", failed" : "");
+    }
+
+    void summary(FILE *fp)
+    {
+        fprintf(fp, "%-10s %6s %5s %10s %10s %10s %10s %12s %10s\n", "command", "count", "fail",
+                "p50 ms", "p90 ms", "p99 ms", "max ms", "bytes", "MB/s");
+        for (auto &c : commands)
+        {
+            timing_stats &st = c.second;
+            fprintf(fp, "%-10s %6lu %5lu %10.3f %10.3f %10.3f %10.3f %12lu %10.1f\n",
+                    c.first.c_str(), (unsigned long)st.count, (unsigned long)st.failed,
+                    st.latency.percentile(50) / 1e3, st.latency.percentile(90) / 1e3,
+                    st.latency.percentile(99) / 1e3, st.latency.max / 1e3, (unsigned long)st.bytes,
+                    st.us ? st.bytes / (double)st.us * 1e6 / (1 << 20) : 0.0);
+        }
+    }
+
+    void summary_json(FILE *fp)
+    {
+        fprintf(fp, "{\"commands\":[");
+        const char *sep = "";
+        for (auto &c : commands)
+        {
+            timing_stats &st = c.second;
+            hdr_histogram &h = st.latency;
+            fprintf(fp,
+                    "%s{\"name\":\"%s\",\"count\":%lu,\"failed\":%lu,\"bytes\":%lu,"
+                    "\"seconds\":%.6f,\"mb_per_s\":%.3f,\"latency_us\":{\"min\":%lu,"
+                    "\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}",
+                    sep, c.first.c_str(), (unsigned long)st.count, (unsigned long)st.failed,
+                    (unsigned long)st.bytes, st.us / 1e6,
+                    st.us ? st.bytes / (double)st.us * 1e6 / (1 << 20) : 0.0,
+                    (unsigned long)(h.total ? h.min : 0), h.total ? h.sum / h.total : 0.0,
+                    (unsigned long)h.percentile(50), (unsigned long)h.percentile(90),
+                    (unsigned long)h.percentile(99), (unsigned long)h.percentile(99.9),
+                    (unsigned long)h.max);
+            sep = ",";
+        }
+        fprintf(fp, "]}\n");
+    }
+
+    // the summary of what was timed, to stdout or the JSON file, then a
+    // fresh session if reset
+    int report(bool reset = true)
+    {
+        if (commands.empty())
+        {
+            return 0;
+        }
+        if (!json)
+        {
+            summary(stdout);
+        }
+        else if (json_path.empty())
+        {
+            summary_json(stdout);
+        }
+        else
+        {
+            FILE *fp = fopen(json_path.c_str(), "a");
+            if (fp == nullptr)
+            {
+                return -1;
+            }
+            summary_json(fp);
+            fclose(fp);
+        }
+        if (reset)
+        {
+            commands.clear();
+        }
+        return 0;
+    }
+};
+
+#endif
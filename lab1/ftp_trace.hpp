@@ -0,0 +1,144 @@
+#ifndef _FTP_TRACE_HPP_
+#define _FTP_TRACE_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// always compiled, runtime toggled tracing of every frame sent or received;
+// each thread appends fixed-size binary records to its own ring without
+// locks, a dump writes all rings to a file that ftp_tracedump decodes
+
+#define TRACE_MAGIC   "FTPTRACE"
+#define TRACE_VERSION 2
+#define TRACE_RING    4096
+
+#define TRACE_SEND 0
+#define TRACE_RECV 1
+
+struct trace_record
+{
+    uint64_t ts_ns;      // CLOCK_MONOTONIC at the start of the operation
+    uint32_t latency_ns; // time the operation took
+    int32_t fd;
+    uint32_t length;     // payload bytes, header excluded
+    uint32_t tid;
+    uint8_t type;
+    uint8_t status;
+    uint8_t dir;         // TRACE_SEND or TRACE_RECV
+    uint8_t result;      // 0 ok, 1 failed
+    uint32_t reserved;
+} __attribute__((packed));
+
+static_assert(sizeof(trace_record) == 32, "trace records are 32 bytes");
+
+struct trace_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t realtime_ns; // CLOCK_REALTIME minus CLOCK_MONOTONIC, for wall time
+} __attribute__((packed));
+
+struct trace_ring
+{
+    std::atomic<uint64_t> head{0};
+    uint32_t tid;
+    trace_record records[TRACE_RING];
+};
+
+std::atomic<bool> trace_enabled{false};
+std::mutex trace_rings_mutex;
+std::vector<trace_ring *> trace_rings;
+
+// monotonic so latencies survive clock steps, the dump records the offset
+// that turns it into wall time
+uint64_t trace_clock(clockid_t clock = CLOCK_MONOTONIC)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// only the owning thread writes to its ring, registering it is the sole lock
+trace_ring *trace_this_ring()
+{
+    static thread_local trace_ring *ring = nullptr;
+    if (ring == nullptr)
+    {
+        ring = new trace_ring;
+        ring->tid = (uint32_t)syscall(SYS_gettid);
+        std::lock_guard<std::mutex> lock(trace_rings_mutex);
+        trace_rings.push_back(ring);
+    }
+    return ring;
+}
+
+inline bool tracing()
+{
+    return trace_enabled.load(std::memory_order_relaxed);
+}
+
+void trace(uint64_t start, int fd, uint8_t dir, uint8_t type, uint8_t status,
+           uint32_t length, bool ok)
+{
+    trace_ring *ring = trace_this_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    trace_record *r = &ring->records[head % TRACE_RING];
+    uint64_t end = trace_clock();
+    r->ts_ns = start;
+    r->latency_ns = (uint32_t)std::min(end - start, (uint64_t)UINT32_MAX);
+    r->fd = fd;
+    r->length = length;
+    r->tid = ring->tid;
+    r->type = type;
+    r->status = status;
+    r->dir = dir;
+    r->result = ok ? 0 : 1;
+    r->reserved = 0;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+// write the records of every ring, oldest first per ring; records being
+// overwritten while we copy them may come out torn
+int trace_dump(const char *path)
+{
+    std::vector<trace_record> out;
+    {
+        std::lock_guard<std::mutex> lock(trace_rings_mutex);
+        for (trace_ring *ring : trace_rings)
+        {
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t first = head > TRACE_RING ? head - TRACE_RING : 0;
+            for (uint64_t i = first; i < head; ++i)
+            {
+                out.push_back(ring->records[i % TRACE_RING]);
+            }
+        }
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == nullptr)
+    {
+        return -1;
+    }
+    trace_file_header header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record);
+    header.count = out.size();
+    header.realtime_ns = trace_clock(CLOCK_REALTIME) - trace_clock();
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(out.data(), sizeof(trace_record), out.size(), fp);
+    return fclose(fp) == 0 ? (int)out.size() : -1;
+}
+
+#endif
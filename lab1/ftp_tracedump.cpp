@@ -0,0 +1,145 @@
+#include <defs.h>
+#include <ftp_trace.hpp>
+
+// decode a trace dump written by ftp_server or ftp_client into text or JSON
+
+const char *type_name(uint8_t type)
+{
+    switch (type)
+    {
+    case OPEN_REQUEST:
+        return "OPEN_REQUEST";
+    case OPEN_REPLY:
+        return "OPEN_REPLY";
+    case LIST_REQUEST:
+        return "LIST_REQUEST";
+    case LIST_REPLY:
+        return "LIST_REPLY";
+    case CD_REQUEST:
+        return "CD_REQUEST";
+    case CD_REPLY:
+        return "CD_REPLY";
+    case GET_REQUEST:
+        return "GET_REQUEST";
+    case GET_REPLY:
+        return "GET_REPLY";
+    case PUT_REQUEST:
+        return "PUT_REQUEST";
+    case PUT_REPLY:
+        return "PUT_REPLY";
+    case SHA_REQUEST:
+        return "SHA_REQUEST";
+    case SHA_REPLY:
+        return "SHA_REPLY";
+    case QUIT_REQUEST:
+        return "QUIT_REQUEST";
+    case QUIT_REPLY:
+        return "QUIT_REPLY";
+    case LISTX_REQUEST:
+        return "LISTX_REQUEST";
+    case LISTX_REPLY:
+        return "LISTX_REPLY";
+    case COPY_REQUEST:
+        return "COPY_REQUEST";
+    case COPY_REPLY:
+        return "COPY_REPLY";
+    case MOVE_REQUEST:
+        return "MOVE_REQUEST";
+    case MOVE_REPLY:
+        return "MOVE_REPLY";
+    case HAVE_REQUEST:
+        return "HAVE_REQUEST";
+    case HAVE_REPLY:
+        return "HAVE_REPLY";
+    case CHUNK_REQUEST:
+        return "CHUNK_REQUEST";
+    case CHUNK_REPLY:
+        return "CHUNK_REPLY";
+    case MANIFEST_REQUEST:
+        return "MANIFEST_REQUEST";
+    case MANIFEST_REPLY:
+        return "MANIFEST_REPLY";
+    case BUNDLE_REQUEST:
+        return "BUNDLE_REQUEST";
+    case BUNDLE_REPLY:
+        return "BUNDLE_REPLY";
+    case TREE_REQUEST:
+        return "TREE_REQUEST";
+    case TREE_REPLY:
+        return "TREE_REPLY";
+    case STATS_REQUEST:
+        return "STATS_REQUEST";
+    case STATS_REPLY:
+        return "STATS_REPLY";
+    case BUSY_REPLY:
+        return "BUSY_REPLY";
+    case FILE_DATA:
+        return "FILE_DATA";
+    }
+    return nullptr;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || (argc == 3 && strcmp(argv[2], "--json") != 0) || argc > 3)
+    {
+        printf("usage: ftp_tracedump <file> [--json]\n");
+        return 0;
+    }
+    bool json = argc == 3;
+
+    FILE *fp = fopen(argv[1], "rb");
+    if (fp == nullptr)
+    {
+        fprintf(stderr, "open trace file error\n");
+        return 1;
+    }
+    trace_file_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(trace_record))
+    {
+        fprintf(stderr, "not a trace file\n");
+        return 1;
+    }
+
+    if (json)
+    {
+        printf("[");
+    }
+    trace_record r;
+    for (uint64_t i = 0; i < header.count && fread(&r, sizeof(r), 1, fp) == 1; ++i)
+    {
+        const char *name = type_name(r.type);
+        char unknown[8];
+        if (name == nullptr)
+        {
+            sprintf(unknown, "0x%02x", r.type);
+            name = unknown;
+        }
+        uint64_t ts = header.realtime_ns + r.ts_ns;
+        if (json)
+        {
+            printf("%s\n  {\"ts_ns\": %llu, \"tid\": %u, \"fd\": %d, \"dir\": \"%s\", "
+                   "\"type\": \"%s\", \"status\": %u, \"length\": %u, "
+                   "\"latency_ns\": %u, \"ok\": %s}",
+                   i ? "," : "", (unsigned long long)ts, r.tid, r.fd,
+                   r.dir == TRACE_SEND ? "send" : "recv", name, r.status,
+                   r.length, r.latency_ns, r.result == 0 ? "true" : "false");
+            continue;
+        }
+        time_t sec = ts / 1000000000;
+        char when[32];
+        strftime(when, sizeof(when), "%F %T", localtime(&sec));
+        printf("%s.%09llu tid %u fd %d %s %-12s status %02x len %u lat %.3f us%s\n",
+               when, (unsigned long long)(ts % 1000000000), r.tid, r.fd,
+               r.dir == TRACE_SEND ? "SEND" : "RECV", name, r.status, r.length,
+               r.latency_ns / 1000.0, r.result == 0 ? "" : " FAILED");
+    }
+    if (json)
+    {
+        printf("\n]\n");
+    }
+    fclose(fp);
+    return 0;
+}
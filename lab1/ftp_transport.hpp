@@ -0,0 +1,228 @@
+#ifndef _FTP_TRANSPORT_HPP_
+#define _FTP_TRANSPORT_HPP_
+
+#include <set>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef FTP_RTP
+#include <rtp_conn.h>
+#endif
+
+// what frames travel on: a TCP or unix stream socket used as it is, or,
+// built with FTP_RTP, a reliable UDP connection from lab2 registered for
+// its socket; the socket calls of ftp_utils.hpp go through here so the
+// protocol code is the same on both
+
+#define TRANSPORT_MAXFD (MAXCONN + 16)
+
+#ifdef FTP_RTP
+rtp_conn_t *rtp_conns[TRANSPORT_MAXFD];
+std::set<int> rtp_fds;
+
+// the socket of conn, which stands for it from now on
+int transport_add(rtp_conn_t *conn)
+{
+    int fd = rtp_conn_fd(conn);
+    if (fd >= TRANSPORT_MAXFD)
+    {
+        rtp_conn_close(conn);
+        return -1;
+    }
+    rtp_conns[fd] = conn;
+    rtp_fds.insert(fd);
+    return fd;
+}
+
+rtp_conn_t *transport_rtp(int fd)
+{
+    return fd >= 0 && fd < TRANSPORT_MAXFD ? rtp_conns[fd] : nullptr;
+}
+#endif
+
+// the UDP socket RTP connections to ip:port are accepted on, -1 on error
+// or when built without FTP_RTP
+int transport_listen(const char *ip, int port)
+{
+#ifdef FTP_RTP
+    return rtp_conn_listen(ip, port);
+#else
+    return -1;
+#endif
+}
+
+// the socket of a connection whose SYN waits on listenfd, with windows of
+// wsize packets or the default for 0; -1 if there was none after all
+int transport_accept(int listenfd, int wsize)
+{
+#ifdef FTP_RTP
+    rtp_conn_t *conn = rtp_conn_accept(listenfd, wsize > 0 ? wsize : RTP_CONN_WINDOW);
+    return conn ? transport_add(conn) : -1;
+#else
+    return -1;
+#endif
+}
+
+int transport_connect(const char *ip, int port, int wsize)
+{
+#ifdef FTP_RTP
+    rtp_conn_t *conn = rtp_conn_connect(ip, port, wsize > 0 ? wsize : RTP_CONN_WINDOW);
+    return conn ? transport_add(conn) : -1;
+#else
+    return -1;
+#endif
+}
+
+ssize_t transport_send(int fd, const void *buf, size_t size, int flags)
+{
+#ifdef FTP_RTP
+    if (rtp_conn_t *conn = transport_rtp(fd))
+    {
+        ssize_t b = rtp_conn_send(conn, buf, size);
+        if (b >= 0 && (flags & MSG_MORE) == 0)
+        {
+            rtp_conn_push(conn);
+        }
+        return b;
+    }
+#endif
+    return send(fd, buf, size, flags);
+}
+
+ssize_t transport_sendv(int fd, struct iovec *iov, int cnt)
+{
+#ifdef FTP_RTP
+    if (rtp_conn_t *conn = transport_rtp(fd))
+    {
+        ssize_t total = 0;
+        for (int i = 0; i < cnt; ++i)
+        {
+            if (rtp_conn_send(conn, iov[i].iov_base, iov[i].iov_len) < 0)
+            {
+                return -1;
+            }
+            total += iov[i].iov_len;
+        }
+        rtp_conn_push(conn);
+        return total;
+    }
+#endif
+    return writev(fd, iov, cnt);
+}
+
+ssize_t transport_recv(int fd, void *buf, size_t size)
+{
+#ifdef FTP_RTP
+    if (rtp_conn_t *conn = transport_rtp(fd))
+    {
+        return rtp_conn_recv(conn, buf, size);
+    }
+#endif
+    return recv(fd, buf, size, 0);
+}
+
+// sendfile; over RTP the data has to pass through a buffer
+ssize_t transport_sendfile(int fd, int filefd, off_t *offset, size_t size)
+{
+#ifdef FTP_RTP
+    if (rtp_conn_t *conn = transport_rtp(fd))
+    {
+        static thread_local char buf[1 << 16];
+        ssize_t n = pread(filefd, buf, std::min(size, sizeof(buf)), *offset);
+        if (n > 0 && rtp_conn_send(conn, buf, n) < 0)
+        {
+            return -1;
+        }
+        if (n > 0)
+        {
+            *offset += n;
+            rtp_conn_push(conn);
+        }
+        return n;
+    }
+#endif
+    return sendfile(fd, filefd, offset, size);
+}
+
+void transport_cork(int fd, int on)
+{
+#ifdef FTP_RTP
+    if (rtp_conn_t *conn = transport_rtp(fd))
+    {
+        rtp_conn_cork(conn, on);
+        return;
+    }
+#endif
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// false if only acknowledgements arrived on fd and a recv would block
+bool transport_readable(int fd)
+{
+#ifdef FTP_RTP
+    if (rtp_conn_t *conn = transport_rtp(fd))
+    {
+        return rtp_conn_poll(conn) != 0;
+    }
+#endif
+    return true;
+}
+
+int transport_close(int fd)
+{
+#ifdef FTP_RTP
+    if (rtp_conn_t *conn = transport_rtp(fd))
+    {
+        rtp_conns[fd] = nullptr;
+        rtp_fds.erase(fd);
+        return rtp_conn_close(conn);
+    }
+#endif
+    return close(fd);
+}
+
+// the epoll_wait timeout given the one wanted otherwise: 0 while RTP
+// connections hold received data, else soon enough for their retransmissions
+int transport_timeout(int timeout)
+{
+#ifdef FTP_RTP
+    for (int fd : rtp_fds)
+    {
+        int t = rtp_conn_poll(rtp_conns[fd]) != 0 ? 0 : rtp_conn_timeout(rtp_conns[fd]);
+        if (t >= 0 && (timeout < 0 || t < timeout))
+        {
+            timeout = t;
+        }
+    }
+#endif
+    return timeout;
+}
+
+// RTP connections keep what they received, so a request that came in with
+// an earlier one no longer makes the socket readable; add those to the n
+// events epoll_wait returned, up to max, and retransmit what is due
+int transport_ready(struct epoll_event *events, int n, int max)
+{
+#ifdef FTP_RTP
+    int returned = n = std::max(n, 0);
+    for (int fd : rtp_fds)
+    {
+        bool dup = false;
+        for (int i = 0; i < returned; ++i)
+        {
+            dup = dup || events[i].data.fd == fd;
+        }
+        if (rtp_conn_poll(rtp_conns[fd]) != 0 && !dup && n < max)
+        {
+            events[n].events = EPOLLIN;
+            events[n++].data.fd = fd;
+        }
+    }
+#endif
+    return n;
+}
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef _FTP_TREE_HPP_
+#define _FTP_TREE_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>
+#include <ftp_sha256.hpp>
+#include <ftp_span.hpp>
+
+// Merkle tree hash, the RFC 6962 construction over SHA-256: a file is cut
+// into leaves of 2^shift bytes, a leaf hashes as SHA-256(0x00 || data), a
+// node as SHA-256(0x01 || left || right), a node without a right sibling
+// moves up a level unchanged, and an empty file hashes as SHA-256 of
+// nothing; leaves don't depend on each other, so a pool of threads hashes
+// them, and a leaf hash checks its range of a file on its own
+
+#define TREE_SHIFT     20 // 1 MiB leaves unless asked otherwise
+#define TREE_SHIFT_MIN 12
+#define TREE_SHIFT_MAX 30
+#define TREE_LEAVES    (1 << 15) // most leaf hashes in a reply
+#define TREE_READ      (1 << 20) // bytes a thread reads at once
+
+// TREE_REQUEST argument, followed by the '\0'-terminated path
+struct tree_request
+{
+    uint8_t shift;  // leaves of at least 2^shift bytes
+    uint8_t leaves; // 1 to get the leaf hashes too
+} __attribute__((packed));
+
+// TREE_REPLY payload when the status is 1, followed by count leaf hashes;
+// the server makes leaves larger than asked when there would be more than
+// TREE_LEAVES of them; big-endian
+struct tree_reply
+{
+    uint64_t size;
+    uint8_t shift;
+    uint32_t count;
+    uint8_t root[SHA256_LEN];
+} __attribute__((packed));
+
+struct tree_digest
+{
+    uint8_t h[SHA256_LEN];
+};
+
+// pread of the hashed data, safe to call from several threads
+typedef std::function<ssize_t(void *buf, size_t size, off_t offset)> tree_reader;
+
+int tree_leaf_count(uint64_t size, int shift)
+{
+    return (int)((size + (1ULL << shift) - 1) >> shift);
+}
+
+// the smallest shift from shift up that gives size at most TREE_LEAVES leaves
+int tree_fit_shift(uint64_t size, int shift)
+{
+    while (shift < TREE_SHIFT_MAX && tree_leaf_count(size, shift) > TREE_LEAVES)
+    {
+        ++shift;
+    }
+    return shift;
+}
+
+bool tree_leaf(const tree_reader &read_at, off_t offset, off_t size, char *buf, uint8_t out[SHA256_LEN])
+{
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    uint8_t prefix = 0;
+    sha256_update(&ctx, &prefix, 1);
+    while (size > 0)
+    {
+        ssize_t n = read_at(buf, std::min(size, (off_t)TREE_READ), offset);
+        if (n <= 0)
+        {
+            return false;
+        }
+        sha256_update(&ctx, buf, n);
+        offset += n;
+        size -= n;
+    }
+    sha256_final(&ctx, out);
+    return true;
+}
+
+void tree_root(const std::vector<tree_digest> &leaves, uint8_t root[SHA256_LEN])
+{
+    if (leaves.empty())
+    {
+        sha256(nullptr, 0, root);
+        return;
+    }
+    std::vector<tree_digest> level = leaves;
+    while (level.size() > 1)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < level.size(); i += 2)
+        {
+            if (i + 1 == level.size())
+            {
+                level[n++] = level[i];
+                continue;
+            }
+            sha256_ctx ctx;
+            uint8_t prefix = 1;
+            sha256_init(&ctx);
+            sha256_update(&ctx, &prefix, 1);
+            sha256_update(&ctx, level[i].h, SHA256_LEN);
+            sha256_update(&ctx, level[i + 1].h, SHA256_LEN);
+            sha256_final(&ctx, level[n++].h);
+        }
+        level.resize(n);
+    }
+    memcpy(root, level[0].h, SHA256_LEN);
+}
+
+// hash the size bytes read_at gives into leaves and root, with up to
+// threads threads taking the next leaf as they finish one; 0 threads is
+// one per core; returns -1 if the data can't be read
+int tree_hash(const tree_reader &read_at, uint64_t size, int shift, int threads,
+              std::vector<tree_digest> &leaves, uint8_t root[SHA256_LEN])
+{
+    span_scope span("hash");
+    int count = tree_leaf_count(size, shift);
+    leaves.resize(count);
+    std::atomic<int> next(0);
+    std::atomic<bool> failed(false);
+    auto work = [&]()
+    {
+        std::vector<char> buf(std::min((uint64_t)TREE_READ, (uint64_t)1 << shift));
+        for (int i; !failed && (i = next++) < count;)
+        {
+            off_t offset = (off_t)i << shift;
+            off_t n = std::min((uint64_t)1 << shift, size - offset);
+            if (!tree_leaf(read_at, offset, n, buf.data(), leaves[i].h))
+            {
+                failed = true;
+            }
+        }
+    };
+
+    if (threads <= 0)
+    {
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    threads = std::max(1, std::min(threads, count));
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads; ++i)
+    {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto &t : pool)
+    {
+        t.join();
+    }
+    if (failed)
+    {
+        return -1;
+    }
+    tree_root(leaves, root);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef _FTP_TUNE_HPP_
+#define _FTP_TUNE_HPP_
+
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// socket buffer autotuning from the bandwidth-delay product: while a file
+// streams over TCP the connection's RTT and delivery rate are read from
+// TCP_INFO, and the socket buffer of the side doing the work is grown to
+// twice the BDP, with stream frames made larger on fat pipes; the kernel's
+// own autotuning stops at tcp_wmem / tcp_rmem, below what a long fast path
+// needs to be kept full
+
+#define TUNE_BUF_MIN   (1 << 16)
+#define TUNE_BUF_MAX   (1 << 28)
+#define TUNE_CHUNK_MAX (CHUNK_SIZE << 4)
+#define TUNE_EVERY_US  1000 // samples a transfer takes at most
+
+// the kernel's struct tcp_info goes on past the end of glibc's, which
+// stops at tcpi_total_retrans
+struct tcp_info_ext
+{
+    struct tcp_info base;
+    uint64_t pacing_rate;
+    uint64_t max_pacing_rate;
+    uint64_t bytes_acked;
+    uint64_t bytes_received;
+    uint32_t segs_out;
+    uint32_t segs_in;
+    uint32_t notsent_bytes;
+    uint32_t min_rtt;
+    uint32_t data_segs_in;
+    uint32_t data_segs_out;
+    uint64_t delivery_rate;
+};
+
+// most a socket buffer can be set to without CAP_NET_ADMIN
+int buffer_limit(int opt)
+{
+    static int limits[2] = {-1, -1};
+    int &limit = limits[opt == SO_RCVBUF];
+    if (limit < 0)
+    {
+        FILE *fp = fopen(opt == SO_RCVBUF ? "/proc/sys/net/core/rmem_max"
+                                          : "/proc/sys/net/core/wmem_max", "r");
+        if (fp == nullptr || fscanf(fp, "%d", &limit) != 1)
+        {
+            limit = 0;
+        }
+        if (fp != nullptr)
+        {
+            fclose(fp);
+        }
+    }
+    return limit;
+}
+
+struct tcp_tuner
+{
+    uint32_t rtt_us = 0;     // smoothed RTT
+    uint32_t min_rtt_us = 0;
+    uint64_t rate = 0;       // best delivery rate of the transfer, bytes/s
+    uint64_t bdp = 0;        // bytes
+    int sndbuf = 0;          // as the kernel reports them
+    int rcvbuf = 0;
+    int chunk = CHUNK_SIZE;  // stream frame size
+    uint64_t grown = 0;      // buffer resizes
+    uint64_t transfers = 0;
+    uint64_t next_us = 0;
+    uint64_t mark_us = 0;    // receive rate since mark_bytes were in
+    uint64_t mark_bytes = 0;
+
+    static uint64_t clock_us()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    // a file starts streaming; rates are per transfer, the rest carries over
+    void begin()
+    {
+        ++transfers;
+        rate = 0;
+        next_us = 0;
+        mark_us = clock_us();
+        mark_bytes = 0;
+    }
+
+    // sending on fd, called before each frame; the frame size to use
+    int sent(int fd)
+    {
+        struct tcp_info_ext info;
+        if (!sample(fd, &info, false))
+        {
+            return chunk;
+        }
+        // an older kernel has no delivery rate, a window per RTT is close
+        if (info.delivery_rate > 0)
+        {
+            rate = std::max(rate, info.delivery_rate);
+        }
+        else if (rtt_us > 0)
+        {
+            rate = std::max(rate, (uint64_t)info.base.tcpi_snd_cwnd * info.base.tcpi_snd_mss *
+                                      1000000 / rtt_us);
+        }
+        bdp = rate * min_rtt_us / 1000000;
+        grow(fd, SO_SNDBUF, SO_SNDBUFFORCE, &sndbuf);
+
+        // a frame per quarter of what is in flight, never below the default
+        int want = CHUNK_SIZE;
+        while (want < TUNE_CHUNK_MAX && (uint64_t)want * 4 <= bdp)
+        {
+            want <<= 1;
+        }
+        chunk = want;
+        return chunk;
+    }
+
+    // received total bytes of the file on fd so far
+    void received(int fd, uint64_t total)
+    {
+        struct tcp_info_ext info;
+        uint64_t now = clock_us();
+        if (!sample(fd, &info, true))
+        {
+            return;
+        }
+        // the receiving side has no delivery rate, it times the data itself
+        if (now > mark_us && total > mark_bytes)
+        {
+            rate = std::max(rate, (total - mark_bytes) * 1000000 / (now - mark_us));
+        }
+        if (now - mark_us >= std::max(rtt_us, (uint32_t)TUNE_EVERY_US))
+        {
+            mark_us = now;
+            mark_bytes = total;
+        }
+        bdp = rate * rtt_us / 1000000;
+        grow(fd, SO_RCVBUF, SO_RCVBUFFORCE, &rcvbuf);
+    }
+
+    // one line on what the tuner saw of fd
+    int describe(int fd, char *buf, size_t size)
+    {
+        int snd = 0, rcv = 0;
+        socklen_t len = sizeof(snd);
+        getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &snd, &len);
+        len = sizeof(rcv);
+        getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcv, &len);
+        return snprintf(buf, size,
+                        "rtt %.3f ms, min rtt %.3f ms, rate %.1f MB/s, bdp %lu KiB, sndbuf %d KiB, "
+                        "rcvbuf %d KiB, chunk %d KiB, %lu transfers, %lu resizes\n",
+                        rtt_us / 1e3, min_rtt_us / 1e3, rate / 1e6, (unsigned long)(bdp >> 10),
+                        snd >> 10, rcv >> 10, chunk >> 10, (unsigned long)transfers,
+                        (unsigned long)grown);
+    }
+
+private:
+    // read TCP_INFO unless it was read less than TUNE_EVERY_US ago
+    bool sample(int fd, struct tcp_info_ext *info, bool receiving)
+    {
+        uint64_t now = clock_us();
+        if (now < next_us)
+        {
+            return false;
+        }
+        next_us = now + TUNE_EVERY_US;
+        memset(info, 0, sizeof(*info));
+        socklen_t len = sizeof(*info);
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, info, &len) < 0)
+        {
+            return false;
+        }
+        // a receiver's RTT from ACKs is stale, it estimates one from the data
+        rtt_us = receiving && info->base.tcpi_rcv_rtt > 0 ? info->base.tcpi_rcv_rtt
+                                                          : info->base.tcpi_rtt;
+        if (len > offsetof(struct tcp_info_ext, min_rtt) && info->min_rtt > 0)
+        {
+            min_rtt_us = info->min_rtt;
+        }
+        else if (min_rtt_us == 0 || rtt_us < min_rtt_us)
+        {
+            min_rtt_us = rtt_us;
+        }
+        return true;
+    }
+
+    // grow the opt buffer of fd to twice the BDP, the kernel doubling that
+    // again for its bookkeeping; never shrink it, setting a size turns the
+    // kernel's autotuning off for the socket and it may have gone further
+    void grow(int fd, int opt, int force, int *size)
+    {
+        socklen_t len = sizeof(*size);
+        if (getsockopt(fd, SOL_SOCKET, opt, size, &len) < 0)
+        {
+            return;
+        }
+        uint64_t want = std::min(std::max(2 * bdp, (uint64_t)TUNE_BUF_MIN), (uint64_t)TUNE_BUF_MAX);
+        if (2 * want <= (uint64_t)*size + *size / 4)
+        {
+            return;
+        }
+        int bytes = (int)want;
+        if (setsockopt(fd, SOL_SOCKET, force, &bytes, sizeof(bytes)) < 0)
+        {
+            bytes = std::min(bytes, buffer_limit(opt));
+            if (2 * (uint64_t)bytes <= (uint64_t)*size ||
+                setsockopt(fd, SOL_SOCKET, opt, &bytes, sizeof(bytes)) < 0)
+            {
+                return;
+            }
+        }
+        ++grown;
+        getsockopt(fd, SOL_SOCKET, opt, size, &len);
+    }
+};
+
+// the tuner of the connection whose file is streaming, nullptr when the
+// transfer is not over TCP or autotuning is off
+thread_local tcp_tuner *tuning = nullptr;
+
+#endif
@@ -1,11 +1,24 @@
 #include <string.h>
+#include <errno.h>
 #include <iostream>
 #include <fstream>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <fcntl.h>
+#include <endian.h>
+#include <ftp_crc32c.hpp>
+#include <ftp_trace.hpp>
+#include <ftp_transport.hpp>
+#include <ftp_span.hpp>
+#include <ftp_tune.hpp>
 
 #define MAGIC_NUMBER_LEN 6
 
@@ -15,6 +28,17 @@ typedef char byte;
 typedef uint8_t type;
 typedef uint8_t status;
 
+// the client command a request type stands for, as servers and replays
+// report them; "?" for anything else
+const char *request_name(type t)
+{
+    static const char *names[] = {"open", "ls", "cd", "get", "put", "sha256", "quit", "lsx",
+                                  "cp", "mv", "have", "chunk", "manifest", "mget", "tree",
+                                  "stats"};
+    int i = (t - OPEN_REQUEST) / 2;
+    return i >= 0 && i < (int)(sizeof(names) / sizeof(names[0])) ? names[i] : "?";
+}
+
 FILE *dfp = stdout;
 
 struct ftp_header
@@ -63,12 +87,20 @@ int serror(const char *msg, FILE *fp = dfp)
     return -1;
 }
 
-int ssend(int fd, void *buf, int size)
+// bytes this thread moved through the socket and copy calls below, for
+// the client to time its commands with
+thread_local uint64_t io_bytes = 0;
+
+int ssend(int fd, void *buf, int size, int flags = 0)
 {
-    size_t ret = 0;
+    int ret = 0;
     while (ret < size)
     {
-        ssize_t b = send(fd, buf + ret, size - ret, 0);
+        ssize_t b = transport_send(fd, (char *)buf + ret, size - ret, flags);
+        if (b < 0 && errno == EINTR)
+        {
+            continue;
+        }
         if (b == 0)
         {
             return serror("socket closed");
@@ -78,16 +110,53 @@ int ssend(int fd, void *buf, int size)
             return serror("ssend error");
         }
         ret += b;
+        io_bytes += b;
     }
     return ret;
 }
 
-int srecv(int fd, void *buf, int size)
+// send all of iov[0..cnt) with one writev per partial send
+int ssendv(int fd, struct iovec *iov, int cnt)
 {
     size_t ret = 0;
+    while (cnt > 0)
+    {
+        ssize_t b = transport_sendv(fd, iov, cnt);
+        if (b < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (b <= 0)
+        {
+            return serror(b == 0 ? "socket closed" : "ssendv error");
+        }
+        ret += b;
+        io_bytes += b;
+        while (cnt > 0 && (size_t)b >= iov->iov_len)
+        {
+            b -= iov->iov_len;
+            ++iov;
+            --cnt;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + b;
+            iov->iov_len -= b;
+        }
+    }
+    return ret;
+}
+
+int srecv(int fd, void *buf, int size)
+{
+    int ret = 0;
     while (ret < size)
     {
-        ssize_t b = recv(fd, buf + ret, size - ret, 0);
+        ssize_t b = transport_recv(fd, (char *)buf + ret, size - ret);
+        if (b < 0 && errno == EINTR)
+        {
+            continue;
+        }
         if (b == 0)
         {
             return serror("socket closed");
@@ -97,6 +166,26 @@ int srecv(int fd, void *buf, int size)
             return serror("srecv error");
         }
         ret += b;
+        io_bytes += b;
+    }
+    return ret;
+}
+
+int swrite(int fd, void *buf, int size)
+{
+    int ret = 0;
+    while (ret < size)
+    {
+        ssize_t b = write(fd, (char *)buf + ret, size - ret);
+        if (b < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (b < 0)
+        {
+            return serror("swrite error");
+        }
+        ret += b;
     }
     return ret;
 }
@@ -111,28 +200,208 @@ void show_data(void *buf, int size, FILE *fp = dfp)
     fprintf(fp, "\n");
 }
 
-int send_post(int fd, type type, void *buf = nullptr, int size = 0, status status = 0)
+// pass MSG_MORE as flags when more data follows right away, so a short
+// reply doesn't go out alone and leave Nagle holding back what follows
+// until the peer's delayed ACK
+int send_post(int fd, type type, void *buf = nullptr, int size = 0, status status = 0, int flags = 0)
 {
+    span_scope span("send");
     struct ftp_header header(type, HEADER_SIZE + size, status);
 #ifdef DEBUG
     header.show(0);
-    show_data(buf, size);
 #endif
+    uint64_t start = tracing() ? trace_clock() : 0;
     int scode;
-    if ((scode = ssend(fd, (void *)&header, HEADER_SIZE)) <= 0)
+    if ((scode = ssend(fd, (void *)&header, HEADER_SIZE, size > 0 ? MSG_MORE : flags)) > 0)
     {
-        return scode;
+        scode = ssend(fd, buf, size, flags);
+    }
+    if (start)
+    {
+        trace(start, fd, TRACE_SEND, type, status, size, scode >= 0);
+    }
+    return scode;
+}
+
+// hold back partial segments while the frames of a reply are queued, the
+// uncork pushes the tail at once instead of after the peer's delayed ACK;
+// a no-op on sockets other than TCP and RTP connections
+void cork(int fd, int on)
+{
+    transport_cork(fd, on);
+}
+
+// sendfile the size bytes of filefd at offset to fd
+int send_range(int fd, int filefd, off_t offset, size_t size)
+{
+    for (off_t end = offset + size; offset < end;)
+    {
+        ssize_t b = transport_sendfile(fd, filefd, &offset, end - offset);
+        if (b < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (b <= 0)
+        {
+            return serror(b == 0 ? "file truncated" : "sendfile error");
+        }
+        io_bytes += b;
+    }
+    return 0;
+}
+
+// copy all of in to out without the data leaving the kernel: a reflink
+// where the filesystem shares extents, copy_file_range otherwise, and
+// sendfile when the two files can't be copied between directly
+int copy_data(int in, int out, off_t size)
+{
+    span_scope span("copy");
+    if (ioctl(out, FICLONE, in) == 0)
+    {
+        io_bytes += size;
+        return 0;
+    }
+
+    off_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = copy_file_range(in, nullptr, out, nullptr, size - done, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && done == 0 &&
+            (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+        {
+            break;
+        }
+        if (n <= 0)
+        {
+            return serror(n == 0 ? "file truncated" : "copy_file_range error");
+        }
+        done += n;
+        io_bytes += n;
+    }
+
+    while (done < size)
+    {
+        ssize_t n = sendfile(out, in, &done, size - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return serror(n == 0 ? "file truncated" : "sendfile error");
+        }
+        io_bytes += n;
+    }
+    return 0;
+}
+
+// zero-copy variant of send_post, the payload is size bytes of filefd at offset
+int send_file(int fd, type type, int filefd, off_t offset, int size, status status = 0)
+{
+    span_scope span("send");
+    struct ftp_header header(type, HEADER_SIZE + size, status);
+#ifdef DEBUG
+    header.show(0);
+#endif
+    uint64_t start = tracing() ? trace_clock() : 0;
+    int scode;
+    if ((scode = ssend(fd, (void *)&header, HEADER_SIZE, size > 0 ? MSG_MORE : 0)) > 0 &&
+        send_range(fd, filefd, offset, size) < 0)
+    {
+        scode = -1;
+    }
+    if (start)
+    {
+        trace(start, fd, TRACE_SEND, type, status, size, scode > 0);
+    }
+    return scode > 0 ? size : -1;
+}
+
+// send_post over an AF_UNIX socket with the descriptor passfd attached,
+// the peer takes both in with recv_post_fd
+int send_post_fd(int fd, type type, void *buf, int size, status status, int passfd)
+{
+    span_scope span("send");
+    struct ftp_header header(type, HEADER_SIZE + size, status);
+    struct iovec iov[2] = {{&header, HEADER_SIZE}, {buf, (size_t)size}};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = size > 0 ? 2 : 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+
+    uint64_t start = tracing() ? trace_clock() : 0;
+    ssize_t b;
+    while ((b = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR)
+    {
+    }
+    int scode = b < 0 ? serror("sendmsg error") : HEADER_SIZE + size;
+
+    // the descriptor went with the first byte, what is left is plain data
+    if (b >= 0 && b < (ssize_t)(HEADER_SIZE + size))
+    {
+        int cnt = msg.msg_iovlen;
+        struct iovec *rest = iov;
+        while (b >= (ssize_t)rest->iov_len)
+        {
+            b -= rest->iov_len;
+            ++rest;
+            --cnt;
+        }
+        rest->iov_base = (char *)rest->iov_base + b;
+        rest->iov_len -= b;
+        if (ssendv(fd, rest, cnt) < 0)
+        {
+            scode = -1;
+        }
+    }
+    if (start)
+    {
+        trace(start, fd, TRACE_SEND, type, status, size, scode >= 0);
+    }
+    return scode;
+}
+
+// retry-after in ms of the last BUSY_REPLY received, for a client to set
+// to 0 and look at when a request fails
+thread_local uint32_t busy_retry_ms = 0;
+
+// note when a server shedding load asks to be tried again
+void recv_busy(const struct ftp_header &header, const void *buf, int size)
+{
+    if (header.m_type == BUSY_REPLY && size >= (int)sizeof(uint32_t))
+    {
+        uint32_t ms;
+        memcpy(&ms, buf, sizeof(ms));
+        busy_retry_ms = std::max(ntohl(ms), 1U);
     }
-    return ssend(fd, buf, size);
 }
 
 int recv_post(int fd, void *buf, type *ptype, status *pstatus = nullptr)
 {
+    span_scope span("recv");
     struct ftp_header header;
     int scode;
     int length;
+    uint64_t start = tracing() ? trace_clock() : 0;
     if ((scode = srecv(fd, (void *)&header, HEADER_SIZE)) <= 0)
     {
+        if (start)
+        {
+            trace(start, fd, TRACE_RECV, 0, 0, 0, false);
+        }
         return scode;
     }
     *ptype = header.m_type;
@@ -144,11 +413,312 @@ int recv_post(int fd, void *buf, type *ptype, status *pstatus = nullptr)
     int size = srecv(fd, buf, length);
 #ifdef DEBUG
     header.show(1);
-    show_data(buf, size);
 #endif
+    recv_busy(header, buf, size);
+    if (start)
+    {
+        trace(start, fd, TRACE_RECV, header.m_type, header.m_status, length, size >= 0);
+    }
+    return size;
+}
+
+// recv_post that also takes in a descriptor sent along by send_post_fd,
+// *passfd is -1 if the frame came without one
+int recv_post_fd(int fd, void *buf, type *ptype, status *pstatus, int *passfd)
+{
+    struct ftp_header header;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&header, HEADER_SIZE};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    *passfd = -1;
+
+    uint64_t start = tracing() ? trace_clock() : 0;
+    ssize_t b;
+    while ((b = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+    {
+    }
+    for (struct cmsghdr *cmsg = b > 0 ? CMSG_FIRSTHDR(&msg) : nullptr; cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(passfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (b > 0 && b < (ssize_t)HEADER_SIZE && srecv(fd, (char *)&header + b, HEADER_SIZE - b) <= 0)
+    {
+        b = -1;
+    }
+    if (b <= 0)
+    {
+        if (*passfd >= 0)
+        {
+            close(*passfd);
+            *passfd = -1;
+        }
+        if (start)
+        {
+            trace(start, fd, TRACE_RECV, 0, 0, 0, false);
+        }
+        return b == 0 ? serror("socket closed") : serror("recvmsg error");
+    }
+    *ptype = header.m_type;
+    *pstatus = header.m_status;
+    int length = ntohl(header.m_length) - HEADER_SIZE;
+    int size = srecv(fd, buf, length);
+    recv_busy(header, buf, size);
+    if (start)
+    {
+        trace(start, fd, TRACE_RECV, header.m_type, header.m_status, length, size >= 0);
+    }
     return size;
 }
 
+// the stream flags both sides can use given the flags a peer asked for
+status data_flags(status wanted)
+{
+    if ((wanted & DATA_STREAM) == 0)
+    {
+        return 0;
+    }
+    return wanted & (DATA_STREAM | DATA_CRC32C | DATA_EXTENT);
+}
+
+// send one DATA_STREAM frame holding the size bytes of filefd at offset,
+// prefixed with DATA_EXTENT by pos, where they go in the file being sent,
+// and followed by the CRC32C of the data with DATA_CRC32C
+int send_chunk(int fd, int filefd, off_t offset, int size, status s, off_t pos)
+{
+    struct
+    {
+        struct ftp_header header;
+        uint64_t offset;
+    } __attribute__((packed)) head;
+    int prefix = (s & DATA_EXTENT) ? sizeof(head.offset) : 0;
+    int trailer = (s & DATA_CRC32C) ? sizeof(uint32_t) : 0;
+    head.header = ftp_header(FILE_DATA, HEADER_SIZE + prefix + size + trailer, s);
+    head.offset = htobe64(pos);
+
+    uint64_t start = tracing() ? trace_clock() : 0;
+    int scode = ssend(fd, (void *)&head, HEADER_SIZE + prefix, size + trailer > 0 ? MSG_MORE : 0);
+    if (scode > 0 && trailer)
+    {
+        // checksum the bytes actually read, a file truncated meanwhile
+        // fails the frame instead of faulting on a mapping past its end
+        char buf[CHUNK_SIZE];
+        uint32_t sum = 0;
+        for (int done = 0, n; scode > 0 && done < size; done += n)
+        {
+            n = pread(filefd, buf, std::min(size - done, (int)sizeof(buf)), offset + done);
+            if (n <= 0)
+            {
+                scode = serror("read file error");
+                break;
+            }
+            sum = crc32c(sum, buf, n);
+            scode = ssend(fd, buf, n, MSG_MORE) < 0 ? -1 : 1;
+        }
+        uint32_t crc = htonl(sum);
+        if (scode > 0 && ssend(fd, (void *)&crc, sizeof(crc)) <= 0)
+        {
+            scode = -1;
+        }
+    }
+    else if (scode > 0 && send_range(fd, filefd, offset, size) < 0)
+    {
+        scode = -1;
+    }
+    if (start)
+    {
+        trace(start, fd, TRACE_SEND, FILE_DATA, s, prefix + size + trailer, scode > 0);
+    }
+    return scode > 0 ? 0 : -1;
+}
+
+// send the bytes [from, to) of filefd as frames of up to CHUNK_SIZE bytes,
+// or what the tuner makes of it, all flagged DATA_MORE except the one
+// ending the stream when last is set
+int send_chunks(int fd, int filefd, off_t from, off_t to, status flags, bool last)
+{
+    off_t offset = from;
+    do
+    {
+        int n = std::min(to - offset, (off_t)(tuning ? tuning->sent(fd) : CHUNK_SIZE));
+        status s = flags & ~DATA_MORE;
+        if (!last || offset + n < to)
+        {
+            s |= DATA_MORE;
+        }
+        if (send_chunk(fd, filefd, offset, n, s, offset) < 0)
+        {
+            return -1;
+        }
+        offset += n;
+    } while (offset < to);
+    return 0;
+}
+
+// send size bytes of filefd as FILE_DATA: a single frame when flags is 0,
+// otherwise DATA_STREAM frames of up to CHUNK_SIZE bytes flagged DATA_MORE
+// but the last, each followed by its CRC32C when DATA_CRC32C is set; with
+// DATA_EXTENT only the data extents found by SEEK_DATA/SEEK_HOLE are sent
+int send_stream(int fd, int filefd, off_t size, status flags)
+{
+    span_scope span("send data");
+    if (flags == 0)
+    {
+        return send_file(fd, FILE_DATA, filefd, 0, size);
+    }
+
+    int scode = 0;
+    if (tuning)
+    {
+        tuning->begin();
+    }
+    cork(fd, 1);
+    if (flags & DATA_EXTENT)
+    {
+        // filesystems without hole tracking report the whole file as data
+        off_t offset = 0;
+        while (scode == 0 && offset < size)
+        {
+            off_t data = lseek(filefd, offset, SEEK_DATA);
+            if (data < 0 && errno == ENXIO)
+            {
+                break;
+            }
+            off_t hole = data < 0 ? size : lseek(filefd, data, SEEK_HOLE);
+            data = data < 0 ? offset : std::min(data, size);
+            hole = hole < 0 ? size : std::min(hole, size);
+            if (data < hole)
+            {
+                scode = send_chunks(fd, filefd, data, hole, flags, false);
+            }
+            offset = std::max(hole, data + 1);
+        }
+        if (scode == 0)
+        {
+            scode = send_chunk(fd, filefd, size, 0, flags & ~DATA_MORE, size);
+        }
+    }
+    else
+    {
+        scode = send_chunks(fd, filefd, 0, size, flags, true);
+    }
+    cork(fd, 0);
+    return scode < 0 ? -1 : 0;
+}
+
+// receive FILE_DATA frames into filefd (discarded if filefd < 0) up to the
+// last one, checking CRC32C trailers as the data is written; extent frames
+// are written at their offset, so skipped holes stay holes, and the file is
+// truncated to the size the final one carries; returns the number of bytes
+// received, or -1 if any frame was bad
+off_t recv_stream(int fd, int filefd)
+{
+    span_scope span("recv data");
+    char buf[CHUNK_SIZE];
+    struct ftp_header header;
+    off_t total = 0;
+    off_t end = -1;
+    bool bad = false;
+    if (tuning)
+    {
+        tuning->begin();
+    }
+    do
+    {
+        uint64_t start = tracing() ? trace_clock() : 0;
+        if (srecv(fd, (void *)&header, HEADER_SIZE) <= 0)
+        {
+            return -1;
+        }
+        if (header.m_type != FILE_DATA)
+        {
+            return serror("bad file data");
+        }
+        uint32_t length = ntohl(header.m_length) - HEADER_SIZE;
+        bool stream = header.m_status & DATA_STREAM;
+        bool crc = stream && (header.m_status & DATA_CRC32C);
+        bool extent = stream && (header.m_status & DATA_EXTENT);
+        uint32_t extra = (crc ? sizeof(uint32_t) : 0) + (extent ? sizeof(uint64_t) : 0);
+        if (length < extra)
+        {
+            return serror("bad file data");
+        }
+        length -= extra;
+
+        if (extent)
+        {
+            uint64_t offset;
+            if (srecv(fd, (void *)&offset, sizeof(offset)) <= 0)
+            {
+                return -1;
+            }
+            end = be64toh(offset);
+            if (filefd >= 0 && lseek(filefd, end, SEEK_SET) < 0)
+            {
+                bad = true;
+                filefd = -1;
+            }
+            end += length;
+        }
+
+        uint32_t sum = 0;
+        while (length > 0)
+        {
+            int n = std::min(length, (uint32_t)sizeof(buf));
+            if (srecv(fd, buf, n) < 0)
+            {
+                return -1;
+            }
+            if (crc)
+            {
+                sum = crc32c(sum, buf, n);
+            }
+            if (filefd >= 0 && swrite(filefd, buf, n) < 0)
+            {
+                bad = true;
+                filefd = -1;
+            }
+            total += n;
+            length -= n;
+        }
+        if (tuning)
+        {
+            tuning->received(fd, total);
+        }
+
+        uint32_t trailer;
+        if (crc && srecv(fd, (void *)&trailer, sizeof(trailer)) <= 0)
+        {
+            return -1;
+        }
+        if (crc && ntohl(trailer) != sum)
+        {
+            serror("chunk checksum mismatch");
+            bad = true;
+        }
+        if (start)
+        {
+            trace(start, fd, TRACE_RECV, FILE_DATA, header.m_status,
+                  ntohl(header.m_length) - HEADER_SIZE, !bad);
+        }
+    } while ((header.m_status & (DATA_STREAM | DATA_MORE)) == (DATA_STREAM | DATA_MORE));
+
+    // a trailing hole is only known from the size the last frame carries
+    if (end >= 0 && filefd >= 0 && ftruncate(filefd, end) < 0)
+    {
+        bad = true;
+    }
+    return bad ? -1 : total;
+}
+
 int write_file(char *filename, void *buf, int size)
 {
     std::ofstream ofs(filename, std::ios::out | std::ios::binary);
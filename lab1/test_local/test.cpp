@@ -7,9 +7,14 @@
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
 #include <cstdlib>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 pid_t startSubProcess(int *writefd, std::string exe, std::vector<std::string> &&args, std::filesystem::path &working_directory, int need_kill=1) {
     std::filesystem::remove_all(working_directory);
@@ -184,6 +189,78 @@ int prepareMulti(int* client_fd, int& server_port, pid_t& server_pid, pid_t* cli
     return 0;
 }
 
+// our ftp_server with extra options and our ftp_client, whose output goes
+// to client.out beside the test, already connected to each other
+int prepareOwn(int& client_fd, int& server_port, pid_t& server_pid, pid_t& client_pid, std::vector<std::string> &&options) {
+    current_dir = std::filesystem::current_path();
+    tmp_dir_ser = current_dir / "tmp_dir_server";
+    tmp_dir_cli = current_dir / "tmp_dir_client";
+
+    client_fd = 0;
+    server_port = randPort();
+
+    std::vector<std::string> args = {"", "127.0.0.1", std::to_string(server_port)};
+    args.insert(args.end(), options.begin(), options.end());
+    server_pid = startSubProcess(nullptr, current_dir / "ftp_server", std::move(args), tmp_dir_ser);
+    EXPECT_GE(server_pid, 0);
+
+    std::string client = "exec " + (current_dir / "ftp_client").string() + " > " + (current_dir / "client.out").string();
+    client_pid = startSubProcess(&client_fd, "/bin/sh", {"sh", "-c", client}, tmp_dir_cli, 0);
+    EXPECT_GE(client_pid, 0);
+
+    if (server_pid <= 0 || client_pid <= 0) {
+        clearProcess(server_pid);
+        clearProcess(client_pid);
+        return -1;
+    }
+
+    std::string cmd_str = "open 127.0.0.1 " + std::to_string(server_port) + "\n";
+    write(client_fd, cmd_str.c_str(), cmd_str.length());
+    usleep(500000);
+
+    return 0;
+}
+
+/**
+ * @brief Feed the last commands to the client, which exits at the end of
+ * its input, and wait for it
+ *
+ * @return int the exit code, -1 when it did not exit in time
+ */
+int finishClient(int client_fd, pid_t client_pid, std::string cmd_str, int seconds = 10) {
+    write(client_fd, cmd_str.c_str(), cmd_str.length());
+    close(client_fd);
+    int code = -1;
+    for (int i = 0; i < 2 * seconds && code == -1; i ++)
+        code = waitProcessExit(client_pid);
+    return code;
+}
+
+std::string clientOutput() {
+    std::ifstream fin((current_dir / "client.out").string(), std::ios::in);
+    return std::string(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+}
+
+std::string readFile(std::filesystem::path path) {
+    std::ifstream fin(path.string(), std::ios::in | std::ios::binary);
+    if (!fin)
+        return "<missing>";
+    return std::string(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+}
+
+void writeFile(std::filesystem::path path, const std::string &content) {
+    std::ofstream fout(path.string(), std::ios::out | std::ios::binary);
+    fout << content;
+    fout.close();
+}
+
+std::string randomContent(size_t size) {
+    std::string content(size, '\0');
+    for (size_t i = 0; i < size; i ++)
+        content[i] = (char)(rand() >> 7);
+    return content;
+}
+
 TEST(FTPServer, Open) {
     pid_t server_pid, client_pid;
     int server_port, client_fd;
@@ -598,6 +675,77 @@ TEST(FTPServer, MultiPut) {
 
 
 
+// speak the protocol directly to put a chunk whose CRC32C trailer is wrong
+int rawPost(int sock, uint8_t type, uint8_t status, const std::string &body) {
+    std::string post = std::string("\xc1\xa1\x10" "ftp", 6) + (char)type + (char)status;
+    uint32_t length = htonl(12 + body.size());
+    post.append((char *)&length, 4).append(body);
+    return send(sock, post.data(), post.size(), 0) == (ssize_t)post.size() ? 0 : -1;
+}
+
+int rawReply(int sock, uint8_t &type, uint8_t &status) {
+    char header[12];
+    if (recv(sock, header, sizeof(header), MSG_WAITALL) != sizeof(header))
+        return -1;
+    type = header[6];
+    status = header[7];
+    return 0;
+}
+
+uint32_t crc32c(const std::string &data) {
+    uint32_t crc = ~0u;
+    for (unsigned char c : data) {
+        crc ^= c;
+        for (int k = 0; k < 8; k ++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+    }
+    return ~crc;
+}
+
+TEST(FTPServer, ChecksumMismatch) {
+    pid_t server_pid;
+    int server_port;
+    current_dir = std::filesystem::current_path();
+    tmp_dir_ser = current_dir / "tmp_dir_server";
+    server_port = randPort();
+    server_pid = startSubProcess(nullptr, current_dir / "ftp_server", {"", "127.0.0.1", std::to_string(server_port)}, tmp_dir_ser);
+    if (server_pid <= 0)
+        return ;
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server_port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    ASSERT_EQ(connect(sock, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    uint8_t type, status;
+    ASSERT_EQ(rawPost(sock, 0xA1, 0, ""), 0);
+    ASSERT_EQ(rawReply(sock, type, status), 0);
+
+    // stream (0x80) with a CRC32C trailer (0x02) and a PUT_REPLY after the data (0x08)
+    std::string data = randomContent(1000);
+    for (int bad = 0; bad < 2; bad ++) {
+        std::string name = bad ? "bad.bin" : "good.bin";
+        ASSERT_EQ(rawPost(sock, 0xA9, 0x80 | 0x02 | 0x08, name + '\0'), 0);
+        ASSERT_EQ(rawReply(sock, type, status), 0);
+        EXPECT_EQ(type, 0xAA);
+        EXPECT_NE(status & 0x02, 0);
+
+        uint32_t crc = htonl(crc32c(data) ^ bad);
+        ASSERT_EQ(rawPost(sock, 0xFF, 0x80 | 0x02, data + std::string((char *)&crc, 4)), 0);
+        ASSERT_EQ(rawReply(sock, type, status), 0);
+        EXPECT_EQ(type, 0xAA);
+        EXPECT_EQ(status, bad ? 0 : 1);
+    }
+    close(sock);
+    usleep(500000);
+
+    EXPECT_EQ(readFile(tmp_dir_ser / "good.bin"), data);
+    EXPECT_FALSE(std::filesystem::exists(tmp_dir_ser / "bad.bin"));
+
+    clearProcess(server_pid);
+}
+
 
 
 
@@ -711,6 +859,262 @@ TEST(FTPClient, Put) {
     clearProcess(server_pid);
 }
 
+TEST(FTPClient, BackgroundRefused) {
+    pid_t server_pid, client_pid;
+    int server_port, client_fd;
+    std::string cmd_str;
+
+    // the interactive connection takes the only one the server allows, so
+    // the pool's is refused; the job queued behind it must not wait forever
+    current_dir = std::filesystem::current_path();
+    tmp_dir_ser = current_dir / "tmp_dir_server";
+    tmp_dir_cli = current_dir / "tmp_dir_client";
+    server_port = randPort();
+    server_pid = startSubProcess(nullptr, current_dir / "ftp_server", {"", "127.0.0.1", std::to_string(server_port), "max_conns=1"}, tmp_dir_ser);
+    client_pid = startSubProcess(&client_fd, current_dir / "ftp_client", {""}, tmp_dir_cli);
+    if (server_pid <= 0 || client_pid <= 0) {
+        clearProcess(server_pid);
+        clearProcess(client_pid);
+        return ;
+    }
+
+    cmd_str = "open 127.0.0.1 " + std::to_string(server_port) + "\n";
+    write(client_fd, cmd_str.c_str(), cmd_str.length());
+    usleep(500000);
+
+    // the client exits at the end of its input once both jobs are over
+    cmd_str = "bg conns 1\nbg get a.txt\nbg get b.txt\nwait\n";
+    write(client_fd, cmd_str.c_str(), cmd_str.length());
+    close(client_fd);
+    usleep(3000000);
+
+    int code = waitProcessExit(client_pid);
+    EXPECT_EQ(code, 0);
+
+    clearProcess(client_pid);
+    clearProcess(server_pid);
+}
+
+TEST(FTPClient, SparseGet) {
+    pid_t server_pid, client_pid;
+    int server_port, client_fd;
+
+    if (prepareOwn(client_fd, server_port, server_pid, client_pid, {}) != 0)
+        return ;
+
+    // 8 MiB with one byte of data in the middle, the rest is holes
+    std::filesystem::path path = tmp_dir_ser / "sparse.bin";
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    pwrite(fd, "x", 1, 4 << 20);
+    ftruncate(fd, 8 << 20);
+    close(fd);
+
+    int code = finishClient(client_fd, client_pid, "sparse on\nget sparse.bin\n");
+    EXPECT_EQ(code, 0);
+
+    struct stat st;
+    std::string content = readFile(tmp_dir_cli / "sparse.bin");
+    std::string expect(8 << 20, '\0');
+    expect[4 << 20] = 'x';
+    EXPECT_TRUE(content == expect);
+    ASSERT_EQ(stat((tmp_dir_cli / "sparse.bin").c_str(), &st), 0);
+    EXPECT_LT(st.st_blocks * 512, 1 << 20);
+
+    clearProcess(client_pid);
+    clearProcess(server_pid);
+}
+
+TEST(FTPClient, ListPaged) {
+    pid_t server_pid, client_pid;
+    int server_port, client_fd;
+
+    if (prepareOwn(client_fd, server_port, server_pid, client_pid, {}) != 0)
+        return ;
+
+    // far more records than fit one LISTX page, each with its own size
+    const int files = 5000;
+    for (int i = 0; i < files; i ++) {
+        std::ofstream fout((tmp_dir_ser / ("file_" + std::to_string(i) + ".dat")).string(), std::ios::out);
+        fout << std::string(i % 10, 'x');
+        fout.close();
+    }
+
+    int code = finishClient(client_fd, client_pid, "lsx\n");
+    EXPECT_EQ(code, 0);
+
+    // "- <size> <date> <time> <name>" once for every file, the first one
+    // behind the prompt
+    std::istringstream lines(clientOutput());
+    std::string line;
+    std::vector<int> seen(files, 0);
+    int bad = 0;
+    while (std::getline(lines, line)) {
+        char kind, name[64];
+        unsigned long long size;
+        int i;
+        line = line.substr(line.find_last_of('>') + 1);
+        if (sscanf(line.c_str(), "%c %llu %*s %*s %63s", &kind, &size, name) != 3 ||
+            sscanf(name, "file_%d.dat", &i) != 1)
+            continue;
+        if (i < 0 || i >= files || size != (unsigned long long)(i % 10))
+            bad ++;
+        else
+            seen[i] ++;
+    }
+    EXPECT_EQ(bad, 0);
+    EXPECT_EQ(std::count(seen.begin(), seen.end(), 1), files);
+
+    clearProcess(client_pid);
+    clearProcess(server_pid);
+}
+
+TEST(FTPClient, CopyMove) {
+    pid_t server_pid, client_pid;
+    int server_port, client_fd;
+
+    if (prepareOwn(client_fd, server_port, server_pid, client_pid, {}) != 0)
+        return ;
+
+    std::string content = randomContent(300000);
+    writeFile(tmp_dir_ser / "a.bin", content);
+
+    // /dev/shm is a tmpfs, so a move there has to copy and unlink
+    std::filesystem::path other = "/dev/shm/ftp_test_moved.bin";
+    std::filesystem::remove(other);
+    struct stat here, there;
+    bool exdev = stat(tmp_dir_ser.c_str(), &here) == 0 && stat("/dev/shm", &there) == 0 && here.st_dev != there.st_dev;
+
+    std::string cmd_str = "cp a.bin b.bin\ncp b.bin b.bin\ncp a.bin ./a.bin\nmv b.bin c.bin\n";
+    if (exdev)
+        cmd_str += "mv c.bin " + other.string() + "\n";
+    int code = finishClient(client_fd, client_pid, cmd_str);
+    EXPECT_EQ(code, 0);
+
+    // copying a file onto itself is refused instead of truncating it
+    EXPECT_TRUE(readFile(tmp_dir_ser / "a.bin") == content);
+    EXPECT_FALSE(std::filesystem::exists(tmp_dir_ser / "b.bin"));
+    std::string output = clientOutput();
+    int refused = 0;
+    for (size_t pos = 0; (pos = output.find("copy failed", pos)) != std::string::npos; pos ++)
+        refused ++;
+    EXPECT_EQ(refused, 2);
+
+    if (exdev) {
+        EXPECT_FALSE(std::filesystem::exists(tmp_dir_ser / "c.bin"));
+        EXPECT_TRUE(readFile(other) == content);
+        std::filesystem::remove(other);
+    } else {
+        EXPECT_TRUE(readFile(tmp_dir_ser / "c.bin") == content);
+    }
+
+    clearProcess(client_pid);
+    clearProcess(server_pid);
+}
+
+TEST(FTPClient, DedupPutGet) {
+    pid_t server_pid, client_pid;
+    int server_port, client_fd;
+    std::string cmd_str;
+
+    if (prepareOwn(client_fd, server_port, server_pid, client_pid, {"storage=dedup"}) != 0)
+        return ;
+
+    std::string content = randomContent(3000000);
+    writeFile(tmp_dir_cli / "a.bin", content);
+    writeFile(tmp_dir_cli / "b.bin", content);
+
+    // the second upload finds every chunk stored already
+    cmd_str = "dedup on\nput a.bin\nput b.bin\n";
+    write(client_fd, cmd_str.c_str(), cmd_str.length());
+    usleep(2000000);
+    std::string output = clientOutput();
+    size_t first = output.find(" chunks sent");
+    size_t second = output.find(" chunks sent", first + 1);
+    ASSERT_NE(second, std::string::npos);
+    EXPECT_EQ(output.compare(output.rfind('>', second) + 1, 2, "0 "), 0);
+
+    // what the server keeps is a manifest, a GET has to reassemble it
+    EXPECT_LT(std::filesystem::file_size(tmp_dir_ser / "a.bin"), content.size());
+    std::filesystem::remove(tmp_dir_cli / "a.bin");
+    int code = finishClient(client_fd, client_pid, "get a.bin\n");
+    EXPECT_EQ(code, 0);
+    EXPECT_TRUE(readFile(tmp_dir_cli / "a.bin") == content);
+
+    clearProcess(client_pid);
+    clearProcess(server_pid);
+}
+
+TEST(FTPClient, BundleUnsafeName) {
+    pid_t server_pid, client_pid;
+    int server_port, client_fd;
+
+    if (prepareOwn(client_fd, server_port, server_pid, client_pid, {}) != 0)
+        return ;
+
+    // from sub, "../escape.txt" names a file of the server beside it, which
+    // unpacked as named would land beside the client's directory
+    std::filesystem::create_directory(tmp_dir_ser / "sub");
+    writeFile(tmp_dir_ser / "sub" / "safe.txt", "safe");
+    writeFile(tmp_dir_ser / "escape.txt", "escape");
+    std::filesystem::remove(current_dir / "escape.txt");
+
+    int code = finishClient(client_fd, client_pid, "cd sub\nmget safe.txt ../escape.txt\n");
+    EXPECT_EQ(code, 0);
+
+    EXPECT_EQ(readFile(tmp_dir_cli / "safe.txt"), "safe");
+    EXPECT_FALSE(std::filesystem::exists(current_dir / "escape.txt"));
+    EXPECT_NE(clientOutput().find("unsafe bundle name"), std::string::npos);
+
+    clearProcess(client_pid);
+    clearProcess(server_pid);
+}
+
+TEST(FTPClient, TreeHash) {
+    pid_t server_pid, client_pid;
+    int server_port, client_fd;
+    std::string cmd_str;
+
+    if (prepareOwn(client_fd, server_port, server_pid, client_pid, {}) != 0)
+        return ;
+
+    // four 1 MiB leaves, the same file on both sides
+    std::string content = randomContent(3500000);
+    writeFile(tmp_dir_ser / "t.bin", content);
+    writeFile(tmp_dir_cli / "t.bin", content);
+
+    cmd_str = "tree t.bin\ntree check t.bin\n";
+    write(client_fd, cmd_str.c_str(), cmd_str.length());
+    usleep(1000000);
+
+    // one byte in the second leaf changes on the server
+    int fd = open((tmp_dir_ser / "t.bin").c_str(), O_WRONLY);
+    char c = content[1500000] ^ 1;
+    pwrite(fd, &c, 1, 1500000);
+    close(fd);
+
+    int code = finishClient(client_fd, client_pid, "tree t.bin\ntree check t.bin\n");
+    EXPECT_EQ(code, 0);
+
+    std::istringstream lines(clientOutput());
+    std::string line;
+    std::vector<std::string> roots;
+    while (std::getline(lines, line)) {
+        line = line.substr(line.find_last_of('>') + 1);
+        if (line.size() > 64 && line.compare(64, 2, "  ") == 0)
+            roots.push_back(line);
+    }
+    // the root repeats for the same content, and the local copy matches it
+    ASSERT_EQ(roots.size(), 3);
+    EXPECT_EQ(roots[0] + " matches", roots[1]);
+    EXPECT_NE(roots[0], roots[2]);
+    std::string output = clientOutput();
+    EXPECT_NE(output.find("leaf 1 differs"), std::string::npos);
+    EXPECT_NE(output.find("1 of 4 leaves differ"), std::string::npos);
+
+    clearProcess(client_pid);
+    clearProcess(server_pid);
+}
+
 int _tmain(int argc, wchar_t* argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
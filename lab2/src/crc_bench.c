@@ -0,0 +1,76 @@
+#include "rtp.h"
+#include "util.h"
+#include <time.h>
+
+// checks every CRC-32 kernel against the bytewise one and reports the
+// throughput of each on RTP packet sized and large buffers
+
+#define BENCH_BYTES (1 << 28) // data each measurement goes through
+#define BENCH_LARGE (1 << 20)
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    int n, sizes[3] = {64, sizeof(rtp_packet_t), BENCH_LARGE};
+    const crc32_kernel_t *kernels = crc32_kernels(&n);
+    uint8_t *buf = malloc(BENCH_LARGE + 64);
+
+    if (!buf)
+    {
+        LOG_FATAL("malloc error\n");
+    }
+    srand(1);
+    for (int i = 0; i < BENCH_LARGE + 64; ++i)
+    {
+        buf[i] = rand();
+    }
+
+    // odd lengths at odd offsets, and one buffer chained in two pieces
+    for (int len = 0; len < 4096; len += 1 + len / 64)
+    {
+        int off = len % 61, cut = len / 3;
+        uint32_t want = kernels[0].func(~0u, buf + off, len);
+        for (int k = 1; k < n; ++k)
+        {
+            uint32_t got = kernels[k].func(~0u, buf + off, len);
+            uint32_t chained = kernels[k].func(kernels[k].func(~0u, buf + off, cut),
+                                               buf + off + cut, len - cut);
+            if (got != want || chained != want)
+            {
+                LOG_FATAL("%s: crc of %d bytes is %08x, not %08x\n", kernels[k].name, len,
+                          got != want ? got : chained, want);
+            }
+        }
+    }
+    if (compute_checksum("123456789", 9) != 0xCBF43926)
+    {
+        LOG_FATAL("compute_checksum: check value is %08x\n", compute_checksum("123456789", 9));
+    }
+    LOG_MSG("all %d kernels agree, compute_checksum uses %s\n", n, kernels[n - 1].name);
+
+    for (int k = 0; k < n; ++k)
+    {
+        for (int s = 0; s < 3; ++s)
+        {
+            long rounds = BENCH_BYTES / sizes[s];
+            volatile uint32_t sink = 0;
+            double start = now_s();
+            for (long r = 0; r < rounds; ++r)
+            {
+                sink += kernels[k].func(~0u, buf + (r & 63), sizes[s]);
+            }
+            double secs = now_s() - start;
+            LOG_MSG("%-12s %8d bytes: %7.2f GB/s\n", kernels[k].name, sizes[s],
+                    rounds * (double)sizes[s] / secs / 1e9);
+        }
+    }
+
+    free(buf);
+    return 0;
+}
@@ -4,6 +4,9 @@
 #define MAXBUF  1 << 21
 #define PAYLOAD_MAX 1461
 #define MAXSEND 50
+#define MMSG_MAX 64 // packets per sendmmsg / recvmmsg
+#define GRO_SEGS 64 // most packets the kernel coalesces into one UDP GRO buffer
+#define BATCH_MAX 256 // data packets the sender queues and the receiver takes at once
 
 #define RECV_S 2
 #define WAIT_S 5
@@ -1,10 +1,31 @@
 #include "rtp.h"
 #include "util.h"
+#include <fcntl.h>
 
 int sock;
 struct sockaddr_in addr;
 socklen_t addrlen;
 uint32_t sqn;
+int offload; // UDP GRO for data bursts
+
+// data packets as received, coalesced ones already cut apart
+rtp_packet_t pkts[BATCH_MAX];
+int scodes[BATCH_MAX];
+
+// acks on their way out, sent together for each batch of packets received
+rtp_packet_t acks[BATCH_MAX];
+int nack;
+
+void queue_ack(uint32_t seqnum)
+{
+    make_packet(&acks[nack++], seqnum, RTP_ACK, 0, NULL);
+}
+
+void flush_acks()
+{
+    send_packets(sock, (struct sockaddr *)&addr, acks, nack, 0);
+    nack = 0;
+}
 
 void establish_connection()
 {
@@ -89,78 +110,89 @@ void break_connection()
 
 void transfer_data(char *filename, int wsize, int mode)
 {
-    rtp_packet_t packet;
-    int fsize = 0, scode, shift = 0, mov;
+    int k, npkt, done = 0, shift = 0, mov;
     int window[wsize];
-    char buf[MAXBUF];
     uint32_t wbase = sqn;
 
+    // each payload goes straight to its place in the file, nothing but the
+    // packet at hand is held
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        LOG_FATAL("open file error (w)\n");
+    }
+
     memset(window, 0, sizeof(window));
 
     set_sock_recv_time(sock, WAIT_S, 0);
-    while (1)
+    while (!done)
     {
-        scode = recv_packet(sock, (struct sockaddr *)&addr, &addrlen, &packet);
+        npkt = recv_packets(sock, (struct sockaddr *)&addr, &addrlen, pkts, scodes, BATCH_MAX, offload);
         // data transfer terminated
-        if (scode == -2 || packet.rtp.flags & RTP_FIN)
+        if (npkt == -2)
         {
             break;
         }
-        // invalid packet
-        if (scode || packet.rtp.flags != 0)
+        for (k = 0; k < npkt; ++k)
         {
-            continue;
-        }
-        // SR
-        if (mode)
-        {
-            if (seqnum_is_in(packet.rtp.seq_num, seqnum_add(wbase, -wsize), wbase))
+            rtp_packet_t *packet = &pkts[k];
+            // data transfer terminated
+            if (packet->rtp.flags & RTP_FIN)
+            {
+                done = 1;
+                break;
+            }
+            // invalid packet
+            if (scodes[k] || packet->rtp.flags != 0)
             {
-                send_packet(sock, (struct sockaddr *)&addr,
-                            packet.rtp.seq_num, RTP_ACK, 0, NULL);
+                continue;
             }
-            else if (seqnum_is_in(packet.rtp.seq_num, wbase, seqnum_add(wbase, wsize)))
+            // SR
+            if (mode)
             {
-                mov = sqn_dis(wbase, packet.rtp.seq_num) + shift;
-                LOG_DEBUG("Receiver: recv packet %d\n", mov + 1);
-                memcpy((void *)buf + mov * PAYLOAD_MAX, (void *)packet.payload,
-                       packet.rtp.length);
-                if (fsize < mov * PAYLOAD_MAX + packet.rtp.length)
+                if (seqnum_is_in(packet->rtp.seq_num, seqnum_add(wbase, -wsize), wbase))
                 {
-                    fsize = mov * PAYLOAD_MAX + packet.rtp.length;
+                    queue_ack(packet->rtp.seq_num);
+                }
+                else if (seqnum_is_in(packet->rtp.seq_num, wbase, seqnum_add(wbase, wsize)))
+                {
+                    mov = sqn_dis(wbase, packet->rtp.seq_num) + shift;
+                    LOG_DEBUG("Receiver: recv packet %d\n", mov + 1);
+                    write_at(fd, packet->payload, packet->rtp.length, (off_t)mov * PAYLOAD_MAX);
+                    mov = update_window(window, wsize, mov - shift);
+                    shift += mov;
+                    wbase = seqnum_add(wbase, mov);
+                    queue_ack(packet->rtp.seq_num);
                 }
-                mov = update_window(window, wsize, mov - shift);
-                shift += mov;
-                wbase = seqnum_add(wbase, mov);
-                send_packet(sock, (struct sockaddr *)&addr,
-                            packet.rtp.seq_num, RTP_ACK, 0, NULL);
             }
-        }
-        // GBN
-        else
-        {
-            if (packet.rtp.seq_num == sqn)
+            // GBN
+            else
             {
-                LOG_DEBUG("Receiver: recv packet %d\n", shift + 1);
-                memcpy((void *)buf + (shift++) * PAYLOAD_MAX,
-                       (void *)packet.payload, packet.rtp.length);
-                fsize += packet.rtp.length;
-                sqn = seqnum_add(sqn, 1);
+                if (packet->rtp.seq_num == sqn)
+                {
+                    LOG_DEBUG("Receiver: recv packet %d\n", shift + 1);
+                    write_at(fd, packet->payload, packet->rtp.length, (off_t)(shift++) * PAYLOAD_MAX);
+                    sqn = seqnum_add(sqn, 1);
+                }
+                queue_ack(sqn);
             }
-            send_packet(sock, (struct sockaddr *)&addr, sqn, RTP_ACK, 0, NULL);
         }
+        flush_acks();
     }
 
     LOG_DEBUG("Receiver: stop receiving data\n");
-    write_file(filename, (void *)buf, fsize);
+    if (close(fd) < 0)
+    {
+        LOG_FATAL("close file error (w)\n");
+    }
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 5)
+    if (argc != 5 && argc != 6)
     {
         LOG_FATAL("Usage: ./receiver [listen port] [file path] [window size] "
-                  "[mode]\n");
+                  "[mode] [offload]\n");
     }
 
     int port, wsize, mode;
@@ -170,11 +202,19 @@ int main(int argc, char **argv)
     file_path = argv[2];
     wsize = atoi(argv[3]);
     mode = atoi(argv[4]);
+    offload = argc > 5 && atoi(argv[5]);
 
     if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
     {
         LOG_FATAL("create socket error\n");
     }
+    // a whole window of data, or of acks, can arrive at once
+    set_sock_recv_buf(sock, wsize);
+    if (offload && set_sock_gro(sock) < 0)
+    {
+        LOG_DEBUG("Receiver: no UDP GRO, receiving packets one by one\n");
+        offload = 0;
+    }
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
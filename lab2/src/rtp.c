@@ -1,4 +1,12 @@
+#define _GNU_SOURCE // sendmmsg, recvmmsg
 #include "rtp.h"
+#include <sys/uio.h>
+#include <netinet/udp.h>
+
+// full packets one UDP_SEGMENT send can carry, its payload staying under 64 KiB
+#define GSO_SEGS ((0xffff - 20 - 8) / (int)sizeof(rtp_packet_t))
+
+static int gso_failed; // the route turned GSO sends down, they are off
 
 const size_t RTP_HEADER_SIZE = sizeof(rtp_header_t);
 
@@ -22,20 +30,26 @@ void show_packet(rtp_packet_t *packet, int sendrecv)
     // LOG_DEBUG("* data: %s\n", packet->payload);
 }
 
-void send_packet(int fd, struct sockaddr *sa, uint32_t sqn,
-                 uint8_t flgs, int size, void *buf)
+int make_packet(rtp_packet_t *packet, uint32_t sqn, uint8_t flgs, int size, void *buf)
 {
-    rtp_packet_t packet;
-    packet.rtp.seq_num = sqn;
-    packet.rtp.length = (uint16_t)size;
-    packet.rtp.checksum = 0;
-    packet.rtp.flags = flgs;
+    packet->rtp.seq_num = sqn;
+    packet->rtp.length = (uint16_t)size;
+    packet->rtp.checksum = 0;
+    packet->rtp.flags = flgs;
     if (buf)
     {
-        memcpy((void *)packet.payload, buf, size);
+        memcpy((void *)packet->payload, buf, size);
     }
     int packet_size = size + RTP_HEADER_SIZE;
-    packet.rtp.checksum = compute_checksum(&packet, packet_size);
+    packet->rtp.checksum = compute_checksum(packet, packet_size);
+    return packet_size;
+}
+
+void send_packet(int fd, struct sockaddr *sa, uint32_t sqn,
+                 uint8_t flgs, int size, void *buf)
+{
+    rtp_packet_t packet;
+    int packet_size = make_packet(&packet, sqn, flgs, size, buf);
 
 #ifdef LDEBUG
     show_packet(&packet, 0);
@@ -47,29 +61,101 @@ void send_packet(int fd, struct sockaddr *sa, uint32_t sqn,
     }
 }
 
-int recv_packet(int fd, struct sockaddr *sa, socklen_t *len, rtp_packet_t *buf)
+int udp_gso_supported(int fd)
 {
-    int size = recvfrom(fd, (void *)buf, sizeof(*buf), 0, sa, len);
+    int size;
+    socklen_t len = sizeof(size);
+    return getsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &size, &len) == 0;
+}
 
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
-    {
-        errno = 0;
-        LOG_DEBUG("recv packet timeout\n");
-        return -2;
-    }
+int set_sock_gro(int fd)
+{
+    int on = 1;
+    return setsockopt(fd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on));
+}
 
-    if (size < 0)
+void send_packets(int fd, struct sockaddr *sa, rtp_packet_t *pkts, int n, int gso)
+{
+    struct mmsghdr msgs[MMSG_MAX];
+    struct iovec iovs[MMSG_MAX];
+    char ctrls[MMSG_MAX][CMSG_SPACE(sizeof(uint16_t))];
+    int sent = 0;
+
+    while (sent < n)
     {
-        LOG_FATAL("recv packet error\n");
+        int batch = 0, i = sent;
+        while (batch < MMSG_MAX && i < n)
+        {
+            // a run of full packets and whatever follows them is already one
+            // buffer in pkts, the kernel cuts it back into packets
+            int run = 0;
+            size_t bytes = 0;
+            do
+            {
+#ifdef LDEBUG
+                show_packet(&pkts[i + run], 0);
+#endif
+                bytes += pkts[i + run].rtp.length + RTP_HEADER_SIZE;
+                ++run;
+            } while (gso && !gso_failed && i + run < n && run < GSO_SEGS &&
+                     pkts[i + run - 1].rtp.length == PAYLOAD_MAX);
+
+            iovs[batch].iov_base = (void *)&pkts[i];
+            iovs[batch].iov_len = bytes;
+            memset(&msgs[batch].msg_hdr, 0, sizeof(msgs[batch].msg_hdr));
+            msgs[batch].msg_hdr.msg_name = sa;
+            msgs[batch].msg_hdr.msg_namelen = sizeof(*sa);
+            msgs[batch].msg_hdr.msg_iov = &iovs[batch];
+            msgs[batch].msg_hdr.msg_iovlen = 1;
+            if (run > 1)
+            {
+                struct cmsghdr *cm;
+                msgs[batch].msg_hdr.msg_control = ctrls[batch];
+                msgs[batch].msg_hdr.msg_controllen = sizeof(ctrls[batch]);
+                cm = CMSG_FIRSTHDR(&msgs[batch].msg_hdr);
+                cm->cmsg_level = IPPROTO_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                *(uint16_t *)CMSG_DATA(cm) = sizeof(rtp_packet_t);
+            }
+            ++batch;
+            i += run;
+        }
+        // a blocking socket may still take fewer than asked
+        int done = sendmmsg(fd, msgs, batch, 0);
+        if (done < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // no checksum offload on the way out, send packets one by one
+            if (gso && !gso_failed && (errno == EIO || errno == EINVAL))
+            {
+                LOG_DEBUG("UDP GSO send error, falling back\n");
+                gso_failed = 1;
+                continue;
+            }
+            LOG_FATAL("send packet error\n");
+        }
+        // all but the last packet of a message are full
+        for (i = 0; i < done; ++i)
+        {
+            sent += (iovs[i].iov_len + sizeof(rtp_packet_t) - 1) / sizeof(rtp_packet_t);
+        }
     }
+}
 
+// 0 if the size bytes in buf are a valid packet, -1 if not
+static int check_packet(rtp_packet_t *buf, int size)
+{
 #ifdef LDEBUG
     show_packet(buf, 1);
 #endif
 
     uint32_t cksm = buf->rtp.checksum;
     buf->rtp.checksum = 0;
-    if (cksm != compute_checksum(buf, size))
+    if (size < (int)RTP_HEADER_SIZE || cksm != compute_checksum(buf, size))
     {
         LOG_DEBUG("packet checksum error\n");
         return -1;
@@ -85,6 +171,127 @@ int recv_packet(int fd, struct sockaddr *sa, socklen_t *len, rtp_packet_t *buf)
     return 0;
 }
 
+int recv_packet(int fd, struct sockaddr *sa, socklen_t *len, rtp_packet_t *buf)
+{
+    int size = recvfrom(fd, (void *)buf, sizeof(*buf), 0, sa, len);
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+        errno = 0;
+        LOG_DEBUG("recv packet timeout\n");
+        return -2;
+    }
+
+    if (size < 0)
+    {
+        LOG_FATAL("recv packet error\n");
+    }
+
+    return check_packet(buf, size);
+}
+
+int recv_packets(int fd, struct sockaddr *sa, socklen_t *len,
+                 rtp_packet_t *bufs, int *scodes, int n, int gro)
+{
+    struct mmsghdr msgs[MMSG_MAX];
+    struct iovec iovs[MMSG_MAX];
+    struct sockaddr_storage names[MMSG_MAX];
+    char ctrls[MMSG_MAX][CMSG_SPACE(sizeof(int))];
+    // with GRO a message may hold GRO_SEGS packets, each gets room for that
+    int room = gro ? GRO_SEGS : 1;
+    int vlen = n / room, got, out = 0;
+
+    if (vlen > MMSG_MAX)
+    {
+        vlen = MMSG_MAX;
+    }
+    if (vlen == 0)
+    {
+        LOG_FATAL("recv packet buffers too small\n");
+    }
+    for (int i = 0; i < vlen; ++i)
+    {
+        iovs[i].iov_base = (void *)&bufs[i * room];
+        iovs[i].iov_len = sizeof(rtp_packet_t) * room;
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_name = &names[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(names[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (gro)
+        {
+            msgs[i].msg_hdr.msg_control = ctrls[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrls[i]);
+        }
+    }
+
+    // wait, up to the receive timeout, for the first packet only and take
+    // whatever else is already queued with it
+    while ((got = recvmmsg(fd, msgs, vlen, MSG_WAITFORONE, NULL)) < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            errno = 0;
+            LOG_DEBUG("recv packet timeout\n");
+            return -2;
+        }
+        if (errno != EINTR)
+        {
+            LOG_FATAL("recv packet error\n");
+        }
+    }
+
+    for (int i = 0; i < got; ++i)
+    {
+        int size = msgs[i].msg_len, seg = size, nseg = 1;
+        char *data = iovs[i].iov_base;
+        struct cmsghdr *cm;
+        for (cm = gro ? CMSG_FIRSTHDR(&msgs[i].msg_hdr) : NULL; cm; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm))
+        {
+            if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO)
+            {
+                memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+            }
+        }
+        if (seg > 0 && seg < size)
+        {
+            nseg = (size + seg - 1) / seg;
+        }
+        // cut coalesced packets apart, back to front as they only move up,
+        // then close the gap to the ones before
+        for (int k = nseg - 1; k >= 0; --k)
+        {
+            int ksize = k == nseg - 1 ? size - k * seg : seg;
+            if (ksize > (int)sizeof(rtp_packet_t))
+            {
+                ksize = sizeof(rtp_packet_t);
+            }
+            if (k > 0 && seg != (int)sizeof(rtp_packet_t))
+            {
+                memmove(&bufs[i * room + k], data + k * seg, ksize);
+            }
+            scodes[i * room + k] = ksize;
+        }
+        for (int k = 0; k < nseg; ++k)
+        {
+            if (out != i * room + k)
+            {
+                memmove(&bufs[out], &bufs[i * room + k], scodes[i * room + k]);
+            }
+            scodes[out] = check_packet(&bufs[out], scodes[i * room + k]);
+            ++out;
+        }
+    }
+    // replies go to whoever sent the last one, as with recv_packet
+    if (sa && got > 0)
+    {
+        socklen_t namelen = msgs[got - 1].msg_hdr.msg_namelen;
+        memcpy(sa, &names[got - 1], namelen < *len ? namelen : *len);
+        *len = namelen;
+    }
+    return out;
+}
+
 void set_sock_recv_time(int fd, int sec, int msec)
 {
     struct timeval tv;
@@ -95,4 +302,14 @@ void set_sock_recv_time(int fd, int sec, int msec)
     {
         LOG_FATAL("set socket recv timeout error\n");
     }
+}
+
+void set_sock_recv_buf(int fd, int npkt)
+{
+    // the kernel charges each datagram about twice its size
+    int bytes = npkt * (int)sizeof(rtp_packet_t) * 2;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) < 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    }
 }
\ No newline at end of file
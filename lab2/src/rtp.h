@@ -41,13 +41,39 @@ extern "C"
 
     void show_packet(rtp_packet_t *packet, int sendrecv);
 
+    // fill packet with a header and size bytes of buf, checksum included;
+    // returns the packet's size on the wire
+    int make_packet(rtp_packet_t *packet, uint32_t sqn, uint8_t flgs, int size, void *buf);
+
     void send_packet(int fd, struct sockaddr *sa, uint32_t sqn,
                      uint8_t flgs, int size, void *buf);
 
+    // send the n packets made in pkts, MMSG_MAX messages per sendmmsg; with
+    // gso, a run of full packets and the one after goes as a single
+    // UDP_SEGMENT message
+    void send_packets(int fd, struct sockaddr *sa, rtp_packet_t *pkts, int n, int gso);
+
     int recv_packet(int fd, struct sockaddr *sa, socklen_t *len, rtp_packet_t *buf);
 
+    // receive up to n packets with one recvmmsg, waiting only for the first;
+    // returns how many, each with its recv_packet code in scodes, or -2 on
+    // timeout; with gro, coalesced buffers are cut back into packets and n
+    // must be at least GRO_SEGS
+    int recv_packets(int fd, struct sockaddr *sa, socklen_t *len,
+                     rtp_packet_t *bufs, int *scodes, int n, int gro);
+
+    // whether the kernel can segment UDP sends on fd (UDP_SEGMENT)
+    int udp_gso_supported(int fd);
+
+    // have the kernel coalesce packets received on fd (UDP_GRO); 0 on success
+    int set_sock_gro(int fd);
+
     void set_sock_recv_time(int fd, int sec, int msec);
 
+    // make room in fd's receive buffer for a burst of npkt full packets,
+    // as far as the system allows
+    void set_sock_recv_buf(int fd, int npkt);
+
 #ifdef __cplusplus
 }
 #endif
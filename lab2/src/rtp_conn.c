@@ -0,0 +1,646 @@
+#include "rtp_conn.h"
+#include "rtp.h"
+#include "util.h"
+#include <poll.h>
+#include <time.h>
+
+#define RTO_MAX_MS  3000    // retransmission backoff cap
+#define WAIT_MAX_MS 30000   // blocking limit of sends without SO_SNDTIMEO
+#define RECV_QUEUE  (4 << 20) // in-order bytes held for the application
+#define CLOSE_TRIES 10
+#define FAST_SENT   0x80000000 // outside the 31 bit sequence space
+
+struct RtpConn
+{
+    int fd;
+    int wsize;
+    struct sockaddr_in peer;
+    int established;
+    int peer_closed; // the peer sent FIN
+    int fin_acked;
+    int failed;
+    int corked;
+    double loss;     // percent of packets dropped on purpose
+    unsigned int seed;
+
+    // sending: snd_base is the oldest unacked packet, held in slot snd_head
+    uint32_t snd_base, snd_next;
+    int snd_head;
+    rtp_packet_t *snd_pkts;
+    int *snd_acked;
+    uint32_t *snd_fast; // snd_next when last sent again early, | FAST_SENT
+    char partial[PAYLOAD_MAX];
+    int partial_len;
+    uint64_t rto_at; // when unacked packets are sent again, 0 if none
+    int rto_ms;
+
+    // receiving: rcv_base is the next packet in order, held in slot rcv_head
+    uint32_t rcv_base;
+    int rcv_head;
+    rtp_packet_t *rcv_pkts;
+    int *rcv_have;
+    char *queue;     // delivered bytes the application hasn't read
+    size_t qhead, qlen, qcap;
+
+    struct RtpConn *next; // accepted connections, to spot repeated SYNs
+};
+
+static rtp_conn_t *accepted = NULL;
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static rtp_conn_t *conn_new(int fd, int wsize, uint32_t isn)
+{
+    rtp_conn_t *c = calloc(1, sizeof(*c));
+    const char *loss = getenv("RTP_LOSS");
+    c->fd = fd;
+    c->wsize = wsize > 0 ? wsize : RTP_CONN_WINDOW;
+    c->loss = loss ? atof(loss) : 0;
+    c->seed = (unsigned int)now_ms() ^ (unsigned int)fd;
+    c->snd_base = c->snd_next = c->rcv_base = seqnum_add(isn, 1);
+    c->rto_ms = SEND_MS;
+    c->snd_pkts = malloc(c->wsize * sizeof(rtp_packet_t));
+    c->snd_acked = calloc(c->wsize, sizeof(int));
+    c->snd_fast = calloc(c->wsize, sizeof(uint32_t));
+    c->rcv_pkts = malloc(c->wsize * sizeof(rtp_packet_t));
+    c->rcv_have = calloc(c->wsize, sizeof(int));
+    c->qcap = RECV_QUEUE + (size_t)c->wsize * PAYLOAD_MAX;
+    c->queue = malloc(c->qcap);
+
+    // a window of datagrams, with the kernel's overhead for each, must fit
+    // in the socket buffers or overflowing them turns into timeouts
+    int bufsize = c->wsize * 4096;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    return c;
+}
+
+static void conn_free(rtp_conn_t *c)
+{
+    for (rtp_conn_t **p = &accepted; *p; p = &(*p)->next)
+    {
+        if (*p == c)
+        {
+            *p = c->next;
+            break;
+        }
+    }
+    close(c->fd);
+    free(c->snd_pkts);
+    free(c->snd_acked);
+    free(c->snd_fast);
+    free(c->rcv_pkts);
+    free(c->rcv_have);
+    free(c->queue);
+    free(c);
+}
+
+static void conn_fill(rtp_packet_t *p, uint32_t sqn, uint8_t flgs, const void *buf, int size)
+{
+    p->rtp.seq_num = sqn;
+    p->rtp.length = (uint16_t)size;
+    p->rtp.checksum = 0;
+    p->rtp.flags = flgs;
+    if (size > 0)
+    {
+        memcpy(p->payload, buf, size);
+    }
+    p->rtp.checksum = compute_checksum(p, sizeof(rtp_header_t) + size);
+}
+
+static void conn_xmit(rtp_conn_t *c, rtp_packet_t *p)
+{
+    if (c->loss > 0 && rand_r(&c->seed) % 10000 < c->loss * 100)
+    {
+        return;
+    }
+#ifdef LDEBUG
+    show_packet(p, 0);
+#endif
+    // a full socket buffer is a loss like any other
+    if (send(c->fd, p, sizeof(rtp_header_t) + p->rtp.length, 0) < 0 && errno == ECONNREFUSED)
+    {
+        c->failed = 1;
+    }
+}
+
+static void conn_ctl(rtp_conn_t *c, uint32_t sqn, uint8_t flgs)
+{
+    rtp_packet_t p;
+    conn_fill(&p, sqn, flgs, NULL, 0);
+    conn_xmit(c, &p);
+}
+
+// 0 if the n bytes received at p are an intact packet
+static int conn_check(rtp_packet_t *p, ssize_t n)
+{
+    if (n < (ssize_t)sizeof(rtp_header_t))
+    {
+        return -1;
+    }
+    uint32_t cksm = p->rtp.checksum;
+    p->rtp.checksum = 0;
+    if (cksm != compute_checksum(p, n))
+    {
+        LOG_DEBUG("packet checksum error\n");
+        return -1;
+    }
+    if (p->rtp.length > PAYLOAD_MAX || p->rtp.length + sizeof(rtp_header_t) != (size_t)n)
+    {
+        LOG_DEBUG("packet length error\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void conn_acked(rtp_conn_t *c, uint32_t sqn)
+{
+    int d = sqn_dis(c->snd_base, sqn);
+    if (d >= sqn_dis(c->snd_base, c->snd_next))
+    {
+        return;
+    }
+    c->snd_acked[(c->snd_head + d) % c->wsize] = 1;
+    if (d > 0)
+    {
+        // acks arrive in order unless packets were lost, so one sent three
+        // or more before this, or before its last early resend, goes again
+        // at once instead of on the timer
+        for (int i = 0; i + 3 <= d; ++i)
+        {
+            int slot = (c->snd_head + i) % c->wsize;
+            uint32_t fast = c->snd_fast[slot];
+            int from = fast ? sqn_dis(c->snd_base, fast & ~FAST_SENT) : i;
+            if (!c->snd_acked[slot] && from + 3 <= d)
+            {
+                conn_xmit(c, &c->snd_pkts[slot]);
+                c->snd_fast[slot] = c->snd_next | FAST_SENT;
+            }
+        }
+        return;
+    }
+    while (c->snd_base != c->snd_next && c->snd_acked[c->snd_head])
+    {
+        c->snd_acked[c->snd_head] = 0;
+        c->snd_head = (c->snd_head + 1) % c->wsize;
+        c->snd_base = seqnum_add(c->snd_base, 1);
+    }
+    // progress, the timer restarts from the base timeout
+    c->rto_ms = SEND_MS;
+    c->rto_at = c->snd_base == c->snd_next ? 0 : now_ms() + c->rto_ms;
+}
+
+static void conn_data(rtp_conn_t *c, rtp_packet_t *p)
+{
+    uint32_t sqn = p->rtp.seq_num;
+    int d = sqn_dis(c->rcv_base, sqn);
+    if (d >= c->wsize)
+    {
+        // delivered before, its ACK got lost
+        if (sqn_dis(sqn, c->rcv_base) <= c->wsize)
+        {
+            conn_ctl(c, sqn, RTP_ACK);
+        }
+        return;
+    }
+    // no room until the application reads, the sender will come back
+    if (c->qlen > RECV_QUEUE)
+    {
+        return;
+    }
+    int slot = (c->rcv_head + d) % c->wsize;
+    if (!c->rcv_have[slot])
+    {
+        memcpy(&c->rcv_pkts[slot], p, sizeof(rtp_header_t) + p->rtp.length);
+        c->rcv_have[slot] = 1;
+    }
+    conn_ctl(c, sqn, RTP_ACK);
+
+    while (c->rcv_have[c->rcv_head])
+    {
+        rtp_packet_t *q = &c->rcv_pkts[c->rcv_head];
+        if (c->qhead + c->qlen + q->rtp.length > c->qcap)
+        {
+            memmove(c->queue, c->queue + c->qhead, c->qlen);
+            c->qhead = 0;
+        }
+        memcpy(c->queue + c->qhead + c->qlen, q->payload, q->rtp.length);
+        c->qlen += q->rtp.length;
+        c->rcv_have[c->rcv_head] = 0;
+        c->rcv_head = (c->rcv_head + 1) % c->wsize;
+        c->rcv_base = seqnum_add(c->rcv_base, 1);
+    }
+}
+
+static void conn_handle(rtp_conn_t *c, rtp_packet_t *p)
+{
+    uint8_t flgs = p->rtp.flags;
+    if (flgs != RTP_SYN)
+    {
+        c->established = 1;
+    }
+    switch (flgs)
+    {
+    case 0:
+        conn_data(c, p);
+        break;
+    case RTP_ACK:
+        conn_acked(c, p->rtp.seq_num);
+        break;
+    case RTP_FIN:
+        // the FIN follows the last packet, with a hole before it the stream
+        // isn't complete yet and the peer sends it again
+        if (p->rtp.seq_num == c->rcv_base)
+        {
+            conn_ctl(c, p->rtp.seq_num, RTP_ACK | RTP_FIN);
+            c->peer_closed = 1;
+        }
+        break;
+    case RTP_ACK | RTP_FIN:
+        c->fin_acked = 1;
+        break;
+    case RTP_SYN:
+        // the SYN|ACK was lost, the peer is still connecting
+        conn_ctl(c, seqnum_add(p->rtp.seq_num, 1), RTP_ACK | RTP_SYN);
+        break;
+    case RTP_ACK | RTP_SYN:
+        // the handshake ACK was lost
+        conn_ctl(c, seqnum_add(p->rtp.seq_num, -1), RTP_ACK);
+        break;
+    }
+}
+
+// handle every packet waiting on the socket
+static void conn_drain(rtp_conn_t *c)
+{
+    rtp_packet_t p;
+    while (1)
+    {
+        ssize_t n = recv(c->fd, &p, sizeof(p), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            if (errno == ECONNREFUSED)
+            {
+                c->failed = 1;
+            }
+            break;
+        }
+        if (conn_check(&p, n) == 0)
+        {
+#ifdef LDEBUG
+            show_packet(&p, 1);
+#endif
+            conn_handle(c, &p);
+        }
+    }
+}
+
+// selective repeat: when the timer runs out every unacked packet goes
+// again and the timeout doubles until something is acked
+static void conn_retransmit(rtp_conn_t *c)
+{
+    if (c->rto_at == 0 || now_ms() < c->rto_at)
+    {
+        return;
+    }
+    int inflight = sqn_dis(c->snd_base, c->snd_next);
+    for (int i = 0; i < inflight; ++i)
+    {
+        int slot = (c->snd_head + i) % c->wsize;
+        if (!c->snd_acked[slot])
+        {
+            conn_xmit(c, &c->snd_pkts[slot]);
+            c->snd_fast[slot] = 0;
+        }
+    }
+    c->rto_ms = c->rto_ms * 2 < RTO_MAX_MS ? c->rto_ms * 2 : RTO_MAX_MS;
+    c->rto_at = now_ms() + c->rto_ms;
+}
+
+// wait for packets until deadline or the retransmission timer, then
+// handle what arrived and retransmit what is due
+static void conn_wait(rtp_conn_t *c, uint64_t deadline)
+{
+    uint64_t now = now_ms();
+    uint64_t until = c->rto_at && c->rto_at < deadline ? c->rto_at : deadline;
+    int ms = until > now ? (until - now < 1000 ? (int)(until - now) : 1000) : 0;
+    struct pollfd pfd = {c->fd, POLLIN, 0};
+    if (ms > 0)
+    {
+        poll(&pfd, 1, ms);
+    }
+    conn_drain(c);
+    conn_retransmit(c);
+}
+
+// when a blocking call on the socket gives up, after its SO_SNDTIMEO or
+// SO_RCVTIMEO, or after dflt ms if that is not set
+static uint64_t conn_deadline(rtp_conn_t *c, int optname, uint64_t dflt)
+{
+    struct timeval tv;
+    socklen_t len = sizeof(tv);
+    uint64_t ms = dflt;
+    if (getsockopt(c->fd, SOL_SOCKET, optname, &tv, &len) == 0 && (tv.tv_sec || tv.tv_usec))
+    {
+        ms = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+    return ms == UINT64_MAX ? UINT64_MAX : now_ms() + ms;
+}
+
+// the partial packet becomes the next one of the window, once there is room
+static int conn_send_partial(rtp_conn_t *c, uint64_t deadline)
+{
+    while (sqn_dis(c->snd_base, c->snd_next) >= c->wsize)
+    {
+        if (c->failed || now_ms() >= deadline)
+        {
+            return -1;
+        }
+        conn_wait(c, deadline);
+    }
+    int slot = (c->snd_head + sqn_dis(c->snd_base, c->snd_next)) % c->wsize;
+    conn_fill(&c->snd_pkts[slot], c->snd_next, 0, c->partial, c->partial_len);
+    c->snd_acked[slot] = 0;
+    c->snd_fast[slot] = 0;
+    conn_xmit(c, &c->snd_pkts[slot]);
+    if (c->rto_at == 0)
+    {
+        c->rto_at = now_ms() + c->rto_ms;
+    }
+    c->snd_next = seqnum_add(c->snd_next, 1);
+    c->partial_len = 0;
+    return 0;
+}
+
+int rtp_conn_listen(const char *ip, int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (fd < 0 || inet_pton(AF_INET, ip, &addr.sin_addr) != 1 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+rtp_conn_t *rtp_conn_accept(int listenfd, int wsize)
+{
+    rtp_packet_t p;
+    struct sockaddr_in peer, local;
+    socklen_t len = sizeof(peer);
+    ssize_t n = recvfrom(listenfd, &p, sizeof(p), MSG_DONTWAIT, (struct sockaddr *)&peer, &len);
+    if (n < 0 || conn_check(&p, n) < 0 || p.rtp.flags != RTP_SYN)
+    {
+        return NULL;
+    }
+    // a SYN repeated before the connection had its own socket
+    for (rtp_conn_t *c = accepted; c; c = c->next)
+    {
+        if (c->peer.sin_addr.s_addr == peer.sin_addr.s_addr && c->peer.sin_port == peer.sin_port)
+        {
+            return NULL;
+        }
+    }
+
+    // the kernel prefers a connected socket for packets from its peer, so
+    // the connection's socket can share the listening port
+    int one = 1;
+    len = sizeof(local);
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || getsockname(listenfd, (struct sockaddr *)&local, &len) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+        connect(fd, (struct sockaddr *)&peer, sizeof(peer)) < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    rtp_conn_t *c = conn_new(fd, wsize, p.rtp.seq_num);
+    c->peer = peer;
+    c->next = accepted;
+    accepted = c;
+
+    // the peer's ACK or its first data completes the handshake; this blocks
+    // the caller, a whole server reactor, for up to SEND_TR * SEND_MS
+    for (int tries = 0; tries < SEND_TR && !c->established && !c->failed; ++tries)
+    {
+        LOG_DEBUG("Accept: send conn reply packet (times: %d)\n", tries + 1);
+        conn_ctl(c, seqnum_add(p.rtp.seq_num, 1), RTP_ACK | RTP_SYN);
+        uint64_t deadline = now_ms() + SEND_MS;
+        while (!c->established && !c->failed && now_ms() < deadline)
+        {
+            conn_wait(c, deadline);
+        }
+    }
+    if (!c->established)
+    {
+        conn_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+rtp_conn_t *rtp_conn_connect(const char *ip, int port, int wsize)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (fd < 0 || inet_pton(AF_INET, ip, &addr.sin_addr) != 1 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    uint32_t isn = get_random_seqnum();
+    rtp_conn_t *c = conn_new(fd, wsize, isn);
+    c->peer = addr;
+
+    for (int tries = 0; tries < SEND_TR && !c->established && !c->failed; ++tries)
+    {
+        LOG_DEBUG("Connect: send conn packet (times: %d)\n", tries + 1);
+        conn_ctl(c, isn, RTP_SYN);
+        uint64_t deadline = now_ms() + SEND_MS;
+        while (!c->established && !c->failed && now_ms() < deadline)
+        {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            rtp_packet_t p;
+            ssize_t n;
+            if (poll(&pfd, 1, deadline - now_ms()) <= 0)
+            {
+                continue;
+            }
+            if ((n = recv(fd, &p, sizeof(p), MSG_DONTWAIT)) < 0)
+            {
+                c->failed = errno == ECONNREFUSED;
+                continue;
+            }
+            if (conn_check(&p, n) == 0 && p.rtp.flags == (RTP_ACK | RTP_SYN) &&
+                p.rtp.seq_num == seqnum_add(isn, 1))
+            {
+                c->established = 1;
+            }
+        }
+    }
+    if (!c->established)
+    {
+        conn_free(c);
+        return NULL;
+    }
+    // acknowledged with the SYN's number, which is outside the peer's window
+    conn_ctl(c, isn, RTP_ACK);
+    return c;
+}
+
+int rtp_conn_fd(rtp_conn_t *c)
+{
+    return c->fd;
+}
+
+ssize_t rtp_conn_send(rtp_conn_t *c, const void *buf, size_t n)
+{
+    const char *p = buf;
+    uint64_t deadline = conn_deadline(c, SO_SNDTIMEO, WAIT_MAX_MS);
+    for (size_t done = 0; done < n;)
+    {
+        if (c->failed)
+        {
+            return -1;
+        }
+        size_t m = n - done < (size_t)(PAYLOAD_MAX - c->partial_len) ? n - done
+                                                                     : (size_t)(PAYLOAD_MAX - c->partial_len);
+        memcpy(c->partial + c->partial_len, p + done, m);
+        c->partial_len += m;
+        done += m;
+        if (c->partial_len == PAYLOAD_MAX && conn_send_partial(c, deadline) < 0)
+        {
+            return -1;
+        }
+    }
+    return n;
+}
+
+void rtp_conn_push(rtp_conn_t *c)
+{
+    if (c->partial_len > 0 && !c->corked &&
+        conn_send_partial(c, conn_deadline(c, SO_SNDTIMEO, WAIT_MAX_MS)) < 0)
+    {
+        c->failed = 1;
+    }
+}
+
+void rtp_conn_cork(rtp_conn_t *c, int on)
+{
+    c->corked = on;
+    rtp_conn_push(c);
+}
+
+ssize_t rtp_conn_recv(rtp_conn_t *c, void *buf, size_t n)
+{
+    rtp_conn_push(c);
+    uint64_t deadline = conn_deadline(c, SO_RCVTIMEO, UINT64_MAX);
+    conn_drain(c);
+    while (c->qlen == 0 && !c->peer_closed && !c->failed)
+    {
+        if (now_ms() >= deadline)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        conn_wait(c, deadline);
+    }
+    if (c->qlen == 0)
+    {
+        return c->peer_closed ? 0 : -1;
+    }
+    if (n > c->qlen)
+    {
+        n = c->qlen;
+    }
+    memcpy(buf, c->queue + c->qhead, n);
+    c->qhead += n;
+    c->qlen -= n;
+    if (c->qlen == 0)
+    {
+        c->qhead = 0;
+    }
+    return n;
+}
+
+int rtp_conn_poll(rtp_conn_t *c)
+{
+    conn_drain(c);
+    conn_retransmit(c);
+    if (c->qlen > 0)
+    {
+        return c->qlen < INT32_MAX ? (int)c->qlen : INT32_MAX;
+    }
+    return c->peer_closed || c->failed ? -1 : 0;
+}
+
+int rtp_conn_timeout(rtp_conn_t *c)
+{
+    if (c->rto_at == 0)
+    {
+        return -1;
+    }
+    uint64_t now = now_ms();
+    return c->rto_at > now ? (int)(c->rto_at - now) : 0;
+}
+
+int rtp_conn_close(rtp_conn_t *c)
+{
+    c->corked = 0;
+    rtp_conn_push(c);
+
+    // the FIN tells the peer the stream is complete, so it goes out only
+    // once everything is acknowledged, waited for as long as a send would;
+    // a peer that closed first reads nothing more and may not ack either
+    uint64_t deadline = conn_deadline(c, SO_SNDTIMEO, WAIT_MAX_MS);
+    while (!c->failed && !c->peer_closed && c->snd_base != c->snd_next && now_ms() < deadline)
+    {
+        conn_wait(c, deadline);
+    }
+    int scode = c->failed || (!c->peer_closed && c->snd_base != c->snd_next) ? -1 : 0;
+
+    // a peer whose FIN was answered may be gone already
+    for (int tries = 0;
+         scode == 0 && tries < CLOSE_TRIES && !c->fin_acked && !c->peer_closed && !c->failed;
+         ++tries)
+    {
+        conn_ctl(c, c->snd_next, RTP_FIN);
+        deadline = now_ms() + SEND_MS;
+        while (!c->fin_acked && !c->failed && now_ms() < deadline)
+        {
+            conn_wait(c, deadline);
+        }
+    }
+    conn_free(c);
+    return scode;
+}
@@ -0,0 +1,66 @@
+#ifndef __RTP_CONN_H
+#define __RTP_CONN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // a reliable, ordered byte stream between two hosts made of the packets
+    // of rtp.h: selective repeat in both directions over one connected UDP
+    // socket, so it can carry a request/reply protocol like a TCP socket;
+    // RTP_LOSS=<percent> in the environment drops that share of the
+    // packets sent, to emulate a lossy link
+    typedef struct RtpConn rtp_conn_t;
+
+#define RTP_CONN_WINDOW 128 // default window in packets, each way
+
+    // a UDP socket for rtp_conn_accept bound to ip:port, -1 on error
+    int rtp_conn_listen(const char *ip, int port);
+
+    // answer the SYN waiting on listenfd; the connection gets a socket of
+    // its own bound to the same port and connected to the peer; blocks
+    // until the handshake completes or its retries run out
+    rtp_conn_t *rtp_conn_accept(int listenfd, int wsize);
+
+    rtp_conn_t *rtp_conn_connect(const char *ip, int port, int wsize);
+
+    // the socket to poll for the connection
+    int rtp_conn_fd(rtp_conn_t *conn);
+
+    // queue n bytes, full packets go out as the window allows and the rest
+    // waits for more data or rtp_conn_push; blocks while the window is full,
+    // up to the socket's SO_SNDTIMEO
+    ssize_t rtp_conn_send(rtp_conn_t *conn, const void *buf, size_t n);
+
+    // send the partial packet now, unless corked
+    void rtp_conn_push(rtp_conn_t *conn);
+
+    // while corked partial packets wait for data, uncorking pushes
+    void rtp_conn_cork(rtp_conn_t *conn, int on);
+
+    // up to n bytes, blocking for the first up to the socket's SO_RCVTIMEO;
+    // 0 once the peer has closed, -1 on timeout or failure
+    ssize_t rtp_conn_recv(rtp_conn_t *conn, void *buf, size_t n);
+
+    // handle the packets that arrived and retransmit what is due without
+    // blocking; the bytes rtp_conn_recv can return at once, or -1 if it
+    // would report the end of the connection
+    int rtp_conn_poll(rtp_conn_t *conn);
+
+    // milliseconds until a retransmission is due, -1 if nothing is unacked
+    int rtp_conn_timeout(rtp_conn_t *conn);
+
+    // flush, say goodbye and free the connection and its socket; -1 if
+    // data was still unacknowledged at the SO_SNDTIMEO deadline, in which
+    // case no FIN is sent and the peer doesn't take the stream as complete
+    int rtp_conn_close(rtp_conn_t *conn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RTP_CONN_H
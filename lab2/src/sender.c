@@ -1,10 +1,43 @@
+#define _GNU_SOURCE // ppoll
 #include "rtp.h"
 #include "util.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define RTO_MIN_US    2000
+#define RTO_MAX_US    3000000
+#define WHEEL_TICK_US 500
+#define WHEEL_SLOTS   1024
+#define WHEEL_WORDS   (WHEEL_SLOTS / 64)
 
 int sock;
 struct sockaddr_in addr;
 socklen_t addrlen;
 uint32_t sqn;
+int offload; // UDP GSO for data bursts
+
+// data packets on their way out, sent MMSG_MAX messages to a syscall
+rtp_packet_t batch[BATCH_MAX];
+int nbatch;
+
+// SR retransmission timers, one per packet in flight, in a hashed timer
+// wheel: a packet due at t hangs off bucket t / WHEEL_TICK_US % WHEEL_SLOTS
+// until it is acked or expires, so a bucket can hold later turns too
+struct timer_wheel
+{
+    int head[WHEEL_SLOTS]; // first packet slot in each bucket, -1 if none
+    uint64_t busy[WHEEL_WORDS]; // bit per bucket that has packets
+    int *next, *prev;      // bucket lists, by packet slot
+    uint64_t *due_us;      // 0 when not armed
+    uint64_t *sent_us;     // last time the packet went out
+    int *tries;            // times it was sent again
+    uint64_t tick;         // first tick not yet run
+} wheel;
+
+// Jacobson/Karels RTT estimate and the RTO from it, in microseconds
+int64_t srtt, rttvar, rto = SEND_MS * 1000;
 
 void establish_connection()
 {
@@ -80,83 +113,353 @@ void break_connection()
     LOG_DEBUG("Sender: connection stopped\n");
 }
 
+// payload bytes of packet ind of a file of fsize bytes
+int payload_size(off_t fsize, int ind)
+{
+    off_t left = fsize - (off_t)ind * PAYLOAD_MAX;
+    return left < PAYLOAD_MAX ? (int)left : PAYLOAD_MAX;
+}
+
+void flush_packets()
+{
+    send_packets(sock, (struct sockaddr *)&addr, batch, nbatch, offload);
+    nbatch = 0;
+}
+
+void queue_packet(uint32_t seqnum, int size, void *buf)
+{
+    make_packet(&batch[nbatch++], seqnum, 0, size, buf);
+    if (nbatch == BATCH_MAX)
+    {
+        flush_packets();
+    }
+}
+
+uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void timer_init(int wsize)
+{
+    for (int i = 0; i < WHEEL_SLOTS; ++i)
+    {
+        wheel.head[i] = -1;
+    }
+    for (int i = 0; i < WHEEL_WORDS; ++i)
+    {
+        wheel.busy[i] = 0;
+    }
+    wheel.next = malloc(wsize * sizeof(int));
+    wheel.prev = malloc(wsize * sizeof(int));
+    wheel.due_us = calloc(wsize, sizeof(uint64_t));
+    wheel.sent_us = calloc(wsize, sizeof(uint64_t));
+    wheel.tries = calloc(wsize, sizeof(int));
+    if (!wheel.next || !wheel.prev || !wheel.due_us || !wheel.sent_us || !wheel.tries)
+    {
+        LOG_FATAL("Sender: alloc timers error\n");
+    }
+    wheel.tick = now_us() / WHEEL_TICK_US;
+}
+
+void timer_free()
+{
+    free(wheel.next);
+    free(wheel.prev);
+    free(wheel.due_us);
+    free(wheel.sent_us);
+    free(wheel.tries);
+}
+
+void timer_cancel(int slot)
+{
+    if (!wheel.due_us[slot])
+    {
+        return;
+    }
+    int bucket = wheel.due_us[slot] / WHEEL_TICK_US % WHEEL_SLOTS;
+    int *link = wheel.prev[slot] < 0 ? &wheel.head[bucket] : &wheel.next[wheel.prev[slot]];
+    *link = wheel.next[slot];
+    if (wheel.next[slot] >= 0)
+    {
+        wheel.prev[wheel.next[slot]] = wheel.prev[slot];
+    }
+    if (wheel.head[bucket] < 0)
+    {
+        wheel.busy[bucket / 64] &= ~((uint64_t)1 << bucket % 64);
+    }
+    wheel.due_us[slot] = 0;
+}
+
+void timer_arm(int slot, uint64_t due)
+{
+    timer_cancel(slot);
+    int bucket = due / WHEEL_TICK_US % WHEEL_SLOTS;
+    int *head = &wheel.head[bucket];
+    wheel.busy[bucket / 64] |= (uint64_t)1 << bucket % 64;
+    wheel.due_us[slot] = due;
+    wheel.prev[slot] = -1;
+    wheel.next[slot] = *head;
+    if (*head >= 0)
+    {
+        wheel.prev[*head] = slot;
+    }
+    *head = slot;
+}
+
+// the packet in slot just went out, tries times after the first
+void timer_sent(int slot, int tries, uint64_t now)
+{
+    int64_t timeout = rto << (tries < 16 ? tries : 16);
+    wheel.sent_us[slot] = now;
+    wheel.tries[slot] = tries;
+    timer_arm(slot, now + (timeout < RTO_MAX_US ? timeout : RTO_MAX_US));
+}
+
+// take up to max packets due by now off the wheel into slots
+int timer_expired(uint64_t now, int *slots, int max)
+{
+    int n = 0;
+    uint64_t last = now / WHEEL_TICK_US;
+    // a bucket's packets from later turns stay, so one turn covers any gap
+    if (last - wheel.tick >= WHEEL_SLOTS)
+    {
+        wheel.tick = last - WHEEL_SLOTS + 1;
+    }
+    for (; wheel.tick <= last; ++wheel.tick)
+    {
+        int slot = wheel.head[wheel.tick % WHEEL_SLOTS];
+        while (slot >= 0)
+        {
+            int next = wheel.next[slot];
+            if (wheel.due_us[slot] <= now)
+            {
+                if (n == max)
+                {
+                    return n;
+                }
+                timer_cancel(slot);
+                slots[n++] = slot;
+            }
+            slot = next;
+        }
+    }
+    // the current tick has more to run once its time is up
+    wheel.tick = last;
+    return n;
+}
+
+// by when the next timer has gone off, 0 if none is armed: the end of the
+// first tick from wheel.tick whose bucket has packets, found in the busy
+// bits with at most WHEEL_WORDS + 1 word tests; that is up to a tick late,
+// and a bucket holding only later turns costs one early wakeup
+uint64_t timer_next()
+{
+    int first = wheel.tick % WHEEL_SLOTS;
+    for (int i = 0; i <= WHEEL_WORDS; ++i)
+    {
+        int word = (first / 64 + i) % WHEEL_WORDS;
+        uint64_t bits = wheel.busy[word];
+        // the word holding first is looked at from first on, then again
+        // up to it once the scan has come round
+        if (i == 0)
+        {
+            bits &= ~(uint64_t)0 << first % 64;
+        }
+        if (i == WHEEL_WORDS)
+        {
+            bits &= ((uint64_t)1 << first % 64) - 1;
+        }
+        if (bits)
+        {
+            int bucket = word * 64 + __builtin_ctzll(bits);
+            uint64_t t = wheel.tick + (bucket - first + WHEEL_SLOTS) % WHEEL_SLOTS;
+            return (t + 1) * WHEEL_TICK_US;
+        }
+    }
+    return 0;
+}
+
+// a packet sent once was acked rtt microseconds later (Karn: never one
+// that was sent again, its ack may be for either copy)
+void rtt_sample(int64_t rtt)
+{
+    if (!srtt)
+    {
+        srtt = rtt;
+        rttvar = rtt / 2;
+    }
+    else
+    {
+        rttvar = (3 * rttvar + (srtt > rtt ? srtt - rtt : rtt - srtt)) / 4;
+        srtt = (7 * srtt + rtt) / 8;
+    }
+    rto = srtt + (4 * rttvar > WHEEL_TICK_US ? 4 * rttvar : WHEEL_TICK_US);
+    rto = rto < RTO_MIN_US ? RTO_MIN_US : rto > RTO_MAX_US ? RTO_MAX_US : rto;
+}
+
+// wait for acks until the next timer is due; 0 if it went off first
+int wait_acks()
+{
+    uint64_t due = timer_next(), now = now_us();
+    struct pollfd pfd = {sock, POLLIN, 0};
+    struct timespec ts;
+    uint64_t wait = due > now ? due - now : 0;
+    if (!due)
+    {
+        wait = SEND_MS * 1000;
+    }
+    ts.tv_sec = wait / 1000000;
+    ts.tv_nsec = wait % 1000000 * 1000;
+    int n = ppoll(&pfd, 1, &ts, NULL);
+    if (n < 0 && errno != EINTR)
+    {
+        LOG_FATAL("Sender: poll error\n");
+    }
+    return n > 0;
+}
+
 void transfer_data(char *filename, int wsize, int mode)
 {
-    rtp_packet_t packet;
-    char buf[MAXBUF];
-    int fsize = read_file(filename, buf, MAXBUF);
-    int dsize, i, mov, scode, shift = 0, tsize = fsize % PAYLOAD_MAX;
+    rtp_packet_t acks[MMSG_MAX];
+    int scodes[MMSG_MAX];
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        LOG_FATAL("open file error (r)\n");
+    }
+    // only the packets of one window are held: the window is refilled
+    // once all of it is acked, and resends come from the same piece
+    char *buf = malloc((size_t)wsize * PAYLOAD_MAX);
+    if (buf == NULL)
+    {
+        LOG_FATAL("Sender: alloc window error\n");
+    }
+    off_t fsize = st.st_size;
     int npacket = (fsize + PAYLOAD_MAX - 1) / PAYLOAD_MAX;
-    int window[wsize];
+    int dsize, i, k, mov, nack, shift = 0, wstart = 0;
+    int window[wsize], expired[wsize];
     uint32_t wbase = sqn, seqnum;
+    uint64_t now;
 
     memset(window, 0, sizeof(window));
+    if (mode)
+    {
+        timer_init(wsize);
+    }
 
     set_sock_recv_time(sock, 0, SEND_MS);
     while (shift < npacket)
     {
         if (wbase == sqn)
         {
-            for (i = 0; i < wsize && i + shift < npacket; ++i)
+            wstart = shift;
+            int n = wsize < npacket - shift ? wsize : npacket - shift;
+            read_at(fd, buf, (size_t)n * PAYLOAD_MAX, (off_t)shift * PAYLOAD_MAX);
+            now = now_us();
+            for (i = 0; i < n; ++i)
             {
                 LOG_DEBUG("Sender: send packet [%d/%d]\n", shift + i + 1, npacket);
-                dsize = shift + i == npacket - 1 ? tsize : PAYLOAD_MAX;
-                send_packet(sock, (struct sockaddr *)&addr, sqn,
-                            0, dsize, (void *)buf + (shift + i) * PAYLOAD_MAX);
+                dsize = payload_size(fsize, shift + i);
+                queue_packet(sqn, dsize, buf + (size_t)i * PAYLOAD_MAX);
                 sqn = seqnum_add(sqn, 1);
+                if (mode)
+                {
+                    timer_sent((shift + i) % wsize, 0, now);
+                }
             }
+            flush_packets();
         }
-        scode = recv_packet(sock, (struct sockaddr *)&addr, &addrlen, &packet);
-        // wait for packet timeout
-        if (scode == -2)
+        // SR: only the packets whose own timers went off are sent again
+        if (mode)
         {
-            for (i = 0; seqnum_add(wbase, i) < sqn; ++i)
+            now = now_us();
+            int nexp = timer_expired(now, expired, wsize);
+            for (k = 0; k < nexp; ++k)
             {
-                if (mode && window[i])
-                {
-                    continue;
-                }
+                i = (expired[k] - shift % wsize + wsize) % wsize;
                 LOG_DEBUG("Sender: resend packet [%d/%d]\n", shift + i + 1, npacket);
-                dsize = shift + i == npacket - 1 ? tsize : PAYLOAD_MAX;
-                send_packet(sock, (struct sockaddr *)&addr, seqnum_add(wbase, i),
-                            0, dsize, (void *)buf + (shift + i) * PAYLOAD_MAX);
+                dsize = payload_size(fsize, shift + i);
+                queue_packet(seqnum_add(wbase, i), dsize,
+                             buf + (size_t)(shift - wstart + i) * PAYLOAD_MAX);
+                timer_sent(expired[k], wheel.tries[expired[k]] + 1, now);
+            }
+            flush_packets();
+            if (!wait_acks())
+            {
+                continue;
             }
-            continue;
-        }
-        // invalid packet
-        if (scode || packet.rtp.flags != RTP_ACK)
-        {
-            continue;
         }
-        seqnum = seqnum_add(packet.rtp.seq_num, -(mode ^ 1));
-        // dropout
-        if (!seqnum_is_in(seqnum, wbase, sqn))
+        nack = recv_packets(sock, (struct sockaddr *)&addr, &addrlen, acks, scodes, MMSG_MAX, 0);
+        // wait for packet timeout, GBN sends everything unacked again
+        if (nack == -2)
         {
+            for (i = 0; !mode && i < sqn_dis(wbase, sqn); ++i)
+            {
+                LOG_DEBUG("Sender: resend packet [%d/%d]\n", shift + i + 1, npacket);
+                dsize = payload_size(fsize, shift + i);
+                queue_packet(seqnum_add(wbase, i), dsize,
+                             buf + (size_t)(shift - wstart + i) * PAYLOAD_MAX);
+            }
+            flush_packets();
             continue;
         }
-        // SR
-        if (mode)
+        for (k = 0; k < nack; ++k)
         {
-            mov = update_window(window, wsize, sqn_dis(wbase, seqnum));
-        }
-        // GBN
-        else
-        {
-            mov = sqn_dis(wbase, seqnum) + 1;
+            // invalid packet
+            if (scodes[k] || acks[k].rtp.flags != RTP_ACK)
+            {
+                continue;
+            }
+            seqnum = seqnum_add(acks[k].rtp.seq_num, -(mode ^ 1));
+            // dropout
+            if (!seqnum_is_in(seqnum, wbase, sqn))
+            {
+                continue;
+            }
+            // SR
+            if (mode)
+            {
+                i = sqn_dis(wbase, seqnum);
+                if (!window[i])
+                {
+                    int slot = (shift + i) % wsize;
+                    if (!wheel.tries[slot])
+                    {
+                        rtt_sample(now_us() - wheel.sent_us[slot]);
+                    }
+                    timer_cancel(slot);
+                }
+                mov = update_window(window, wsize, i);
+            }
+            // GBN
+            else
+            {
+                mov = sqn_dis(wbase, seqnum) + 1;
+            }
+            shift += mov;
+            wbase = seqnum_add(wbase, mov);
         }
-        shift += mov;
-        wbase = seqnum_add(wbase, mov);
     }
 
+    if (mode)
+    {
+        timer_free();
+    }
+    free(buf);
+    close(fd);
     LOG_DEBUG("Sender: stop sending data\n");
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 6)
+    if (argc != 6 && argc != 7)
     {
         LOG_FATAL("Usage: ./sender [receiver ip] [receiver port] [file path] "
-                  "[window size] [mode]\n");
+                  "[window size] [mode] [offload]\n");
     }
 
     char *ip, *file_path;
@@ -167,11 +470,19 @@ int main(int argc, char **argv)
     file_path = argv[3];
     wsize = atoi(argv[4]);
     mode = atoi(argv[5]);
+    offload = argc > 6 && atoi(argv[6]);
 
     if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
     {
         LOG_FATAL("Sender: create socket error\n");
     }
+    // a whole window of data, or of acks, can arrive at once
+    set_sock_recv_buf(sock, wsize);
+    if (offload && !udp_gso_supported(sock))
+    {
+        LOG_DEBUG("Sender: no UDP GSO, sending packets one by one\n");
+        offload = 0;
+    }
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
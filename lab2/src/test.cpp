@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <thread>
@@ -104,8 +105,10 @@ void exe_name(char* name, size_t maxlen, bool is_sender, bool normal) {
 }
 
 // issn: is sender the normal version or the test version?
+// offload: UDP GSO/GRO for the normal version, an extra argument only when
+// given, as nullptr it ends the argument list where it always did
 int run_tests(const char* window_size, const char* err, const char* prob,
-              bool issn, bool opt) {
+              bool issn, bool opt, const char* offload = nullptr) {
     char sender_name[200];
     char receiver_name[200];
     char port_s[10];
@@ -126,7 +129,7 @@ int run_tests(const char* window_size, const char* err, const char* prob,
             }
         } else {
             if (execl(receiver_name, receiver_name, port_s, result, window_size,
-                      mode, nullptr) == -1) {
+                      mode, offload, nullptr) == -1) {
                 LOG_FATAL("Failed to execute the receiver\n");
             }
         }
@@ -134,7 +137,7 @@ int run_tests(const char* window_size, const char* err, const char* prob,
     if ((sender = fork()) == 0) {
         if (issn) {
             if (execl(sender_name, sender_name, "127.0.0.1", port_s, origin,
-                      window_size, mode, nullptr) == -1) {
+                      window_size, mode, offload, nullptr) == -1) {
                 LOG_FATAL("Failed to execute the sender\n");
             }
         } else {
@@ -151,10 +154,10 @@ int run_tests(const char* window_size, const char* err, const char* prob,
     return diff_file(origin, result);
 }
 
-void create_random(int megabytes) {
+void create_random(int megabytes, int extra = 0) {
     char cmd[200];
     std::snprintf(cmd, 200, "head -c %d < /dev/urandom > %s",
-                  megabytes * 1024 * 1024, origin);
+                  megabytes * 1024 * 1024 + extra, origin);
     system(cmd);
 }
 
@@ -271,3 +274,22 @@ TEST_F(RTP, OPT_SENDER_MIXED_2) {
     ASSERT_EQ(run_tests("16", "15", "30", true, true), 1);
 }
 
+TEST_F(RTP, OPT_SENDER_LOSS_RTO) {
+    // a lost packet is resent when its own RTO runs out; with one fixed
+    // 100 ms timeout for the window this took about 25 s
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ(run_tests("16", "1", "30", true, true), 1);
+    auto secs = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now() - start);
+    EXPECT_LT(secs.count(), 12);
+}
+
+
+/* ------------------------------ offload tests ----------------------------- */
+TEST_F(RTP, OFFLOAD_SHORT_TAIL) {
+    // 1437 packets: the last run of a 16 window is 13 long and ends in a
+    // short packet
+    create_random(2, 1000);
+    ASSERT_EQ(run_tests("16", "0", "0", true, true, "1"), 1);
+    ASSERT_EQ(run_tests("16", "0", "0", false, true, "1"), 1);
+}
@@ -2,22 +2,237 @@
 #include "time.h"
 #include "math.h"
 #include <string.h>
+#include <pthread.h>
 
-static uint32_t crc32_for_byte(uint32_t r)
+// the checksum is the usual reflected CRC-32 (0xEDB88320, register starting
+// at ~0 and complemented at the end), kernels below work on the register
+#define CRC32_POLY 0xEDB88320u
+
+static uint32_t crc_table[16][0x100];
+static crc32_kernel_t crc_kernels[8];
+static int crc_nkernels;
+static crc32_func_t crc_best;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t load_le32(const uint8_t *p)
+{
+    uint32_t w;
+    memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap32(w);
+#endif
+    return w;
+}
+
+static uint32_t crc32_bytewise(uint32_t crc, const void *data, size_t n_bytes)
+{
+    const uint8_t *p = data;
+    while (n_bytes--)
+    {
+        crc = crc_table[0][(uint8_t)crc ^ *p++] ^ crc >> 8;
+    }
+    return crc;
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const void *data, size_t n_bytes)
 {
-    for (int j = 0; j < 8; ++j)
-        r = (r & 1 ? 0 : (uint32_t)0xEDB88320L) ^ r >> 1;
-    return r ^ (uint32_t)0xFF000000L;
+    const uint8_t *p = data;
+    while (n_bytes >= 8)
+    {
+        uint32_t one = load_le32(p) ^ crc, two = load_le32(p + 4);
+        crc = crc_table[7][one & 0xff] ^ crc_table[6][(one >> 8) & 0xff] ^
+              crc_table[5][(one >> 16) & 0xff] ^ crc_table[4][one >> 24] ^
+              crc_table[3][two & 0xff] ^ crc_table[2][(two >> 8) & 0xff] ^
+              crc_table[1][(two >> 16) & 0xff] ^ crc_table[0][two >> 24];
+        p += 8;
+        n_bytes -= 8;
+    }
+    return crc32_bytewise(crc, p, n_bytes);
+}
+
+static uint32_t crc32_slice16(uint32_t crc, const void *data, size_t n_bytes)
+{
+    const uint8_t *p = data;
+    while (n_bytes >= 16)
+    {
+        uint32_t one = load_le32(p) ^ crc, two = load_le32(p + 4);
+        uint32_t three = load_le32(p + 8), four = load_le32(p + 12);
+        crc = crc_table[15][one & 0xff] ^ crc_table[14][(one >> 8) & 0xff] ^
+              crc_table[13][(one >> 16) & 0xff] ^ crc_table[12][one >> 24] ^
+              crc_table[11][two & 0xff] ^ crc_table[10][(two >> 8) & 0xff] ^
+              crc_table[9][(two >> 16) & 0xff] ^ crc_table[8][two >> 24] ^
+              crc_table[7][three & 0xff] ^ crc_table[6][(three >> 8) & 0xff] ^
+              crc_table[5][(three >> 16) & 0xff] ^ crc_table[4][three >> 24] ^
+              crc_table[3][four & 0xff] ^ crc_table[2][(four >> 8) & 0xff] ^
+              crc_table[1][(four >> 16) & 0xff] ^ crc_table[0][four >> 24];
+        p += 16;
+        n_bytes -= 16;
+    }
+    return crc32_slice8(crc, p, n_bytes);
 }
 
-static void crc32(const void *data, size_t n_bytes, uint32_t *crc)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// folds 64 bytes at a time with carry-less multiplies and Barrett-reduces the
+// remainder (Gopal et al., "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ"), what is left past the last 16 bytes goes to slice-by-8
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const void *data, size_t n_bytes)
 {
-    static uint32_t table[0x100];
-    if (!*table)
-        for (size_t i = 0; i < 0x100; ++i)
-            table[i] = crc32_for_byte(i);
-    for (size_t i = 0; i < n_bytes; ++i)
-        *crc = table[(uint8_t)*crc ^ ((uint8_t *)data)[i]] ^ *crc >> 8;
+    const uint8_t *p = data;
+    if (n_bytes < 64)
+    {
+        return crc32_slice8(crc, p, n_bytes);
+    }
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p), _mm_cvtsi32_si128(crc));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 16));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 32));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 48));
+    p += 64;
+    n_bytes -= 64;
+
+    while (n_bytes >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)p));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 48)));
+        p += 64;
+        n_bytes -= 64;
+    }
+
+    // four lanes into one
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (n_bytes >= 16)
+    {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+        p += 16;
+        n_bytes -= 16;
+    }
+
+    // 128 bits to 64
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = _mm_extract_epi32(x1, 1);
+
+    return crc32_slice8(crc, p, n_bytes);
+}
+#endif
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+
+// the ARMv8 CRC32 instructions use this very polynomial
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const void *data, size_t n_bytes)
+{
+    const uint8_t *p = data;
+    while (n_bytes >= 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        crc = __crc32d(crc, w);
+        p += 8;
+        n_bytes -= 8;
+    }
+    while (n_bytes--)
+    {
+        crc = __crc32b(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static void add_kernel(const char *name, crc32_func_t func)
+{
+    crc_kernels[crc_nkernels].name = name;
+    crc_kernels[crc_nkernels++].func = func;
+    crc_best = func;
+}
+
+// build the tables and pick the fastest kernel this CPU runs, once
+static void crc32_init()
+{
+    for (uint32_t i = 0; i < 0x100; ++i)
+    {
+        uint32_t r = i;
+        for (int j = 0; j < 8; ++j)
+        {
+            r = (r & 1 ? CRC32_POLY : 0) ^ r >> 1;
+        }
+        crc_table[0][i] = r;
+    }
+    for (int k = 1; k < 16; ++k)
+    {
+        for (int i = 0; i < 0x100; ++i)
+        {
+            crc_table[k][i] = crc_table[k - 1][i] >> 8 ^ crc_table[0][crc_table[k - 1][i] & 0xff];
+        }
+    }
+
+    add_kernel("bytewise", crc32_bytewise);
+    add_kernel("slice-by-8", crc32_slice8);
+    add_kernel("slice-by-16", crc32_slice16);
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+    {
+        add_kernel("pclmul", crc32_pclmul);
+    }
+#endif
+#if defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+    {
+        add_kernel("armv8-crc", crc32_armv8);
+    }
+#endif
+}
+
+const crc32_kernel_t *crc32_kernels(int *n)
+{
+    pthread_once(&crc_once, crc32_init);
+    *n = crc_nkernels;
+    return crc_kernels;
 }
 
 // Computes checksum for `n_bytes` of data
@@ -31,9 +246,8 @@ static void crc32(const void *data, size_t n_bytes, uint32_t *crc)
 // data packet.
 uint32_t compute_checksum(const void *pkt, size_t n_bytes)
 {
-    uint32_t crc = 0;
-    crc32(pkt, n_bytes, &crc);
-    return crc;
+    pthread_once(&crc_once, crc32_init);
+    return ~crc_best(~0u, pkt, n_bytes);
 }
 
 int read_file(char *filename, void *buf, int size)
@@ -90,6 +304,39 @@ void write_file(char *filename, void *buf, int size)
     }
 }
 
+ssize_t read_at(int fd, void *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pread(fd, (char *)buf + done, size - done, offset + done);
+        if (n < 0)
+        {
+            LOG_FATAL("read file error\n");
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+void write_at(int fd, const void *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pwrite(fd, (const char *)buf + done, size - done, offset + done);
+        if (n < 0)
+        {
+            LOG_FATAL("write file error\n");
+        }
+        done += n;
+    }
+}
+
 uint32_t get_random_seqnum()
 {
     return INT32_MAX;
@@ -107,7 +354,8 @@ int sqn_dis(uint32_t l, uint32_t r)
 
 int seqnum_is_in(uint32_t seqnum, uint32_t l, uint32_t r)
 {
-    if (l < r)
+    // [l, l) is empty, not the whole sequence space
+    if (l <= r)
     {
         return seqnum >= l && seqnum < r;
     }
@@ -14,10 +14,29 @@ extern "C"
 
     uint32_t compute_checksum(const void *pkt, size_t n_bytes);
 
+    // a CRC-32 kernel: crc, the register, updated with n_bytes of data; it
+    // starts at ~0 and the checksum is its complement
+    typedef uint32_t (*crc32_func_t)(uint32_t crc, const void *data, size_t n_bytes);
+
+    typedef struct
+    {
+        const char *name;
+        crc32_func_t func;
+    } crc32_kernel_t;
+
+    // the kernels this CPU can run, slowest first; compute_checksum uses the last
+    const crc32_kernel_t *crc32_kernels(int *n);
+
     int read_file(char *filename, void *buf, int size);
 
     void write_file(char *filename, void *buf, int size);
 
+    // read size bytes of fd at offset, fewer only at the end of the file
+    ssize_t read_at(int fd, void *buf, size_t size, off_t offset);
+
+    // write all size bytes of buf to fd at offset
+    void write_at(int fd, const void *buf, size_t size, off_t offset);
+
     uint32_t get_random_seqnum();
 
     // logically add addnum to seqnum